@@ -27,6 +27,8 @@ C_DEPS :=
 C_UPPER_DEPS := 
 EXECUTABLES := 
 OBJS := 
+BENCHMARK_SRCS := 
+BENCHMARK_OBJS := 
 
 # Every subdirectory with source files must be described here
 SUBDIRS := \
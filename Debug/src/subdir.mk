@@ -12,6 +12,15 @@ CPP_DEPS += \
 OBJS += \
 ./src/launchTests.o 
 
+BENCHMARK_SRCS += \
+../src/LuanchBenchMarks.cpp 
+
+CPP_DEPS += \
+./src/LuanchBenchMarks.d 
+
+BENCHMARK_OBJS += \
+./src/LuanchBenchMarks.o 
+
 
 # Each subdirectory must supply rules for building sources it contributes
 src/%.o: ../src/%.cpp src/subdir.mk
@@ -21,11 +30,19 @@ src/%.o: ../src/%.cpp src/subdir.mk
 	@echo 'Finished building: $<'
 	@echo ' '
 
+# the benchmarks are timed, so they are built optimized even in the Debug configuration
+src/LuanchBench%.o: ../src/LuanchBench%.cpp src/subdir.mk
+	@echo 'Building file: $<'
+	@echo 'Invoking: Cross G++ Compiler'
+	g++ -O2 -g -Wall -c -fmessage-length=0 -std=c++1z -MMD -MP -MF"$(@:%.o=%.d)" -MT"$@" -o "$@" "$<"
+	@echo 'Finished building: $<'
+	@echo ' '
+
 
 clean: clean-src
 
 clean-src:
-	-$(RM) ./src/launchTests.d ./src/launchTests.o
+	-$(RM) ./src/LuanchBenchMarks.d ./src/LuanchBenchMarks.o ./src/launchTests.d ./src/launchTests.o
 
 .PHONY: clean-src
 
@@ -438,7 +438,7 @@ void AllocatorExample() {
 
 	inFileAllocator::detail::FileMemoryManagerHandler handler(3, 0,
 			inFileAllocator::detail::pageSize * 100);
-	handler.setDefCstr();
+	inFileAllocator::detail::heaps::scope scope(handler.getManager());
 
 	inFileAllocator::detail::fileAllocator<char> alloc;
 
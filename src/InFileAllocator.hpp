@@ -18,6 +18,32 @@
 #include<ctime>
 #include <type_traits>
 #include <limits>
+#include <fstream>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <memory_resource>
+#include <thread>
+#include <exception>
+#include <deque>
+#include <algorithm>
+
+#if defined(__SANITIZE_ADDRESS__)
+#define INFILEALLOCATOR_ASAN 1
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define INFILEALLOCATOR_ASAN 1
+#endif
+#endif
+#ifdef INFILEALLOCATOR_ASAN
+#include <sanitizer/asan_interface.h>
+#define INFILEALLOCATOR_NO_ASAN __attribute__((no_sanitize_address))
+#else
+#define INFILEALLOCATOR_NO_ASAN
+#endif
 
 namespace inFileAllocator {
 
@@ -29,6 +55,7 @@ static_assert(sizeof(Forceduint8_t)==1);
 
 //system dependent
 const size_t pageSize = 4096;
+const size_t cacheLineSize = 64;
 
 // compiler dependent
 template<size_t size>
@@ -46,35 +73,22 @@ constexpr bool isPowerOf2<0> = false;
 template<size_t size>
 union MemBlock;
 
+// list links of a free block, whether a block is free is kept in the free map of MemoryFileHandler
 template<size_t size>
 struct UnusedMemBlock {
-	static inline constexpr size_t marker1Hash = 5747124830538865000;
-	size_t unusedMarker1 = marker1Hash;
 	MemBlock<size> *next = nullptr;
 	MemBlock<size> *prev = nullptr;
-	size_t spanPower = 0;
-
-	bool isNotUsed() {
-		return unusedMarker1 == marker1Hash; // && unusedMarker2 == marker2Hash;
-	}
-
-	void setUnused(size_t spanPow) {
-		next = nullptr;
-		prev = nullptr;
-		unusedMarker1 = marker1Hash;
-		spanPower = spanPow;
-	}
 
 	void setUsed() {
-		unusedMarker1 = 0;
 		next = nullptr;
 		prev = nullptr;
-		spanPower = 0;
 	}
 
+	// buddies pair up relative to the first data page, the mapping itself is 64KiB aligned
 	static MemBlock<size>* interBuddyAdress(UnusedMemBlock<size> *ptr) {
-		return reinterpret_cast<MemBlock<size>*>(reinterpret_cast<size_t>(ptr)
-				^ static_cast<size_t>(1) << sizeToPowIndex<size - 1> );
+		return reinterpret_cast<MemBlock<size>*>(((reinterpret_cast<size_t>(ptr)
+				- pageSize) ^ static_cast<size_t>(1) << sizeToPowIndex<size - 1>)
+				+ pageSize);
 	}
 
 	MemBlock<size>* buddyAdress() {
@@ -117,39 +131,538 @@ void ensureFileSize(const int &_fd, const size_t &_size) {
 	}
 }
 
+constexpr size_t IndexOffset = 5;
+
+namespace stats {
+
+constexpr size_t classCount = 63 - IndexOffset;
+
+// written by one thread only, so relaxed load+store is enough and avoids a locked add
+struct counter {
+	std::atomic<uint64_t> value { 0 };
+
+	void add(uint64_t n = 1) {
+		value.store(value.load(std::memory_order_relaxed) + n,
+				std::memory_order_relaxed);
+	}
+
+	uint64_t get() const {
+		return value.load(std::memory_order_relaxed);
+	}
+
+	void clear() {
+		value.store(0, std::memory_order_relaxed);
+	}
+};
+
+// counters of one thread for one heap, splits and merges are counted at the class of the bigger block
+struct block {
+	const void *owner = nullptr;
+	bool retired = false;
+	counter allocations[classCount];
+	counter deallocations[classCount];
+	counter splits[classCount];
+	counter merges[classCount];
+	counter freePagesCalls;
+	counter pagesHandedOut;
+
+	void clear() {
+		for (size_t i = 0; i < classCount; ++i) {
+			allocations[i].clear();
+			deallocations[i].clear();
+			splits[i].clear();
+			merges[i].clear();
+		}
+		freePagesCalls.clear();
+		pagesHandedOut.clear();
+	}
+};
+
+class registry {
+	std::mutex mutex;
+	std::list<block> blocks;
+
+public:
+	static registry& instance() {
+		static registry reg;
+		return reg;
+	}
+
+	// counters are cumulative, so a block left by an exited thread can be continued by a new one
+	block* acquire(const void *owner) {
+		std::lock_guard<std::mutex> lock(mutex);
+		for (auto &b : blocks) {
+			if (b.retired && b.owner == owner) {
+				b.retired = false;
+				return &b;
+			}
+		}
+		blocks.emplace_back();
+		blocks.back().owner = owner;
+		return &blocks.back();
+	}
+
+	void retire(block *b) {
+		std::lock_guard<std::mutex> lock(mutex);
+		b->retired = true;
+	}
+
+	// Counts of a heap that was reset or unmapped, so a heap mapped at the same address later
+	// starts from zero. Threads keep their blocks, the heap must not be in use meanwhile.
+	void clear(const void *owner) {
+		std::lock_guard<std::mutex> lock(mutex);
+		for (auto &b : blocks) {
+			if (b.owner == owner) {
+				b.clear();
+			}
+		}
+	}
+
+	void forOwner(const void *owner, const std::function<void(const block&)> &func) {
+		std::lock_guard<std::mutex> lock(mutex);
+		for (auto &b : blocks) {
+			if (b.owner == owner) {
+				func(b);
+			}
+		}
+	}
+};
+
+struct threadCache {
+	const void *owner = nullptr;
+	block *current = nullptr;
+	std::vector<block*> blocks;
+
+	~threadCache() {
+		for (block *b : blocks) {
+			registry::instance().retire(b);
+		}
+	}
+};
+
+inline thread_local threadCache cache;
+
+// the counters of owner for this thread, owner is the address the heap is mapped at
+inline block& local(const void *owner) {
+	if (cache.owner == owner) {
+		return *cache.current;
+	}
+	block *found = nullptr;
+	for (block *b : cache.blocks) {
+		if (b->owner == owner) {
+			found = b;
+			break;
+		}
+	}
+	if (found == nullptr) {
+		found = registry::instance().acquire(owner);
+		cache.blocks.push_back(found);
+	}
+	cache.owner = owner;
+	cache.current = found;
+	return *found;
+}
+
+}
+
+namespace tracing {
+
+// Receives every allocate/deallocate of every heap while it is installed, see inFileTrace.hpp.
+struct sink {
+	virtual void onAllocate(const void *owner, const void *ptr, size_t size) = 0;
+	virtual void onDeallocate(const void *owner, const void *ptr,
+			size_t size) = 0;
+	virtual ~sink() = default;
+};
+
+inline std::atomic<sink*> activeSink { nullptr };
+
+// one relaxed load when no sink is installed
+inline void allocated(const void *owner, const void *ptr, size_t size) {
+	if (sink *s = activeSink.load(std::memory_order_relaxed)) {
+		s->onAllocate(owner, ptr, size);
+	}
+}
+
+inline void deallocated(const void *owner, const void *ptr, size_t size) {
+	if (sink *s = activeSink.load(std::memory_order_relaxed)) {
+		s->onDeallocate(owner, ptr, size);
+	}
+}
+
+}
+
+namespace numa {
+
+// values from linux/mempolicy.h
+constexpr int preferredPolicy = 1;
+constexpr size_t maxNodes = 64;
+
+// pages handed out by getFreePages on this thread are bound to this node, -1 for no binding
+inline thread_local int pageBindNode = -1;
+
+inline size_t nodeCount() {
+	static const size_t count = []() -> size_t {
+		std::ifstream online("/sys/devices/system/node/online");
+		std::string ranges;
+		if (!(online >> ranges)) {
+			return 1;
+		}
+		size_t pos = ranges.find_last_of("-,");
+		size_t last = std::stoul(
+				pos == std::string::npos ? ranges : ranges.substr(pos + 1));
+		return std::min(last + 1, maxNodes);
+	}();
+	return count;
+}
+
+// node of the cpu this thread first asked from, cached per thread
+inline int threadNode() {
+	static thread_local int node = []() {
+		unsigned int cpu = 0;
+		unsigned int nodeOfCpu = 0;
+		if (syscall(SYS_getcpu, &cpu, &nodeOfCpu, nullptr) != 0) {
+			return 0;
+		}
+		return static_cast<int>(nodeOfCpu);
+	}();
+	return node;
+}
+
+// best effort, returns false when the kernel has no numa support or the node does not exist
+inline bool bindPreferred(void *adr, size_t len, int node) {
+	if (node < 0 || static_cast<size_t>(node) >= maxNodes) {
+		return false;
+	}
+	unsigned long mask = 1ul << node;
+	return syscall(SYS_mbind, adr, len, preferredPolicy, &mask, maxNodes + 1,
+			0) == 0;
+}
+
+struct scopedBinding {
+	int previous;
+	scopedBinding(int node) :
+			previous(pageBindNode) {
+		pageBindNode = node;
+	}
+	~scopedBinding() {
+		pageBindNode = previous;
+	}
+};
+
+}
+
+// Extents of heap files written since the last heapChecksums commit, one bit per extent of
+// 2^extentPow bytes. Kept outside of the heaps, so tracking never changes what it tracks.
+namespace dirtyTracking {
+
+struct tracker {
+	std::atomic<const Forceduint8_t*> heap { nullptr };
+	// writers inside mark, detach waits for them before the extents are freed
+	std::atomic<size_t> marking { 0 };
+	std::atomic<uint64_t> *extents = nullptr;
+	size_t extentPow = 0;
+
+	void mark(size_t offset, size_t len) {
+		size_t last = (offset + len - 1) >> extentPow;
+		for (size_t extent = offset >> extentPow; extent <= last; ++extent) {
+			auto &word = extents[extent / 64];
+			uint64_t bit = static_cast<uint64_t>(1) << (extent % 64);
+			if ((word.load(std::memory_order_relaxed) & bit) == 0) {
+				word.fetch_or(bit);
+			}
+		}
+	}
+};
+
+constexpr size_t maxTrackers = 8;
+inline tracker trackers[maxTrackers];
+inline std::atomic<size_t> activeTrackers { 0 };
+inline std::mutex trackersMutex;
+
+// Heaps are told apart by the address they are mapped at. A writer announces itself before
+// it checks the heap again, so detach either sees it or it sees the cleared heap.
+inline void mark(const Forceduint8_t *heap, size_t offset, size_t len) {
+	if (activeTrackers.load(std::memory_order_relaxed) == 0) {
+		return;
+	}
+	for (auto &t : trackers) {
+		if (t.heap.load(std::memory_order_relaxed) != heap) {
+			continue;
+		}
+		t.marking.fetch_add(1);
+		if (t.heap.load() == heap) {
+			t.mark(offset, len);
+		}
+		t.marking.fetch_sub(1, std::memory_order_release);
+		return;
+	}
+}
+
+inline tracker* attach(const Forceduint8_t *heap,
+		std::atomic<uint64_t> *extents, size_t extentPow) {
+	std::lock_guard<std::mutex> lock(trackersMutex);
+	for (auto &t : trackers) {
+		if (t.heap.load() == heap) {
+			throw std::runtime_error("the heap is tracked already");
+		}
+	}
+	for (auto &t : trackers) {
+		if (t.heap.load() == nullptr) {
+			t.extents = extents;
+			t.extentPow = extentPow;
+			t.heap.store(heap, std::memory_order_release);
+			activeTrackers.fetch_add(1);
+			return &t;
+		}
+	}
+	throw std::runtime_error("too many tracked heaps");
+}
+
+inline void detach(tracker *t) {
+	std::lock_guard<std::mutex> lock(trackersMutex);
+	t->heap.store(nullptr);
+	activeTrackers.fetch_sub(1);
+	while (t->marking.load(std::memory_order_acquire) != 0) {
+		std::this_thread::yield();
+	}
+}
+
+}
+
+// Order in which freed blocks are handed out again. lifo takes the block freed last, which
+// is likely still in cache; fifo the one freed first; addressOrdered the lowest free block,
+// which keeps the heap compact but walks the free list on every free.
+enum class reusePolicy : uint8_t {
+	lifo, fifo, addressOrdered
+};
+
 struct MemoryFileHandler {
 	int fd;
 	size_t mappedMemSize;
-	size_t size = pageSize;
 	Forceduint8_t *dataAdress = 0;
+	// address space this process reserved for blocks, mappedMemSize grows up to it
+	size_t reservedMemSize;
+	reusePolicy reuse = reusePolicy::lifo;
+	// end of the used part of the file, moved by every block taken from fresh pages, so it
+	// gets a cache line of its own
+	alignas(cacheLineSize) size_t size = pageSize;
+
+	// Free state of the blocks below 64KiB, so merging never reads a buddy to learn it is in
+	// use. Every 64KiB chunk has 4096 bits, the block of 2^p bytes at index i of its chunk
+	// has bit 2^(16-p) + i. The first chunks are kept in the header, the others in a table
+	// of pages from the end of the file, which doubles when the heap outgrows it.
+	static constexpr size_t chunkPow = 16;
+	static constexpr size_t chunkMapWords = pow2<chunkPow - IndexOffset + 1>
+			/ 64;
+	static constexpr size_t headerChunks = 4;
+	alignas(cacheLineSize) uint64_t headerFreeMap[headerChunks][chunkMapWords] = { };
+	uint64_t (*freeMap)[chunkMapWords] = nullptr;
+	size_t freeMapChunks = 0;
+	// pages taken for tables so far, replaced ones included
+	size_t freeMapBytes = 0;
+	// chunk the map starts at, sub-heaps map only their own range
+	size_t freeMapFirstChunk = 0;
 
 	MemoryFileHandler(int _fd, Forceduint8_t *_adr, size_t _mappedMemSize) :
-			fd(_fd), mappedMemSize(_mappedMemSize), dataAdress(_adr) {
+			fd(_fd), mappedMemSize(_mappedMemSize), dataAdress(_adr), reservedMemSize(
+					_mappedMemSize) {
+	}
+
+	// maps more of the file over the PROT_NONE reservation, at least doubling the mapping
+	void grow(size_t needed) {
+		size_t newSize = std::min(std::max(mappedMemSize * 2, needed),
+				reservedMemSize);
+		void *adr = mmap(dataAdress + pageSize + mappedMemSize,
+				newSize - mappedMemSize, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_NORESERVE | MAP_FIXED, fd,
+				pageSize + mappedMemSize);
+		if (adr == MAP_FAILED) {
+			throw std::runtime_error("failed to grow the heap mapping");
+		}
+		mappedMemSize = newSize;
 	}
 
 	void reset() {
+		touchedRange(dataAdress, size);
 		size = pageSize;
 		ftruncate(fd, pageSize);
+		memset(headerFreeMap, 0, sizeof(headerFreeMap));
+		freeMap = nullptr;
+		freeMapChunks = 0;
+		freeMapBytes = 0;
+	}
+
+	// the table only ever takes whole chunks, so blocks of 64KiB and up stay chunk aligned;
+	// the old table is punched out and its pages stay in use
+	void growFreeMap(size_t chunks) {
+		constexpr size_t perChunk = chunkMapWords * sizeof(uint64_t);
+		constexpr size_t chunksPerStep = pow2<chunkPow> / perChunk;
+		size_t newChunks = std::max(chunks, freeMapChunks * 2);
+		newChunks = (newChunks + chunksPerStep - 1) / chunksPerStep
+				* chunksPerStep;
+		auto *newMap = static_cast<uint64_t (*)[chunkMapWords]>(getFreePages(
+				newChunks * perChunk / pageSize));
+		if (freeMap != nullptr) {
+			memcpy(newMap, freeMap, freeMapChunks * perChunk);
+			punchHole(freeMap, freeMapChunks * perChunk);
+		}
+		touchedRange(newMap, newChunks * perChunk);
+		memset(newMap + freeMapChunks, 0,
+				(newChunks - freeMapChunks) * perChunk);
+		freeMap = newMap;
+		freeMapChunks = newChunks;
+		freeMapBytes += newChunks * perChunk;
+	}
+
+	template<size_t pow>
+	bool isFree(const void *block) {
+		size_t offset = static_cast<const Forceduint8_t*>(block)
+				- (dataAdress + pageSize);
+		size_t chunk = (offset >> chunkPow) - freeMapFirstChunk;
+		uint64_t *map;
+		if (chunk < headerChunks) {
+			map = headerFreeMap[chunk];
+		} else if (chunk - headerChunks < freeMapChunks) {
+			map = freeMap[chunk - headerChunks];
+		} else {
+			return false;
+		}
+		size_t bit = pow2<chunkPow - pow> + ((offset & (pow2<chunkPow> - 1)) >> pow);
+		return (map[bit / 64] >> (bit % 64)) & 1;
+	}
+
+	template<size_t pow>
+	void setFree(const void *block, bool free) {
+		size_t offset = static_cast<const Forceduint8_t*>(block)
+				- (dataAdress + pageSize);
+		size_t chunk = (offset >> chunkPow) - freeMapFirstChunk;
+		uint64_t *map;
+		if (chunk < headerChunks) {
+			map = headerFreeMap[chunk];
+		} else {
+			if (chunk - headerChunks >= freeMapChunks) {
+				if (!free) {
+					return;
+				}
+				growFreeMap(chunk - headerChunks + 1);
+			}
+			map = freeMap[chunk - headerChunks];
+		}
+		size_t bit = pow2<chunkPow - pow> + ((offset & (pow2<chunkPow> - 1)) >> pow);
+		touched(&map[bit / 64]);
+		if (free) {
+			map[bit / 64] |= static_cast<uint64_t>(1) << (bit % 64);
+		} else {
+			map[bit / 64] &= ~(static_cast<uint64_t>(1) << (bit % 64));
+		}
+	}
+
+	// the counters of the heap mapped at dataAdress, sub-heaps count for the heap they are in
+	stats::block& statsBlock() {
+		return stats::local(dataAdress);
 	}
 
 	void* getFreePages(const size_t &pageCount) {
-		if (mappedMemSize + pageSize - size < pageCount * pageSize) {
+		if (reservedMemSize + pageSize - size < pageCount * pageSize) {
 			std::string str = "out of mem, remaning mem: ";
-			str += std::to_string(mappedMemSize + pageSize - size)
+			str += std::to_string(reservedMemSize + pageSize - size)
 					+ ", requested mem: " + std::to_string(pageCount * pageSize);
 			throw std::runtime_error(str);
 		}
+		if (mappedMemSize + pageSize - size < pageCount * pageSize) {
+			grow(size + pageCount * pageSize - pageSize);
+		}
 		void *retPtr = static_cast<void*>(dataAdress + size);
 		size += pageSize * pageCount;
+		stats::block &counters = statsBlock();
+		counters.freePagesCalls.add();
+		counters.pagesHandedOut.add(pageCount);
 		ensureFileSize(fd, size);
+		if (numa::pageBindNode >= 0) {
+			numa::bindPreferred(retPtr, pageSize * pageCount,
+					numa::pageBindNode);
+		}
 		return retPtr;
 	}
 
+	void releaseTail(const size_t &bytes) {
+		touchedRange(top() - bytes, bytes);
+		size -= bytes;
+		ftruncate(fd, size);
+	}
+
+	bool punchHole(void *adr, const size_t &len) {
+		touchedRange(adr, len);
+		return fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				fileOffset(adr), len) == 0;
+	}
+
+	// every write of the allocator marks its extent first, one load while no heap is tracked
+	void touched(const void *adr) {
+		dirtyTracking::mark(dataAdress, fileOffset(adr), 1);
+	}
+
+	void touchedRange(const void *adr, size_t len) {
+		if (len != 0) {
+			dirtyTracking::mark(dataAdress, fileOffset(adr), len);
+		}
+	}
+
+	// the header page is mapped at file offset 0
+	off_t fileOffset(const void *adr) {
+		return static_cast<const Forceduint8_t*>(adr) - dataAdress;
+	}
+
+	// Fills len bytes at adr from srcFd without passing them through user space: a reflink
+	// where the file system shares extents between the files, copy_file_range otherwise,
+	// and a pread straight into the mapping as the last resort. Returns the bytes filled,
+	// less than len only at the end of the source.
+	size_t copyFromFile(void *adr, int srcFd, off_t srcOffset, size_t len) {
+		loff_t destOffset = fileOffset(adr);
+		file_clone_range clone { srcFd, static_cast<__u64>(srcOffset), len,
+				static_cast<__u64>(destOffset) };
+		if (ioctl(fd, FICLONERANGE, &clone) == 0) {
+			return len;
+		}
+		loff_t from = srcOffset;
+		size_t done = 0;
+		while (done < len) {
+			ssize_t n = copy_file_range(srcFd, &from, fd, &destOffset,
+					len - done, 0);
+			if (n <= 0) {
+				break;
+			}
+			done += n;
+		}
+		while (done < len) {
+			ssize_t n = pread(srcFd, static_cast<Forceduint8_t*>(adr) + done,
+					len - done, srcOffset + done);
+			if (n < 0 && errno == EINTR) {
+				continue;
+			}
+			if (n <= 0) {
+				break;
+			}
+			done += n;
+		}
+		return done;
+	}
+
+	Forceduint8_t* top() {
+		return dataAdress + size;
+	}
+
 };
 
+// The classes that merge are taken and given back by most allocations, each has a cache
+// line of its own. nextSpan relies on the size, see SpanList.
 template<size_t powerIndex>
-struct SpanOfSize {
+struct alignas(
+		powerIndex < MemoryFileHandler::chunkPow ? cacheLineSize : 8) SpanOfSize {
 	static constexpr size_t blockSize = pow2<powerIndex>;
+	// blocks below a chunk merge with their buddy and are tracked in the free map
+	static constexpr bool merges = powerIndex < MemoryFileHandler::chunkPow;
 	MemBlock<blockSize> *first = nullptr;
 	MemBlock<blockSize> *last = nullptr;
 
@@ -163,14 +676,16 @@ struct SpanOfSize {
 	}
 
 	MemBlock<blockSize>* getFreeBlock(MemoryFileHandler &fileHandler) {
-		if constexpr (powerIndex >= 16) {
+		if constexpr (!merges) {
 			return static_cast<MemBlock<blockSize>*>(fileHandler.getFreePages(
 					MemBlockStoragePage<blockSize>::pageCount));
 		} else {
 			MemBlock<blockSize * 2> *dualBLock = reinterpret_cast<MemBlock<
 					blockSize * 2>*>(nextSpan().getBlock(fileHandler));
+			fileHandler.statsBlock().splits[powerIndex + 1 - IndexOffset].add();
 			auto blockPair = dualBLock->split();
-			putBlock(blockPair.second);
+			putBlock(blockPair.second, fileHandler);
+			fileHandler.touched(blockPair.first);
 			blockPair.first->asUnused.setUsed();
 			return blockPair.first;
 		}
@@ -180,68 +695,180 @@ struct SpanOfSize {
 
 		if (first == nullptr) {
 			MemBlock<blockSize> &retBlock = *getFreeBlock(fileHandler);
+			fileHandler.touched(&retBlock);
 			retBlock.asUnused.setUsed();
 			return retBlock.asData;
 		}
-		if (first == last) {
-				MemBlock<blockSize> *retBlock = first;
-				first = nullptr;
-				last = nullptr;
-				retBlock->asUnused.setUsed();
-				return retBlock->asData;
+		MemBlock<blockSize> *retBlock = first;
+		unlink(retBlock, fileHandler);
+		return retBlock->asData;
+	}
+
+	void unlink(MemBlock<blockSize> *block, MemoryFileHandler &fileHandler) {
+		auto &unused = block->asUnused;
+		fileHandler.touched(block);
+		if (unused.prev != nullptr) {
+			fileHandler.touched(unused.prev);
+			unused.prev->asUnused.next = unused.next;
+		} else
+			first = unused.next;
+		if (unused.next != nullptr) {
+			fileHandler.touched(unused.next);
+			unused.next->asUnused.prev = unused.prev;
+		} else
+			last = unused.prev;
+		unused.next = nullptr;
+		unused.prev = nullptr;
+		if constexpr (merges) {
+			fileHandler.setFree<powerIndex>(block, false);
+		}
+	}
+
+	void pushFront(MemBlock<blockSize> *block, MemoryFileHandler &fileHandler) {
+		fileHandler.touched(block);
+		block->asUnused.prev = nullptr;
+		block->asUnused.next = first;
+		if (first != nullptr) {
+			fileHandler.touched(first);
+			first->asUnused.prev = block;
+		} else
+			last = block;
+		first = block;
+		if constexpr (merges) {
+			fileHandler.setFree<powerIndex>(block, true);
+		}
+	}
+
+	void insertOrdered(MemBlock<blockSize> *block,
+			MemoryFileHandler &fileHandler) {
+		MemBlock<blockSize> *next = first;
+		while (next != nullptr && next < block) {
+			next = next->asUnused.next;
+		}
+		if (next == nullptr) {
+			pushBack(block, fileHandler);
+			return;
+		}
+		if (next == first) {
+			pushFront(block, fileHandler);
+			return;
+		}
+		fileHandler.touched(block);
+		fileHandler.touched(next);
+		fileHandler.touched(next->asUnused.prev);
+		block->asUnused.next = next;
+		block->asUnused.prev = next->asUnused.prev;
+		next->asUnused.prev->asUnused.next = block;
+		next->asUnused.prev = block;
+		if constexpr (merges) {
+			fileHandler.setFree<powerIndex>(block, true);
+		}
+	}
+
+	void pushBack(MemBlock<blockSize> *block, MemoryFileHandler &fileHandler) {
+		fileHandler.touched(block);
+		block->asUnused.next = nullptr;
+		block->asUnused.prev = last;
+		if (last != nullptr) {
+			fileHandler.touched(last);
+			last->asUnused.next = block;
+		} else
+			first = block;
+		last = block;
+		if constexpr (merges) {
+			fileHandler.setFree<powerIndex>(block, true);
+		}
+	}
 
+	// takes the lowest free block below limit, splitting a larger one if this class has none
+	MemBlock<blockSize>* takeBlockBelow(const void *limit, size_t scanLimit,
+			MemoryFileHandler &fileHandler) {
+		MemBlock<blockSize> *best = nullptr;
+		size_t scanned = 0;
+		for (auto *it = first; it != nullptr && scanned < scanLimit;
+				it = it->asUnused.next, ++scanned) {
+			if (static_cast<const void*>(it) < limit
+					&& (best == nullptr || it < best))
+				best = it;
+		}
+		if (best != nullptr) {
+			unlink(best, fileHandler);
+			return best;
 		}
+		if constexpr (merges) {
+			auto *dualBlock = nextSpan().takeBlockBelow(limit, scanLimit,
+					fileHandler);
+			if (dualBlock != nullptr) {
+				fileHandler.statsBlock().splits[powerIndex + 1 - IndexOffset].add();
+				auto blockPair = dualBlock->split();
+				putBlock(blockPair.second, fileHandler);
+				fileHandler.touched(blockPair.first);
+				blockPair.first->asUnused.setUsed();
+				return blockPair.first;
+			}
+		}
+		return nullptr;
+	}
 
-			MemBlock<blockSize> *retBlock = first;
-			first = retBlock->asUnused.next;
-			first->asUnused.prev = nullptr;
-			retBlock->asUnused.setUsed();
-			return retBlock->asData;
+	// moves the lowest free block below limit to the front, so the next getBlock returns it
+	bool promoteBelow(const void *limit, size_t scanLimit,
+			MemoryFileHandler &fileHandler) {
+		MemBlock<blockSize> *block = takeBlockBelow(limit, scanLimit,
+				fileHandler);
+		if (block == nullptr)
+			return false;
+		pushFront(block, fileHandler);
+		return true;
+	}
 
+	MemBlock<blockSize>* takeBlockEndingAt(const Forceduint8_t *end,
+			size_t scanLimit, MemoryFileHandler &fileHandler) {
+		size_t scanned = 0;
+		for (auto *it = first; it != nullptr && scanned < scanLimit;
+				it = it->asUnused.next, ++scanned) {
+			if (it->asData + blockSize == end) {
+				unlink(it, fileHandler);
+				return it;
+			}
+		}
+		return nullptr;
 	}
 
-	void putBlock(MemBlock<blockSize> *block) {
-		if (!block->asUnused.isNotUsed()) {
-			block->asUnused.setUnused(powerIndex);
-		} else {
-			block->asUnused.spanPower = powerIndex;
+	void forEachFree(const std::function<void(void*, size_t)> &func) {
+		for (auto *it = first; it != nullptr; it = it->asUnused.next) {
+			func(it, blockSize);
 		}
+	}
 
-		if constexpr (powerIndex < 16) {
-			if (auto *buddyPtr = block->asUnused.buddyAdress(); (buddyPtr->asUnused.spanPower
-					== powerIndex) && buddyPtr->asUnused.isNotUsed()) {
-				auto &buddyBlock = buddyPtr->asUnused;
-				if (buddyBlock.prev != nullptr)
-					buddyBlock.prev->asUnused.next = buddyBlock.next;
-				if (buddyBlock.next != nullptr)
-					buddyBlock.next->asUnused.prev = buddyBlock.prev;
+	void putBlock(MemBlock<blockSize> *block, MemoryFileHandler &fileHandler) {
+		if constexpr (merges) {
+			// only the free map is read, the buddy is touched once it is merged
+			if (auto *buddyPtr = block->asUnused.buddyAdress(); fileHandler.isFree<
+					powerIndex>(buddyPtr)) {
+				unlink(buddyPtr, fileHandler);
 
 				auto *leftBlock = (block < buddyPtr ? block : buddyPtr);
-				auto *rightBlock = (block > buddyPtr ? block : buddyPtr);
-				rightBlock->asUnused.setUsed();
+				fileHandler.statsBlock().merges[powerIndex - IndexOffset].add();
 				nextSpan().putBlock(
-						reinterpret_cast<MemBlock<blockSize * 2>*>(leftBlock));
+						reinterpret_cast<MemBlock<blockSize * 2>*>(leftBlock),
+						fileHandler);
 				return;
 			}
 		}
-
-		if (first != nullptr) {
-			last->asUnused.next = block;
-			block->asUnused.prev = last;
-			block->asUnused.next = nullptr;
-			last = block;
-		} else {
-			block->asUnused.next = nullptr;
-			block->asUnused.prev = nullptr;
-			first = block;
-			last = block;
+		switch (fileHandler.reuse) {
+		case reusePolicy::lifo:
+			pushFront(block, fileHandler);
+			break;
+		case reusePolicy::fifo:
+			pushBack(block, fileHandler);
+			break;
+		case reusePolicy::addressOrdered:
+			insertOrdered(block, fileHandler);
+			break;
 		}
-
 	}
 };
 
-constexpr size_t IndexOffset = 5;
-
 template<size_t Index>
 Forceduint8_t* allocateI(void *spanPtr, MemoryFileHandler &fileHandler) {
 	return static_cast<SpanOfSize<Index + IndexOffset>*>(spanPtr)->getBlock(
@@ -249,9 +876,29 @@ Forceduint8_t* allocateI(void *spanPtr, MemoryFileHandler &fileHandler) {
 }
 
 template<size_t Index>
-void deallocateI(void *spanPtr, void *ptr) {
+void deallocateI(void *spanPtr, void *ptr, MemoryFileHandler &fileHandler) {
 	static_cast<SpanOfSize<Index + IndexOffset>*>(spanPtr)->putBlock(
-			static_cast<MemBlock<pow2<Index + IndexOffset>>*>(ptr));
+			static_cast<MemBlock<pow2<Index + IndexOffset>>*>(ptr), fileHandler);
+}
+
+template<size_t Index>
+bool promoteBelowI(void *spanPtr, const void *limit, size_t scanLimit,
+		MemoryFileHandler &fileHandler) {
+	return static_cast<SpanOfSize<Index + IndexOffset>*>(spanPtr)->promoteBelow(
+			limit, scanLimit, fileHandler);
+}
+
+template<size_t Index>
+bool takeBlockEndingAtI(void *spanPtr, const Forceduint8_t *end,
+		size_t scanLimit, MemoryFileHandler &fileHandler) {
+	return static_cast<SpanOfSize<Index + IndexOffset>*>(spanPtr)->takeBlockEndingAt(
+			end, scanLimit, fileHandler) != nullptr;
+}
+
+template<size_t Index>
+void forEachFreeI(void *spanPtr,
+		const std::function<void(void*, size_t)> &func) {
+	static_cast<SpanOfSize<Index + IndexOffset>*>(spanPtr)->forEachFree(func);
 }
 
 template<typename T>
@@ -264,13 +911,19 @@ struct SpanListHelper<std::integer_sequence<size_t, Is...>> {
 	inline static constexpr Forceduint8_t* (*allocByIndx[])(void*,
 			MemoryFileHandler&) = {allocateI<Is>...};
 	inline static constexpr void (*deallocByIndx[])(void*,
-			void*) = {deallocateI<Is>...};
+			void*, MemoryFileHandler&) = {deallocateI<Is>...};
+	inline static constexpr bool (*promoteBelowByIndx[])(void*, const void*,
+			size_t, MemoryFileHandler&) = {promoteBelowI<Is>...};
+	inline static constexpr bool (*takeBlockEndingAtByIndx[])(void*,
+			const Forceduint8_t*, size_t, MemoryFileHandler&) = {takeBlockEndingAtI<Is>...};
+	inline static constexpr void (*forEachFreeByIndx[])(void*,
+			const std::function<void(void*, size_t)>&) = {forEachFreeI<Is>...};
 };
 
-// compiler dependent
+// index of the smallest class that holds size bytes, compiler dependent
 unsigned int sizeToIndex(const size_t size) {
-	if (size >= pow2<IndexOffset>) {
-		return 64 - __builtin_clzll(size) - IndexOffset;
+	if (size > pow2<IndexOffset>) {
+		return 64 - __builtin_clzll(size - 1) - IndexOffset;
 	} else {
 		return 0;
 	}
@@ -278,85 +931,807 @@ unsigned int sizeToIndex(const size_t size) {
 
 class SpanList: public SpanListHelper<
 		std::make_integer_sequence<size_t, 63 - IndexOffset>> {
-
-	struct Dummy {
-		static_assert(sizeof(SpanOfSize<1>)==sizeof(SpanOfSize<20>));
-		char data[sizeof(SpanOfSize<1> )] = { };
-	};
-	Dummy spans[60];
+	friend class FileMemoryManager;
+
+	// the classes that merge come first, a cache line each, the others are packed behind them
+	static constexpr size_t mergingSpans = MemoryFileHandler::chunkPow
+			- IndexOffset;
+	static constexpr size_t mergingSpanSize = sizeof(SpanOfSize<IndexOffset>);
+	static constexpr size_t packedSpanSize = sizeof(SpanOfSize<
+			MemoryFileHandler::chunkPow>);
+	static_assert(mergingSpanSize == sizeof(SpanOfSize<MemoryFileHandler::chunkPow - 1>));
+	static_assert(packedSpanSize == sizeof(SpanOfSize<62>));
+	alignas(cacheLineSize) char spans[mergingSpans * mergingSpanSize
+			+ (63 - IndexOffset - mergingSpans) * packedSpanSize] = { };
+
+	void* span(size_t index) {
+		if (index < mergingSpans) {
+			return spans + index * mergingSpanSize;
+		}
+		return spans + mergingSpans * mergingSpanSize
+				+ (index - mergingSpans) * packedSpanSize;
+	}
 
 public:
+	// the whole block counts as written, it is about to be
 	Forceduint8_t* allocate(size_t size, MemoryFileHandler &fileHandler) {
 		unsigned int index = sizeToIndex(size);
-		return allocByIndx[index](&spans[index], fileHandler);
+		Forceduint8_t *ptr = allocByIndx[index](span(index), fileHandler);
+		fileHandler.touchedRange(ptr, pow2<IndexOffset> << index);
+		return ptr;
 	}
 
-	void deallocate(void *ptr, size_t size) {
+	void deallocate(void *ptr, size_t size, MemoryFileHandler &fileHandler) {
 		unsigned int index = sizeToIndex(size);
-		deallocByIndx[index](&spans[index], ptr);
+		deallocByIndx[index](span(index), ptr, fileHandler);
 	}
 
-	void resetAll() {
-		for (size_t i = 0; i < 63 - IndexOffset; ++i) {
-			reinterpret_cast<SpanOfSize<1>*>(&spans[i])->reset();
-		}
+	bool promoteBelow(const void *limit, size_t size, size_t scanLimit,
+			MemoryFileHandler &fileHandler) {
+		unsigned int index = sizeToIndex(size);
+		return promoteBelowByIndx[index](span(index), limit, scanLimit,
+				fileHandler);
 	}
 
-};
-
-const size_t confirmationNumber = 1217160;
-
-class alignas(pageSize) FileMemoryManager {
-	static constexpr size_t minSize = 8;
-	static constexpr size_t maxSize = pow2<63>;
-	static constexpr size_t minI = 3;
-	static constexpr size_t maxI = 62;
-
-	void *objPtr = 0;
-	size_t confNum = confirmationNumber;
-	MemoryFileHandler fileHandler;
-	alignas(8) SpanList listOfSpans;
-
-public:
-	FileMemoryManager(int _fd, void *adrs, size_t mappedMemSize) :
-			fileHandler(_fd, static_cast<Forceduint8_t*>(adrs), mappedMemSize) {
+	// returns the size of a released block ending at end, 0 if there is none
+	size_t takeBlockEndingAt(const Forceduint8_t *end, size_t scanLimit,
+			MemoryFileHandler &fileHandler) {
+		for (size_t i = 16 - IndexOffset; i < 63 - IndexOffset; ++i) {
+			if (takeBlockEndingAtByIndx[i](span(i), end, scanLimit,
+					fileHandler)) {
+				return static_cast<size_t>(1) << (i + IndexOffset);
+			}
+		}
+		return 0;
 	}
 
-	void reset() {
-		objPtr = 0;
-		fileHandler.reset();
-		listOfSpans.resetAll();
+	void forEachFree(size_t index,
+			const std::function<void(void*, size_t)> &func) {
+		forEachFreeByIndx[index](span(index), func);
 	}
 
-	bool isConstructed() {
-		return confNum == confirmationNumber;
-	}
-	bool testmemSize(size_t memSize) {
-		return memSize == fileHandler.mappedMemSize;
-	}
-	void setFd(int fd) {
-		fileHandler.fd = fd;
+	static constexpr size_t spanCount() {
+		return 63 - IndexOffset;
 	}
 
-	MemoryFileHandler& getFilehandler() {
-		return fileHandler;
+	void resetAll() {
+		memset(spans, 0, sizeof(spans));
 	}
 
-	size_t getMemSize() {
-		return fileHandler.mappedMemSize;
-	}
+};
 
-	Forceduint8_t* allocate(size_t _size) {
-		return listOfSpans.allocate(_size, fileHandler);
+// confNum identifies the header layout, it changes with every change of the layout.
+// Heaps of the baseline layout 1217160 are not compatible with this one: the header gained
+// fields and hot fields are padded to cache lines, free blocks are tracked in a bitmap
+// instead of an in-block marker and buddies pair relative to the first data page. Such
+// heaps are refused and have to be recreated, they can not be upgraded.
+// 1217162 since a request of exactly 2^k is served from the 2^k size class, heaps written
+// before file such blocks in the next larger class.
+const size_t confirmationNumber = 1217162;
+// ids of earlier layouts, heaps carrying one are refused instead of being overwritten
+const size_t retiredConfirmationNumbers[] = { 1217160, 1217161 };
+
+// Guarded blocks of builds with INFILEALLOCATOR_DEBUG_HEAP, see FileMemoryManager::allocate.
+// A block is laid out as [front redzone | header | data | back redzone]. Freed blocks are
+// filled with freedByte and wait in a quarantine before they go back to the lists. Broken
+// redzones and writes after free are reported when a block is freed or leaves the
+// quarantine. Under ASan the redzones and the quarantine are poisoned as well.
+namespace debugHeap {
+
+constexpr size_t redzoneSize = 32;
+constexpr uint8_t redzoneByte = 0xfa;
+constexpr uint8_t allocatedByte = 0xbe;
+constexpr uint8_t freedByte = 0xdd;
+constexpr uint32_t liveMagic = 0x4c495645;
+constexpr uint32_t freedMagic = 0x46524545;
+
+struct header {
+	uint32_t magic;
+	uint32_t front;
+	uint64_t size;
+};
+static_assert(sizeof(header) <= redzoneSize / 2);
+
+inline void poison(const void *adr, size_t len) {
+#ifdef INFILEALLOCATOR_ASAN
+	ASAN_POISON_MEMORY_REGION(adr, len);
+#else
+	(void) adr;
+	(void) len;
+#endif
+}
+
+inline void unpoison(const void *adr, size_t len) {
+#ifdef INFILEALLOCATOR_ASAN
+	ASAN_UNPOISON_MEMORY_REGION(adr, len);
+#else
+	(void) adr;
+	(void) len;
+#endif
+}
+
+// for code that reads the whole heap, redzones and quarantined blocks included
+INFILEALLOCATOR_NO_ASAN inline void readHeap(void *dst, const void *src,
+		size_t len) {
+#ifdef INFILEALLOCATOR_ASAN
+	// a plain loop, memcpy would be checked
+	auto *to = static_cast<volatile uint8_t*>(dst);
+	auto *from = static_cast<const volatile uint8_t*>(src);
+	for (size_t i = 0; i < len; ++i) {
+		to[i] = from[i];
 	}
+#else
+	memcpy(dst, src, len);
+#endif
+}
 
-	void deallocate(void *ptr, size_t _size) {
+// freed bytes a heap holds back before reusing them
+inline std::atomic<size_t> quarantineBytes { 4ul << 20 };
+
+// reports a broken block, prints and aborts unless replaced
+inline std::function<void(const std::string&)> onError =
+		[](const std::string &message) {
+			fprintf(stderr, "inFileAllocator debug heap: %s\n", message.c_str());
+			abort();
+		};
+
+inline void report(const std::string &message, const void *ptr) {
+	char adr[32];
+	snprintf(adr, sizeof(adr), " at %p", ptr);
+	onError(message + adr);
+}
+
+inline bool filled(const Forceduint8_t *begin, const Forceduint8_t *end,
+		uint8_t value) {
+	for (; begin < end; ++begin) {
+		if (*begin != value) {
+			return false;
+		}
+	}
+	return true;
+}
+
+struct quarantined {
+	Forceduint8_t *block;
+	Forceduint8_t *data;
+	size_t blockSize;
+	// arena the block goes back to, -1 for the shared lists
+	int node;
+};
+
+struct quarantine {
+	std::deque<quarantined> blocks;
+	size_t bytes = 0;
+};
+
+// heaps are used behind their own locks, only the map needs one; workers of parallelBuild
+// keep a quarantine in their sub-heap
+inline std::mutex quarantinesMutex;
+inline std::map<const void*, quarantine> quarantines;
+
+inline quarantine& quarantineOf(const void *manager) {
+	std::lock_guard<std::mutex> lock(quarantinesMutex);
+	return quarantines[manager];
+}
+
+// the blocks are gone with the heap or its reset
+inline void forget(const void *manager) {
+	std::lock_guard<std::mutex> lock(quarantinesMutex);
+	quarantines.erase(manager);
+}
+
+}
+
+class FileMemoryManager;
+
+// Part of a heap that one thread of FileMemoryManager::parallelBuild allocates from without
+// locking: whole chunks with their own lists, bump pointer and free map. Blocks stay where
+// they are when it is merged back.
+class subHeap {
+	friend class FileMemoryManager;
+
+	const FileMemoryManager *owner;
+	MemoryFileHandler fileHandler;
+	SpanList lists;
+	Forceduint8_t *begin;
+	Forceduint8_t *end;
+#ifdef INFILEALLOCATOR_DEBUG_HEAP
+	debugHeap::quarantine freed;
+#endif
+
+public:
+	// allocations of owner on this thread go here while it is set
+	static inline thread_local subHeap *active = nullptr;
+
+	subHeap(const FileMemoryManager *_owner, const MemoryFileHandler &heap,
+			Forceduint8_t *_begin, size_t bytes) :
+			owner(_owner), fileHandler(heap.fd, heap.dataAdress, 0), begin(
+					_begin), end(_begin + bytes) {
+		fileHandler.size = begin - heap.dataAdress;
+		fileHandler.mappedMemSize = end - heap.dataAdress - pageSize;
+		fileHandler.reservedMemSize = fileHandler.mappedMemSize;
+		fileHandler.freeMapFirstChunk = (fileHandler.size - pageSize)
+				>> MemoryFileHandler::chunkPow;
+		fileHandler.reuse = heap.reuse;
+	}
+
+	bool contains(const void *ptr) const {
+		return ptr >= begin && ptr < end;
+	}
+
+	Forceduint8_t* allocate(size_t size) {
+		return lists.allocate(size, fileHandler);
+	}
+
+	void deallocate(void *ptr, size_t size) {
+		lists.deallocate(ptr, size, fileHandler);
+	}
+};
+
+// std::pmr view of a heap, alignments up to a page come from the buddy layout. Each heap keeps
+// one in its header, so pmr containers in the file point at a resource that is mapped with
+// them; its vtable pointer is written again whenever the heap is opened for writing. A read
+// only heap keeps the vtable pointer of the process that wrote it, so pmr containers in it
+// can be read but not copied, grown or destroyed.
+class fileMemoryResource: public std::pmr::memory_resource {
+	FileMemoryManager *manager;
+
+public:
+	fileMemoryResource(FileMemoryManager *_manager) :
+			manager(_manager) {
+	}
+
+	FileMemoryManager* getManagerPtr() const {
+		return manager;
+	}
+
+protected:
+	void* do_allocate(size_t bytes, size_t alignment) override;
+
+	void do_deallocate(void *ptr, size_t bytes, size_t alignment) override;
+
+	bool do_is_equal(const std::pmr::memory_resource &other) const noexcept
+			override {
+		auto *file = dynamic_cast<const fileMemoryResource*>(&other);
+		return file != nullptr && file->manager == manager;
+	}
+};
+
+class heapImporter;
+
+class alignas(pageSize) FileMemoryManager {
+	friend class heapImporter;
+
+	static constexpr size_t minSize = 8;
+	static constexpr size_t maxSize = pow2<63>;
+	static constexpr size_t minI = 3;
+	static constexpr size_t maxI = 62;
+
+	void *objPtr = 0;
+	size_t confNum = confirmationNumber;
+	MemoryFileHandler fileHandler;
+	SpanList listOfSpans;
+	SpanList *nodeArenas = nullptr;
+	size_t nodeArenaCount = 0;
+	fileMemoryResource resource;
+	// zero, for fields of later layouts
+	uint64_t reserved[32] = { };
+
+	SpanList& arenaFor(int node) {
+		if (node < 0) {
+			return listOfSpans;
+		}
+		if (nodeArenas == nullptr) {
+			enableNodeArenas(numa::nodeCount());
+		}
+		if (static_cast<size_t>(node) >= nodeArenaCount) {
+			return listOfSpans;
+		}
+		return nodeArenas[node];
+	}
+
+#ifdef INFILEALLOCATOR_DEBUG_HEAP
+	// the quarantine of the sub-heap a worker of parallelBuild frees its block to
+	debugHeap::quarantine& quarantineFor(const void *ptr) {
+		if (subHeap *sub = subHeap::active; sub != nullptr && sub->owner == this
+				&& sub->contains(ptr)) {
+			return sub->freed;
+		}
+		return debugHeap::quarantineOf(this);
+	}
+
+	Forceduint8_t* guardedAllocate(size_t size, size_t front, int node = -1) {
+		using namespace debugHeap;
+		size_t blockSize = front + size + redzoneSize;
+		Forceduint8_t *block =
+				node < 0 ?
+						allocateBlock(blockSize) :
+						allocateBlockOnNode(blockSize, node);
+		unpoison(block, blockSize);
+		Forceduint8_t *data = block + front;
+		memset(block, redzoneByte, front - sizeof(header));
+		header h { liveMagic, static_cast<uint32_t>(front), size };
+		memcpy(data - sizeof(header), &h, sizeof(h));
+		memset(data, allocatedByte, size);
+		memset(data + size, redzoneByte, redzoneSize);
+		poison(block, front);
+		poison(data + size, redzoneSize);
+		return data;
+	}
+
+	void guardedDeallocate(void *ptr, size_t size, int node = -1) {
+		using namespace debugHeap;
+		auto *data = static_cast<Forceduint8_t*>(ptr);
+		unpoison(data - sizeof(header), sizeof(header));
+		header h { };
+		memcpy(&h, data - sizeof(header), sizeof(h));
+		if (h.magic == freedMagic) {
+			report("double free", ptr);
+			return;
+		}
+		if (h.magic != liveMagic || h.front < redzoneSize) {
+			report("free of a block that was not allocated or whose front redzone was overwritten",
+					ptr);
+			return;
+		}
+		if (h.size != size) {
+			report("freed with size " + std::to_string(size) + ", allocated with "
+					+ std::to_string(h.size), ptr);
+			return;
+		}
+		Forceduint8_t *block = data - h.front;
+		size_t blockSize = h.front + size + redzoneSize;
+		unpoison(block, blockSize);
+		if (!filled(block, data - sizeof(header), redzoneByte)) {
+			report("front redzone overwritten", ptr);
+		}
+		if (!filled(data + size, data + size + redzoneSize, redzoneByte)) {
+			report("write past the end of a block of " + std::to_string(size)
+					+ " bytes", ptr);
+		}
+		h.magic = freedMagic;
+		memcpy(data - sizeof(header), &h, sizeof(h));
+		memset(data, freedByte, size);
+		fileHandler.touchedRange(block, blockSize);
+		poison(block, blockSize);
+		quarantine &q = quarantineFor(ptr);
+		q.blocks.push_back( { block, data, blockSize, node });
+		q.bytes += blockSize;
+		while (q.bytes > quarantineBytes.load() && !q.blocks.empty()) {
+			releaseQuarantined(q);
+		}
+	}
+
+	void releaseQuarantined(debugHeap::quarantine &q) {
+		using namespace debugHeap;
+		quarantined entry = q.blocks.front();
+		q.blocks.pop_front();
+		q.bytes -= entry.blockSize;
+		unpoison(entry.block, entry.blockSize);
+		Forceduint8_t *data = entry.data;
+		Forceduint8_t *end = entry.block + entry.blockSize;
+		header h { };
+		memcpy(&h, data - sizeof(header), sizeof(h));
+		if (h.magic != freedMagic || data + h.size + redzoneSize != end
+				|| !filled(entry.block, data - sizeof(header), redzoneByte)
+				|| !filled(data, end - redzoneSize, freedByte)
+				|| !filled(end - redzoneSize, end, redzoneByte)) {
+			report("write to a freed block", data);
+		}
+		if (entry.node < 0) {
+			deallocateBlock(entry.block, entry.blockSize);
+		} else {
+			deallocateBlockOnNode(entry.block, entry.blockSize, entry.node);
+		}
+	}
+#endif
+
+	// gives the free blocks, the free map table and the unused tail of a sub-heap to the
+	// shared lists; the runs of 64KiB and up are split into powers of 2
+	void mergeSubHeap(subHeap &sub) {
+#ifdef INFILEALLOCATOR_DEBUG_HEAP
+		// what its worker freed last goes to its lists first
+		subHeap *active = subHeap::active;
+		subHeap::active = &sub;
+		while (!sub.freed.blocks.empty()) {
+			releaseQuarantined(sub.freed);
+		}
+		subHeap::active = active;
+#endif
+		std::vector<std::pair<void*, size_t>> freeBlocks;
+		for (size_t i = 0; i < SpanList::spanCount(); ++i) {
+			sub.lists.forEachFree(i, [&](void *block, size_t blockSize) {
+				freeBlocks.emplace_back(block, blockSize);
+			});
+		}
+		auto release = [&](Forceduint8_t *run, size_t bytes) {
+			while (bytes != 0) {
+				size_t blockSize = static_cast<size_t>(1)
+						<< (63 - __builtin_clzll(bytes));
+				freeBlocks.emplace_back(run, blockSize);
+				run += blockSize;
+				bytes -= blockSize;
+			}
+		};
+		MemoryFileHandler &subHandler = sub.fileHandler;
+		if (subHandler.freeMap != nullptr) {
+			release(reinterpret_cast<Forceduint8_t*>(subHandler.freeMap),
+					subHandler.freeMapChunks * sizeof(*subHandler.freeMap));
+		}
+		release(subHandler.top(), sub.end - subHandler.top());
+		for (auto &block : freeBlocks) {
+			listOfSpans.deallocate(block.first, block.second, fileHandler);
+		}
+	}
+
+public:
+	FileMemoryManager(int _fd, void *adrs, size_t mappedMemSize) :
+			fileHandler(_fd, static_cast<Forceduint8_t*>(adrs), mappedMemSize), resource(
+					this) {
+	}
+
+	void reset() {
+#ifdef INFILEALLOCATOR_DEBUG_HEAP
+		debugHeap::forget(this);
+		debugHeap::unpoison(fileHandler.dataAdress + pageSize,
+				fileHandler.mappedMemSize);
+#endif
+		stats::registry::instance().clear(this);
+		objPtr = 0;
+		fileHandler.reset();
+		listOfSpans.resetAll();
+		nodeArenas = nullptr;
+		nodeArenaCount = 0;
+	}
+
+	bool isConstructed() {
+		return confNum == confirmationNumber;
+	}
+
+	bool hasRetiredLayout() {
+		return std::find(std::begin(retiredConfirmationNumbers),
+				std::end(retiredConfirmationNumbers), confNum)
+				!= std::end(retiredConfirmationNumbers);
+	}
+
+	// a heap fits into any mapping at least as big as it has grown
+	bool testmemSize(size_t memSize) {
+		return fileHandler.mappedMemSize <= memSize;
+	}
+	void setFd(int fd) {
+		fileHandler.fd = fd;
+	}
+
+	// kept in the header, blocks that are already free keep their place in the lists
+	void setReusePolicy(reusePolicy policy) {
+		fileHandler.reuse = policy;
+	}
+
+	reusePolicy getReusePolicy() {
+		return fileHandler.reuse;
+	}
+	void setMemSize(size_t mappedMemSize, size_t reservedMemSize) {
+		fileHandler.mappedMemSize = mappedMemSize;
+		fileHandler.reservedMemSize = reservedMemSize;
+	}
+
+	// the vtable pointer in the header is from the process that created it
+	void attachResource() {
+		new (&resource) fileMemoryResource(this);
+	}
+
+	// throws for a read only heap, see fileMemoryResource
+	std::pmr::memory_resource* getResource();
+
+	MemoryFileHandler& getFilehandler() {
+		return fileHandler;
+	}
+
+	size_t getMemSize() {
+		return fileHandler.mappedMemSize;
+	}
+
+#ifdef INFILEALLOCATOR_DEBUG_HEAP
+	// Blocks get redzones and go through the quarantine, see debugHeap.
+	Forceduint8_t* allocate(size_t _size) {
+		return guardedAllocate(_size, debugHeap::redzoneSize);
+	}
+
+	void deallocate(void *ptr, size_t _size) {
+		guardedDeallocate(ptr, _size);
+	}
+
+	// gives the blocks in the quarantine back to the lists, after checking them
+	void flushQuarantine() {
+		debugHeap::quarantine &q = debugHeap::quarantineOf(this);
+		while (!q.blocks.empty()) {
+			releaseQuarantined(q);
+		}
+	}
+#else
+	Forceduint8_t* allocate(size_t _size) {
+		return allocateBlock(_size);
+	}
+
+	void deallocate(void *ptr, size_t _size) {
+		deallocateBlock(ptr, _size);
+	}
+#endif
+
+	Forceduint8_t* allocateBlock(size_t _size) {
+		stats::local(this).allocations[sizeToIndex(_size)].add();
+		Forceduint8_t *ptr;
+		if (subHeap *sub = subHeap::active; sub != nullptr && sub->owner == this) {
+			ptr = sub->allocate(_size);
+		} else {
+			ptr = listOfSpans.allocate(_size, fileHandler);
+		}
+		tracing::allocated(this, ptr, _size);
+		return ptr;
+	}
+
+	void deallocateBlock(void *ptr, size_t _size) {
+		if (ptr >= (fileHandler.dataAdress + pageSize)
+				&& ptr
+						<= (fileHandler.dataAdress + fileHandler.mappedMemSize
+								+ pageSize)) {
+			stats::local(this).deallocations[sizeToIndex(_size)].add();
+			tracing::deallocated(this, ptr, _size);
+			if (subHeap *sub = subHeap::active; sub != nullptr
+					&& sub->owner == this && sub->contains(ptr)) {
+				sub->deallocate(ptr, _size);
+				return;
+			}
+			listOfSpans.deallocate(ptr, _size, fileHandler);
+		}
+	}
+
+	// A block of 2^k bytes sits at a multiple of 2^k from the first data page, which is page
+	// aligned, so any block at least as big as align is aligned to it. Small requests are
+	// moved up to the class of align instead of over allocating and adjusting the pointer.
+	static size_t alignedSize(size_t size, size_t align) {
+		if (align == 0 || (align & (align - 1)) != 0 || align > pageSize) {
+			throw std::runtime_error(
+					"alignment has to be a power of 2 up to the page size");
+		}
+		size_t blockSize = pow2<IndexOffset> << sizeToIndex(size);
+		return blockSize < align ? align : size;
+	}
+
+	Forceduint8_t* allocateAligned(size_t _size, size_t align) {
+#ifdef INFILEALLOCATOR_DEBUG_HEAP
+		alignedSize(_size, align);
+		return guardedAllocate(_size, std::max(debugHeap::redzoneSize, align));
+#else
+		return allocate(alignedSize(_size, align));
+#endif
+	}
+
+	void deallocateAligned(void *ptr, size_t _size, size_t align) {
+#ifdef INFILEALLOCATOR_DEBUG_HEAP
+		(void) align;
+		guardedDeallocate(ptr, _size);
+#else
+		deallocate(ptr, alignedSize(_size, align));
+#endif
+	}
+
+	// A page aligned block the size of at least bytes, together with where it is in the heap
+	// file. Whatever is written to that file range through the fd is what the block holds.
+	struct pageRun {
+		Forceduint8_t *data;
+		off_t fileOffset;
+		size_t size;
+	};
+
+	static size_t pageRunSize(size_t bytes) {
+		return std::max(bytes, pageSize);
+	}
+
+	// free with deallocatePageRun and the same bytes
+	pageRun reservePageRun(size_t bytes) {
+		Forceduint8_t *data = allocateAligned(pageRunSize(bytes), pageSize);
+		return {data, fileHandler.fileOffset(data), bytes};
+	}
+
+	void deallocatePageRun(void *ptr, size_t bytes) {
+		deallocateAligned(ptr, pageRunSize(bytes), pageSize);
+	}
+
+	int getFd() {
+		return fileHandler.fd;
+	}
+
+	// copies len bytes of srcFd from srcOffset into a new page run, see
+	// MemoryFileHandler::copyFromFile; throws if the source ends before len
+	Forceduint8_t* ingestFile(int srcFd, off_t srcOffset, size_t len) {
+		pageRun run = reservePageRun(len);
+		if (fileHandler.copyFromFile(run.data, srcFd, srcOffset, len) != len) {
+			deallocatePageRun(run.data, len);
+			throw std::runtime_error("ingestFile: source is shorter than "
+					+ std::to_string(len) + " bytes");
+		}
+		return run.data;
+	}
+
+	// Runs build(worker) for workers 0 to workers - 1 on threads of their own. What they
+	// allocate from this heap comes from a private sub-heap of regionBytes each, so they
+	// never lock, and they may only free blocks they allocated during the build. Afterwards
+	// the free parts of the sub-heaps go to the shared lists and the first exception a
+	// worker threw is rethrown. Sub-heap allocations are traced and counted for this heap.
+	void parallelBuild(size_t workers, size_t regionBytes,
+			const std::function<void(size_t)> &build) {
+		constexpr size_t chunkSize = pow2<MemoryFileHandler::chunkPow>;
+		regionBytes = std::max((regionBytes + chunkSize - 1) / chunkSize,
+				static_cast<size_t>(1)) * chunkSize;
+		std::vector<std::unique_ptr<subHeap>> subs;
+		std::exception_ptr error;
+		try {
+			for (size_t i = 0; i < workers; ++i) {
+				auto *region = static_cast<Forceduint8_t*>(fileHandler.getFreePages(
+						regionBytes / pageSize));
+				subs.push_back(
+						std::make_unique<subHeap>(this, fileHandler, region,
+								regionBytes));
+			}
+			std::mutex errorMutex;
+			std::vector<std::thread> threads;
+			for (size_t i = 0; i < workers; ++i) {
+				threads.emplace_back([&, i]() {
+					subHeap::active = subs[i].get();
+					try {
+						build(i);
+					} catch (...) {
+						std::lock_guard<std::mutex> lock(errorMutex);
+						if (!error) {
+							error = std::current_exception();
+						}
+					}
+					subHeap::active = nullptr;
+				});
+			}
+			for (auto &thread : threads) {
+				thread.join();
+			}
+		} catch (...) {
+			error = std::current_exception();
+		}
+		for (auto &sub : subs) {
+			mergeSubHeap(*sub);
+		}
+		if (error) {
+			std::rethrow_exception(error);
+		}
+	}
+
+	// creates one arena per node, a single node heap keeps using the shared lists
+	void enableNodeArenas(size_t count) {
+		if (nodeArenas != nullptr || count <= 1) {
+			return;
+		}
+		nodeArenas = reinterpret_cast<SpanList*>(allocateAligned(
+				sizeof(SpanList) * count, alignof(SpanList)));
+		for (size_t i = 0; i < count; ++i) {
+			new (&nodeArenas[i]) SpanList();
+		}
+		nodeArenaCount = count;
+	}
+
+	size_t getNodeArenaCount() {
+		return nodeArenaCount;
+	}
+
+	SpanList* getNodeArenas() {
+		return nodeArenas;
+	}
+
+	void* getObjPtr() {
+		return objPtr;
+	}
+
+	// node is -1 for blocks in the shared lists
+	void forEachFreeBlock(
+			const std::function<void(void*, size_t, int)> &func) {
+		for (size_t i = 0; i < SpanList::spanCount(); ++i) {
+			listOfSpans.forEachFree(i, [&](void *block, size_t blockSize) {
+				func(block, blockSize, -1);
+			});
+		}
+		for (size_t node = 0; node < nodeArenaCount; ++node) {
+			for (size_t i = 0; i < SpanList::spanCount(); ++i) {
+				nodeArenas[node].forEachFree(i,
+						[&](void *block, size_t blockSize) {
+							func(block, blockSize, static_cast<int>(node));
+						});
+			}
+		}
+	}
+
+	// blocks must be freed with deallocateOnNode and the same node
+#ifdef INFILEALLOCATOR_DEBUG_HEAP
+	Forceduint8_t* allocateOnNode(size_t _size, int node) {
+		return guardedAllocate(_size, debugHeap::redzoneSize, node);
+	}
+
+	void deallocateOnNode(void *ptr, size_t _size, int node) {
+		guardedDeallocate(ptr, _size, node);
+	}
+#else
+	Forceduint8_t* allocateOnNode(size_t _size, int node) {
+		return allocateBlockOnNode(_size, node);
+	}
+
+	void deallocateOnNode(void *ptr, size_t _size, int node) {
+		deallocateBlockOnNode(ptr, _size, node);
+	}
+#endif
+
+	Forceduint8_t* allocateBlockOnNode(size_t _size, int node) {
+		stats::local(this).allocations[sizeToIndex(_size)].add();
+		SpanList &arena = arenaFor(node);
+		Forceduint8_t *ptr;
+		if (&arena == &listOfSpans) {
+			ptr = listOfSpans.allocate(_size, fileHandler);
+		} else {
+			numa::scopedBinding binding(node);
+			ptr = arena.allocate(_size, fileHandler);
+		}
+		tracing::allocated(this, ptr, _size);
+		return ptr;
+	}
+
+	void deallocateBlockOnNode(void *ptr, size_t _size, int node) {
 		if (ptr >= (fileHandler.dataAdress + pageSize)
 				&& ptr
 						<= (fileHandler.dataAdress + fileHandler.mappedMemSize
 								+ pageSize)) {
-			listOfSpans.deallocate(ptr, _size);
+			stats::local(this).deallocations[sizeToIndex(_size)].add();
+			tracing::deallocated(this, ptr, _size);
+			arenaFor(node).deallocate(ptr, _size, fileHandler);
+		}
+	}
+
+	// makes the next allocation of this size class land below ptr, if a free block is there
+	bool preferLowerBlock(const void *ptr, size_t _size, size_t scanLimit = 64) {
+#ifdef INFILEALLOCATOR_DEBUG_HEAP
+		_size = 2 * debugHeap::redzoneSize + _size;
+#endif
+		return listOfSpans.promoteBelow(ptr, _size, scanLimit, fileHandler);
+	}
+
+	void* relocate(void *ptr, size_t _size, size_t scanLimit = 64) {
+		if (!preferLowerBlock(ptr, _size, scanLimit)) {
+			return ptr;
 		}
+		Forceduint8_t *newPtr = allocate(_size);
+		memcpy(newPtr, ptr, _size);
+		deallocate(ptr, _size);
+		return newPtr;
+	}
+
+	// gives free chunks at the end of the file back to the file system
+	size_t trimTail(size_t scanLimit = 64) {
+		size_t released = 0;
+		while (size_t blockSize = listOfSpans.takeBlockEndingAt(
+				fileHandler.top(), scanLimit, fileHandler)) {
+			fileHandler.releaseTail(blockSize);
+			released += blockSize;
+		}
+		return released;
+	}
+
+	// frees the file space under free blocks of size class index, keeping their first page for the list links
+	size_t punchFreeBlocks(size_t index) {
+		size_t punched = 0;
+		listOfSpans.forEachFree(index, [&](void *block, size_t blockSize) {
+			if (blockSize >= 2 * pageSize
+					&& fileHandler.punchHole(
+							static_cast<Forceduint8_t*>(block) + pageSize,
+							blockSize - pageSize)) {
+				punched += blockSize - pageSize;
+			}
+		});
+		return punched;
 	}
 
 	template<typename U, typename ... Args>
@@ -370,48 +1745,295 @@ public:
 	}
 };
 
+inline void* fileMemoryResource::do_allocate(size_t bytes, size_t alignment) {
+	return manager->allocateAligned(bytes, alignment);
+}
+
+inline void fileMemoryResource::do_deallocate(void *ptr, size_t bytes,
+		size_t alignment) {
+	manager->deallocateAligned(ptr, bytes, alignment);
+}
+
+namespace heaps {
+
+// address ranges of the mapped heaps, to find the heap an object lies in
+class registry {
+	struct range {
+		uintptr_t end;
+		FileMemoryManager *manager;
+		bool readOnly;
+	};
+	std::shared_mutex mutex;
+	std::map<uintptr_t, range> ranges;
+
+public:
+	static registry& instance() {
+		static registry reg;
+		return reg;
+	}
+
+	void add(FileMemoryManager *manager, size_t len, bool readOnly = false) {
+		std::unique_lock<std::shared_mutex> lock(mutex);
+		uintptr_t begin = reinterpret_cast<uintptr_t>(manager);
+		ranges[begin] = range { begin + len, manager, readOnly };
+	}
+
+	void remove(FileMemoryManager *manager) {
+		std::unique_lock<std::shared_mutex> lock(mutex);
+		ranges.erase(reinterpret_cast<uintptr_t>(manager));
+	}
+
+	FileMemoryManager* find(uintptr_t adr) {
+		std::shared_lock<std::shared_mutex> lock(mutex);
+		auto iter = ranges.upper_bound(adr);
+		if (iter == ranges.begin()) {
+			return nullptr;
+		}
+		--iter;
+		return adr < iter->second.end ? iter->second.manager : nullptr;
+	}
+
+	bool isReadOnly(const FileMemoryManager *manager) {
+		std::shared_lock<std::shared_mutex> lock(mutex);
+		auto iter = ranges.find(reinterpret_cast<uintptr_t>(manager));
+		return iter != ranges.end() && iter->second.readOnly;
+	}
+};
+
+inline thread_local FileMemoryManager *current = nullptr;
+
+// makes manager the heap of default constructed allocators outside of any heap on this thread
+struct scope {
+	FileMemoryManager *previous;
+	scope(FileMemoryManager *manager) :
+			previous(current) {
+		current = manager;
+	}
+	~scope() {
+		current = previous;
+	}
+};
+
+// the heap adr lies in, otherwise the heap of the innermost scope
+inline FileMemoryManager* defaultFor(uintptr_t adr) {
+	FileMemoryManager *manager = registry::instance().find(adr);
+	if (manager == nullptr) {
+		manager = current;
+	}
+	if (manager == nullptr) {
+		throw std::runtime_error(
+				"no heap for a default constructed allocator outside of a heap, open a heaps::scope");
+	}
+	return manager;
+}
+
+}
+
+inline std::pmr::memory_resource* FileMemoryManager::getResource() {
+	if (heaps::registry::instance().isReadOnly(this)) {
+		throw std::runtime_error("read only heap: no memory resource");
+	}
+	return &resource;
+}
+
 struct FileMemoryManagerSharedPtrDeleter {
+	size_t length;
 	void operator()(FileMemoryManager *ptr) {
-		munmap(ptr, ptr->getMemSize());
+		heaps::registry::instance().remove(ptr);
+#ifdef INFILEALLOCATOR_DEBUG_HEAP
+		if (ptr->isConstructed()) {
+			ptr->flushQuarantine();
+		}
+		debugHeap::forget(ptr);
+		debugHeap::unpoison(ptr, length);
+#endif
+		stats::registry::instance().clear(ptr);
+		munmap(ptr, length);
 	}
 };
 
+class ioEngine;
+
 class FileMemoryManagerHandler {
-	static inline FileMemoryManager *DefCstrWorkAroundPtr;
 	static_assert(sizeof(FileMemoryManager) <= pageSize);
 	std::shared_ptr<FileMemoryManager> manager;
-	void mapHeader(int fd, void *adrs, size_t mappedMemSize) {
-		ensureFileSize(fd, pageSize);
+	// declared after manager so pending io is drained before the heap is unmapped
+	std::shared_ptr<ioEngine> engine;
+	bool readOnly;
+	size_t memSize;
+
+	// With reservedMemSize above mappedMemSize the whole range is reserved PROT_NONE first and
+	// the file is mapped over the start of it, the heap then grows in place.
+	void mapHeader(int fd, void *adrs, size_t mappedMemSize,
+			size_t reservedMemSize, int flags = 0) {
+		if (reinterpret_cast<size_t>(adrs) % pow2<16> != 0) {
+			throw std::runtime_error("adrs has to be 64KiB aligned");
+		}
+		if (!readOnly) {
+			ensureFileSize(fd, pageSize);
+		}
+		if (reservedMemSize > mappedMemSize && (flags & MAP_FIXED) == 0) {
+			void *range = mmap(adrs, reservedMemSize + pageSize, PROT_NONE,
+					MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+			if (range == MAP_FAILED) {
+				throw std::runtime_error("failed to reserve address range");
+			}
+			if (range != adrs) {
+				munmap(range, reservedMemSize + pageSize);
+				throw std::runtime_error("failed to map to given adrs");
+			}
+			flags |= MAP_FIXED;
+		}
 
+		// the header page comes on top of mappedMemSize bytes of blocks
 		FileMemoryManager *adr = static_cast<FileMemoryManager*>(mmap(adrs,
-				mappedMemSize,
-				PROT_READ | PROT_WRITE,
-				MAP_SHARED | MAP_NORESERVE, fd, 0));
+				mappedMemSize + pageSize,
+				readOnly ? PROT_READ : PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_NORESERVE | flags, fd, 0));
 
 		if (adr == MAP_FAILED) {
 			fprintf(stderr, "mmap [mapHeader] failed: %s\n", strerror(errno));
+			if (reservedMemSize > mappedMemSize) {
+				munmap(adrs, reservedMemSize + pageSize);
+			}
 			throw std::runtime_error("failed to map header");
 		}
 
 		if (adr != adrs) {
-			//std::cerr << "adrs = " << (void*) adr << std::endl;
-			//throwError("[mapHeader]did not map to dedicated adrs");
+			// the kernel took adrs as a hint only, the mapping elsewhere is not ours to keep
+			munmap(adr, mappedMemSize + pageSize);
 			throw std::runtime_error("failed to map to given adrs");
 		}
 	}
 
+	// a copy of the header page, aligned like the header so its fields can be read in place
+	struct headerCopy {
+		alignas(FileMemoryManager) Forceduint8_t bytes[pageSize];
+
+		FileMemoryManager* get() {
+			return reinterpret_cast<FileMemoryManager*>(bytes);
+		}
+	};
+
+	enum class headerKind {
+		none, current
+	};
+
+	// An all zero header page holds no heap yet, otherwise confNum has to name the current
+	// layout. Anything else is refused, so a file is never taken for an empty one and
+	// overwritten.
+	static headerKind classify(FileMemoryManager *header) {
+		if (header->isConstructed()) {
+			return headerKind::current;
+		}
+		if (header->hasRetiredLayout()) {
+			throw std::runtime_error(
+					"heap header has a layout that is no longer supported, recreate the heap");
+		}
+		auto *bytes = reinterpret_cast<const Forceduint8_t*>(header);
+		if (std::all_of(bytes, bytes + pageSize, [](Forceduint8_t b) {
+			return b == 0;
+		})) {
+			return headerKind::none;
+		}
+		throw std::runtime_error("file holds no heap of a known layout");
+	}
+
+	// a file shorter than the header page reads as zeros after its end
+	static headerKind readHeader(int fd, headerCopy &copy) {
+		memset(copy.bytes, 0, pageSize);
+		if (pread(fd, copy.bytes, pageSize, 0) < 0) {
+			throw std::runtime_error("failed to read heap header");
+		}
+		return classify(copy.get());
+	}
+
+	// the size the heap in fd grew to, 0 if fd holds no heap yet
+	static size_t storedMemSize(int fd) {
+		headerCopy copy;
+		if (readHeader(fd, copy) == headerKind::none) {
+			return 0;
+		}
+		return copy.get()->getMemSize();
+	}
+
+	// reads the header with pread, so a bad file is rejected before anything is mapped
+	static void checkHeader(int fd, size_t mappedMemSize) {
+		headerCopy copy;
+		if (readHeader(fd, copy) == headerKind::none) {
+			throw std::runtime_error("read only heap: file is not a heap");
+		}
+		FileMemoryManager *header = copy.get();
+		if (!header->testmemSize(mappedMemSize)) {
+			throw std::runtime_error("different size of memory given");
+		}
+		struct stat st;
+		if (fstat(fd, &st) != 0
+				|| static_cast<size_t>(st.st_size)
+						< header->getFilehandler().size) {
+			throw std::runtime_error("read only heap: file is truncated");
+		}
+	}
+
 public:
-	FileMemoryManagerHandler(int fd, void *adrs, size_t mappedMemSize) :
-			manager(static_cast<FileMemoryManager*>(adrs),
-					FileMemoryManagerSharedPtrDeleter()) {
-		mapHeader(fd, adrs, mappedMemSize);
-		if (!manager->isConstructed()) {
-			new (manager.get()) FileMemoryManager(fd, adrs, mappedMemSize);
-		} else {
-			if (!manager->testmemSize(mappedMemSize)) {
-				throw std::runtime_error("different size of memory given");
+	// Read only heaps are mapped PROT_READ and their header is never written, so any number
+	// of processes share the page cache pages of one file. Only reading is possible: nothing
+	// may be allocated or freed, and pmr containers in the heap can not grow.
+	enum class openMode {
+		readWrite, readOnly
+	};
+
+	// A heap that grew past mappedMemSize is mapped at the size it grew to. With
+	// reservedMemSize the heap grows into that much address space instead of running out
+	// of memory at mappedMemSize.
+	FileMemoryManagerHandler(int fd, void *adrs, size_t mappedMemSize,
+			openMode mode = openMode::readWrite, size_t reservedMemSize = 0) :
+			readOnly(mode == openMode::readOnly) {
+		mappedMemSize = std::max(mappedMemSize, storedMemSize(fd));
+		reservedMemSize = std::max(reservedMemSize, mappedMemSize);
+		if (readOnly) {
+			// a reader never grows the heap, it maps all it may see at once
+			mappedMemSize = reservedMemSize;
+			checkHeader(fd, mappedMemSize);
+		}
+		memSize = mappedMemSize;
+		mapHeader(fd, adrs, mappedMemSize, reservedMemSize);
+		manager.reset(static_cast<FileMemoryManager*>(adrs),
+				FileMemoryManagerSharedPtrDeleter { reservedMemSize + pageSize });
+		if (!readOnly) {
+			if (classify(manager.get()) == headerKind::none) {
+				new (manager.get()) FileMemoryManager(fd, adrs, mappedMemSize);
+			} else {
+				manager->setFd(fd);
+				manager->attachResource();
 			}
-			manager->setFd(fd);
+			manager->setMemSize(mappedMemSize, reservedMemSize);
+		}
+		heaps::registry::instance().add(manager.get(),
+				reservedMemSize + pageSize, readOnly);
+	}
+
+	bool isReadOnly() const {
+		return readOnly;
+	}
+
+	// Maps the heap in fd, a newer version published by publishHeapFile, over the current one.
+	// MAP_FIXED swaps the pages in one step, so other threads never fault, but they may read
+	// a mix of both versions and must not hold pointers into the heap across the call.
+	void remap(int fd) {
+		if (!readOnly) {
+			throw std::runtime_error("only read only heaps can be remapped");
+		}
+		checkHeader(fd, memSize);
+		mapHeader(fd, manager.get(), memSize, memSize, MAP_FIXED);
+	}
+
+	// writes the heap back to its file, before it is published or copied
+	void sync() {
+		MemoryFileHandler &fileHandler = manager->getFilehandler();
+		if (msync(manager.get(), fileHandler.size, MS_SYNC) != 0
+				|| fsync(fileHandler.fd) != 0) {
+			throw std::runtime_error("failed to sync heap");
 		}
 	}
 
@@ -419,12 +2041,12 @@ public:
 		return manager.get();
 	}
 
-	void setDefCstr() {
-		DefCstrWorkAroundPtr = manager.get();
+	void attachIoEngine(std::shared_ptr<ioEngine> _engine) {
+		engine = std::move(_engine);
 	}
 
-	static FileMemoryManager* getDefPtr() {
-		return DefCstrWorkAroundPtr;
+	ioEngine* getIoEngine() {
+		return engine.get();
 	}
 
 	~FileMemoryManagerHandler() {
@@ -433,6 +2055,21 @@ public:
 
 };
 
+// Replaces path with the heap in tmpPath, which its builder has synced. Readers that open
+// path get either the old or the new heap, and the old one stays valid while it is mapped.
+inline void publishHeapFile(const std::string &tmpPath, const std::string &path) {
+	if (rename(tmpPath.c_str(), path.c_str()) != 0) {
+		throw std::runtime_error("failed to rename " + tmpPath);
+	}
+	size_t slash = path.find_last_of('/');
+	std::string dir = slash == std::string::npos ? "." : path.substr(0, slash + 1);
+	int dirFd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+	if (dirFd >= 0) {
+		fsync(dirFd);
+		close(dirFd);
+	}
+}
+
 template<typename T>
 class fileAllocator: public std::pointer_traits<T*> {
 private:
@@ -449,8 +2086,10 @@ public:
 		using other = fileAllocator<U>;
 	};
 
+	// containers in a heap keep using it after the heap was reopened, only the address of
+	// the allocator is looked at
 	fileAllocator() :
-			manager(FileMemoryManagerHandler::getDefPtr()) {
+			manager(heaps::defaultFor(reinterpret_cast<uintptr_t>(this))) {
 	}
 
 	fileAllocator(FileMemoryManager *_manager) :
@@ -464,11 +2103,12 @@ public:
 	}
 
 	T* allocate(size_t count, const void* = 0) {
-		return reinterpret_cast<T*>(manager->allocate(count * sizeof(T)));
+		return reinterpret_cast<T*>(manager->allocateAligned(count * sizeof(T),
+				alignof(T)));
 	}
 
-	void deallocate(T *ptr, size_t size) noexcept {
-		manager->deallocate(ptr, size);
+	void deallocate(T *ptr, size_t count) noexcept {
+		manager->deallocateAligned(ptr, count * sizeof(T), alignof(T));
 	}
 
 	template<typename U, typename ... Args>
@@ -487,16 +2127,62 @@ public:
 
 };
 
+// allocates from the arena of one numa node, defaults to the node of the constructing thread
+template<typename T>
+class numaFileAllocator: public fileAllocator<T> {
+	int node;
+
+public:
+	template<typename U>
+	struct rebind {
+		using other = numaFileAllocator<U>;
+	};
+
+	numaFileAllocator(FileMemoryManager *_manager, int _node =
+			numa::threadNode()) :
+			fileAllocator<T>(_manager), node(_node) {
+	}
+
+	template<typename U>
+	numaFileAllocator(const numaFileAllocator<U> &other) noexcept :
+			fileAllocator<T>(other.getManagerPtr()), node(other.getNode()) {
+	}
+
+	T* allocate(size_t count, const void* = 0) {
+		return reinterpret_cast<T*>(this->getManagerPtr()->allocateOnNode(
+				FileMemoryManager::alignedSize(count * sizeof(T), alignof(T)),
+				node));
+	}
+
+	void deallocate(T *ptr, size_t count) noexcept {
+		this->getManagerPtr()->deallocateOnNode(ptr,
+				FileMemoryManager::alignedSize(count * sizeof(T), alignof(T)),
+				node);
+	}
+
+	int getNode() const {
+		return node;
+	}
+
+};
+
 template<typename T, typename U>
-constexpr bool operator==(const fileAllocator<T> &a,
-		const fileAllocator<U> &b) noexcept {
-	return false;
+constexpr bool operator==(const numaFileAllocator<T> &a,
+		const numaFileAllocator<U> &b) noexcept {
+	return a.getManagerPtr() == b.getManagerPtr() && a.getNode() == b.getNode();
 }
 
-template<typename T>
+template<typename T, typename U>
+constexpr bool operator!=(const numaFileAllocator<T> &a,
+		const numaFileAllocator<U> &b) noexcept {
+	return !(a == b);
+}
+
+// blocks from one heap can be given back through any allocator of that heap
+template<typename T, typename U>
 constexpr bool operator==(const fileAllocator<T> &a,
-		const fileAllocator<T> &b) noexcept {
-	return true;
+		const fileAllocator<U> &b) noexcept {
+	return a.getManagerPtr() == b.getManagerPtr();
 }
 
 template<typename T, typename U>
@@ -2,9 +2,9 @@
 //#include "AllocatorTestting.hpp"
 
 
-int main(){
-
-
-	//BenchmarkAllocators().test();
+int main(int argc, char **argv) {
+	benchmarks::benchmarkSuite suite(benchmarks::parseOptions(argc, argv),
+			std::cout);
+	suite.run();
 	return 0;
 }
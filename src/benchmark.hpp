@@ -9,218 +9,1327 @@
 #define BENCHMARK_HPP_
 
 #include "InFileAllocator.hpp"
-#include <x86intrin.h>
-#include <queue>
+#include "inFileTrace.hpp"
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <dlfcn.h>
+#include <iomanip>
+#include <linux/perf_event.h>
+#include <random>
+#include <set>
+#include <sstream>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <thread>
 
-struct benchmarkDatum {
-	size_t allocAvrg;
-	size_t allocWorst;
-	size_t deallocAvrg;
-	size_t deallocWorst;
+#if __has_include(<boost/interprocess/managed_mapped_file.hpp>)
+#include <boost/interprocess/managed_mapped_file.hpp>
+#define INFILEALLOCATOR_BENCH_BOOST 1
+#endif
 
+namespace benchmarks {
+
+using clockT = std::chrono::steady_clock;
+
+struct RAIIFD {
+	int fd;
+	RAIIFD(const char *path) {
+		fd = open(path, O_CREAT | O_RDWR, 0777);
+		if (fd == -1) {
+			fprintf(stderr, "open [RAIIFD] failed: %s\n", strerror(errno));
+		}
+	}
+	~RAIIFD() {
+		close(fd);
+	}
+	operator int() const {
+		return fd;
+	}
 };
 
-template<typename Allocator>
-struct BenchmarkSingleAllocator {
-	static constexpr size_t repeatCount = 1000;
-	Allocator alloc;
-	benchmarkDatum allocateAlotOnce() {
-		size_t avrgSumAlloc = 0;
-		size_t worstAlloc = 0;
-		size_t avrgSumDealloc = 0;
-		size_t worstDealloc = 0;
-
-		//size_t allocSizes[] = {8,16,32,64,128,256,[]}
-
-		for (size_t i = 0; i < repeatCount; ++i) {
-			size_t start = __rdtsc();
-			char *ptr = alloc.allocate(4096 * 50);
-			size_t time = __rdtsc() - start;
-			avrgSumAlloc += time;
-			worstAlloc = (worstAlloc > time ? worstAlloc : time);
+// one row of output, extra holds suite specific numbers (faults, lock hold times, ...)
+struct benchmarkResult {
+	std::string suite;
+	std::string scenario;
+	std::string allocator;
+	size_t threads = 1;
+	size_t ops = 0;
+	double seconds = 0;
+	double opsPerSec = 0;
+	double meanNs = 0;
+	double p50Ns = 0;
+	double p99Ns = 0;
+	double p999Ns = 0;
+	double maxNs = 0;
+	std::vector<std::pair<std::string, double>> extra;
+};
+
+// per operation latencies in ns, percentiles are computed by sorting on report
+class latencyRecorder {
+	std::vector<uint32_t> samples;
 
-			start = __rdtsc();
-			alloc.deallocate(ptr, 4096 * 50);
-			time = __rdtsc() - start;
-			avrgSumDealloc += time;
-			worstDealloc = (worstDealloc > time ? worstDealloc : time);
+public:
+	void reserve(size_t n) {
+		samples.reserve(n);
+	}
+
+	void add(clockT::duration d) {
+		auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
+		samples.push_back(
+				static_cast<uint32_t>(std::min<int64_t>(ns,
+						std::numeric_limits<uint32_t>::max())));
+	}
+
+	void merge(const latencyRecorder &other) {
+		samples.insert(samples.end(), other.samples.begin(),
+				other.samples.end());
+	}
+
+	bool empty() const {
+		return samples.empty();
+	}
+
+	// sorts on first use, q in [0, 1]
+	double percentile(double q) {
+		if (samples.empty()) {
+			return 0;
+		}
+		if (!std::is_sorted(samples.begin(), samples.end())) {
+			std::sort(samples.begin(), samples.end());
 		}
+		return static_cast<double>(samples[std::min(samples.size() - 1,
+				static_cast<size_t>(q * samples.size()))]);
+	}
 
-		return {avrgSumAlloc/repeatCount,worstAlloc,avrgSumDealloc/repeatCount,worstDealloc};
+	void fill(benchmarkResult &result) {
+		if (samples.empty()) {
+			return;
+		}
+		auto at = [&](double q) {
+			return percentile(q);
+		};
+		double sum = 0;
+		for (uint32_t s : samples) {
+			sum += s;
+		}
+		result.meanNs = sum / samples.size();
+		result.p50Ns = at(0.5);
+		result.p99Ns = at(0.99);
+		result.p999Ns = at(0.999);
+		result.maxNs = samples.back();
 	}
+};
 
-	benchmarkDatum allocateDiffSizes() {
-		size_t avrgSumAlloc = 0;
-		size_t worstAlloc = 0;
-		size_t avrgSumDealloc = 0;
-		size_t worstDealloc = 0;
+class resultWriter {
+public:
+	enum class format {
+		table, csv, json
+	};
 
-		for (size_t i = 0; i < repeatCount; ++i) {
-			size_t start = __rdtsc();
-			char *ptr1 = alloc.allocate(4096 * 1);
-			char *ptr2 = alloc.allocate(4096 * 10);
-			char *ptr3 = alloc.allocate(4096 * 20);
-			size_t time = __rdtsc() - start;
-			avrgSumAlloc += time;
-			worstAlloc = (worstAlloc > time ? worstAlloc : time);
+private:
+	std::ostream &out;
+	format fmt;
+	bool headerDone = false;
 
-			start = __rdtsc();
-			alloc.deallocate(ptr1, 4096);
-			alloc.deallocate(ptr2, 4096 * 10);
-			alloc.deallocate(ptr3, 4096 * 20);
-			time = __rdtsc() - start;
-			avrgSumDealloc += time;
-			worstDealloc = (worstDealloc > time ? worstDealloc : time);
+public:
+	resultWriter(std::ostream &_out, format _fmt) :
+			out(_out), fmt(_fmt) {
+	}
+
+	std::ostream& stream() {
+		return out;
+	}
 
+	void write(const benchmarkResult &r) {
+		switch (fmt) {
+		case format::json:
+			out << "{\"suite\":\"" << r.suite << "\",\"scenario\":\""
+					<< r.scenario << "\",\"allocator\":\"" << r.allocator
+					<< "\",\"threads\":" << r.threads << ",\"ops\":" << r.ops
+					<< ",\"seconds\":" << r.seconds << ",\"ops_per_sec\":"
+					<< r.opsPerSec << ",\"mean_ns\":" << r.meanNs
+					<< ",\"p50_ns\":" << r.p50Ns << ",\"p99_ns\":" << r.p99Ns
+					<< ",\"p999_ns\":" << r.p999Ns << ",\"max_ns\":" << r.maxNs;
+			for (auto &e : r.extra) {
+				out << ",\"" << e.first << "\":" << e.second;
+			}
+			out << "}\n";
+			break;
+		case format::csv:
+			if (!headerDone) {
+				out
+						<< "suite,scenario,allocator,threads,ops,seconds,ops_per_sec,mean_ns,p50_ns,p99_ns,p999_ns,max_ns,extra\n";
+				headerDone = true;
+			}
+			out << r.suite << ',' << r.scenario << ',' << r.allocator << ','
+					<< r.threads << ',' << r.ops << ',' << r.seconds << ','
+					<< r.opsPerSec << ',' << r.meanNs << ',' << r.p50Ns << ','
+					<< r.p99Ns << ',' << r.p999Ns << ',' << r.maxNs << ',';
+			for (auto &e : r.extra) {
+				out << e.first << '=' << e.second << ';';
+			}
+			out << '\n';
+			break;
+		case format::table:
+			if (!headerDone) {
+				out << std::left << std::setw(10) << "suite" << std::setw(20)
+						<< "scenario" << std::setw(12) << "allocator"
+						<< std::setw(4) << "thr" << std::right << std::setw(14)
+						<< "ops/sec" << std::setw(10) << "p50" << std::setw(10)
+						<< "p99" << std::setw(10) << "p999" << std::setw(12)
+						<< "max" << "  extra\n";
+				headerDone = true;
+			}
+			out << std::left << std::setw(10) << r.suite << std::setw(20)
+					<< r.scenario << std::setw(12) << r.allocator << std::setw(4)
+					<< r.threads << std::right << std::setw(14)
+					<< static_cast<size_t>(r.opsPerSec) << std::setw(10)
+					<< static_cast<size_t>(r.p50Ns) << std::setw(10)
+					<< static_cast<size_t>(r.p99Ns) << std::setw(10)
+					<< static_cast<size_t>(r.p999Ns) << std::setw(12)
+					<< static_cast<size_t>(r.maxNs) << "  ";
+			for (auto &e : r.extra) {
+				out << e.first << '=' << e.second << ' ';
+			}
+			out << '\n';
+			break;
 		}
+		out.flush();
+	}
+};
+
+// Allocators under test share one interface: allocate/deallocate raw bytes and reset between runs.
 
-		return {avrgSumAlloc/repeatCount,worstAlloc,avrgSumDealloc/repeatCount,worstDealloc};
+struct fileHeapAllocator {
+	static constexpr const char *name = "file";
+	inFileAllocator::detail::FileMemoryManager *manager;
+
+	void* allocate(size_t size) {
+		return manager->allocate(size);
+	}
+	void deallocate(void *ptr, size_t size) {
+		manager->deallocate(ptr, size);
+	}
+	void reset() {
+		manager->reset();
 	}
+	template<typename T>
+	using containerAllocator = inFileAllocator::detail::fileAllocator<T>;
+	template<typename T>
+	containerAllocator<T> containerAlloc() {
+		return containerAllocator<T>(manager);
+	}
+};
 
-	benchmarkDatum allocateSmallSizesNoKeep() {
-		benchmarkDatum ret;
-		const size_t sizes[10] = { 7, 15, 31, 63, 127, 255, 511, 1023, 2047,
-				4095 };
+struct stdHeapAllocator {
+	static constexpr const char *name = "std";
+	std::allocator<char> alloc;
 
-		for (size_t i = 0; i < repeatCount; ++i) {
-			size_t start = __rdtsc();
-			size_t size = __rdtsc() % 10;
-			char *ptr = alloc.allocate(sizes[size]);
-			size_t time = __rdtsc() - start;
-			ret.allocAvrg += time;
-			ret.allocWorst = (ret.allocWorst > time ? ret.allocWorst : time);
+	void* allocate(size_t size) {
+		return alloc.allocate(size);
+	}
+	void deallocate(void *ptr, size_t size) {
+		alloc.deallocate(static_cast<char*>(ptr), size);
+	}
+	void reset() {
+	}
+	template<typename T>
+	using containerAllocator = std::allocator<T>;
+	template<typename T>
+	containerAllocator<T> containerAlloc() {
+		return containerAllocator<T>();
+	}
+};
 
-			start = __rdtsc();
-			alloc.deallocate(ptr, sizes[size]);
-			time = __rdtsc() - start;
-			ret.deallocAvrg += time;
-			ret.deallocWorst = (
-					ret.deallocWorst > time ? ret.deallocWorst : time);
+// jemalloc or tcmalloc loaded at run time, so neither is a build dependency
+struct dlMallocAllocator {
+	const char *name;
+	void *handle = nullptr;
+	void* (*mallocFn)(size_t) = nullptr;
+	void (*freeFn)(void*) = nullptr;
+
+	dlMallocAllocator(const char *_name, std::initializer_list<const char*> libs) :
+			name(_name) {
+		for (const char *lib : libs) {
+			handle = dlopen(lib, RTLD_NOW | RTLD_LOCAL);
+			if (handle != nullptr) {
+				break;
+			}
+		}
+		if (handle != nullptr) {
+			mallocFn = reinterpret_cast<void* (*)(size_t)>(dlsym(handle,
+					"malloc"));
+			freeFn = reinterpret_cast<void (*)(void*)>(dlsym(handle, "free"));
+		}
+	}
+	~dlMallocAllocator() {
+		if (handle != nullptr) {
+			dlclose(handle);
 		}
+	}
+	bool available() const {
+		return mallocFn != nullptr && freeFn != nullptr;
+	}
+	void* allocate(size_t size) {
+		return mallocFn(size);
+	}
+	void deallocate(void *ptr, size_t) {
+		freeFn(ptr);
+	}
+	void reset() {
+	}
+};
 
-		ret.allocAvrg /= repeatCount;
-		ret.deallocAvrg /= repeatCount;
-		return ret;
+#ifdef INFILEALLOCATOR_BENCH_BOOST
+struct boostMappedFileAllocator {
+	static constexpr const char *name = "boost-mmf";
+	std::string path;
+	size_t size;
+	std::unique_ptr<boost::interprocess::managed_mapped_file> segment;
+
+	boostMappedFileAllocator(std::string _path, size_t _size) :
+			path(std::move(_path)), size(_size) {
+		reset();
+	}
+	~boostMappedFileAllocator() {
+		segment.reset();
+		boost::interprocess::file_mapping::remove(path.c_str());
+	}
+	void* allocate(size_t bytes) {
+		return segment->allocate(bytes);
 	}
+	void deallocate(void *ptr, size_t) {
+		segment->deallocate(ptr);
+	}
+	void reset() {
+		segment.reset();
+		boost::interprocess::file_mapping::remove(path.c_str());
+		segment = std::make_unique<boost::interprocess::managed_mapped_file>(
+				boost::interprocess::create_only, path.c_str(), size);
+	}
+};
+#endif
 
-	benchmarkDatum allocateSmallSizesYesKeep() {
-		benchmarkDatum ret;
-		const size_t sizes[10] = { 7, 15, 31, 63, 127, 255, 511, 1023, 2047,
-				4095 };
+// Hardware cache misses of the calling thread through perf_event_open. Stays unavailable
+// where the kernel or the hypervisor does not expose the counter.
+class cacheMissCounter {
+	int fd = -1;
 
-		std::queue<std::pair<size_t, char*>> allocs;
+public:
+	cacheMissCounter() {
+		perf_event_attr attr { };
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.size = sizeof(attr);
+		attr.config = PERF_COUNT_HW_CACHE_MISSES;
+		attr.disabled = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+	}
+
+	cacheMissCounter(const cacheMissCounter&) = delete;
 
-		for (size_t i = 0; i < repeatCount; ++i) {
-			size_t start = __rdtsc();
-			size_t size = __rdtsc() % 10;
-			char *ptr = alloc.allocate(sizes[size]);
-			size_t time = __rdtsc() - start;
-			allocs.emplace(size, ptr);
-			ret.allocAvrg += time;
-			ret.allocWorst = (ret.allocWorst > time ? ret.allocWorst : time);
+	~cacheMissCounter() {
+		if (fd >= 0) {
+			close(fd);
 		}
+	}
 
-		while (allocs.size()) {
-			auto pair = allocs.front();
-			allocs.pop();
-			size_t start = __rdtsc();
-			alloc.deallocate(pair.second, sizes[pair.first]);
-			size_t time = __rdtsc() - start;
-			ret.deallocAvrg += time;
-			ret.deallocWorst = (
-					ret.deallocWorst > time ? ret.deallocWorst : time);
+	bool available() const {
+		return fd >= 0;
+	}
+
+	void start() {
+		ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+		ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+	}
+
+	uint64_t stop() {
+		ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+		uint64_t count = 0;
+		if (read(fd, &count, sizeof(count)) != sizeof(count)) {
+			return 0;
 		}
+		return count;
+	}
+};
+
+// Process wide fault and io counters, subtract two samples to get the cost of what ran in between.
+// write_bytes/read_bytes come from /proc/self/io and stay 0 where it can not be read.
+struct resourceUsage {
+	uint64_t minorFaults = 0;
+	uint64_t majorFaults = 0;
+	uint64_t readBytes = 0;
+	uint64_t writeBytes = 0;
 
-		ret.allocAvrg /= repeatCount;
-		ret.deallocAvrg /= repeatCount;
-		return ret;
+	static resourceUsage now() {
+		resourceUsage usage;
+		rusage ru;
+		if (getrusage(RUSAGE_SELF, &ru) == 0) {
+			usage.minorFaults = ru.ru_minflt;
+			usage.majorFaults = ru.ru_majflt;
+		}
+		std::ifstream io("/proc/self/io");
+		std::string key;
+		uint64_t value;
+		while (io >> key >> value) {
+			if (key == "read_bytes:") {
+				usage.readBytes = value;
+			} else if (key == "write_bytes:") {
+				usage.writeBytes = value;
+			}
+		}
+		return usage;
 	}
 
+	resourceUsage operator-(const resourceUsage &other) const {
+		return {minorFaults - other.minorFaults, majorFaults - other.majorFaults,
+			readBytes - other.readBytes, writeBytes - other.writeBytes};
+	}
 };
 
-struct RAIIFD {
-	int fd;
-	RAIIFD(const char *path) {
-		fd = open(path, O_CREAT | O_RDWR, 0777);
-		if (fd == -1) {
-			fprintf(stderr, "mmap [mapHeader] failed: %s\n", strerror(errno));
+// Shares an allocator between threads behind one mutex, the way a FileMemoryManager has to be shared today.
+// Without locking the calls go straight through, for allocators that are thread safe on their own.
+// Threads that set times get the time they waited for and held the lock recorded.
+template<typename Allocator>
+class sharedHeap {
+public:
+	struct lockTimes {
+		latencyRecorder wait;
+		latencyRecorder hold;
+	};
+
+private:
+	Allocator &alloc;
+	bool locking;
+	std::mutex mutex;
+
+	template<typename F>
+	auto withLock(F &&f) {
+		if (!locking) {
+			return f();
+		}
+		if (times == nullptr) {
+			std::lock_guard<std::mutex> lock(mutex);
+			return f();
 		}
+		auto start = clockT::now();
+		std::lock_guard<std::mutex> lock(mutex);
+		auto acquired = clockT::now();
+		times->wait.add(acquired - start);
+		struct holdTimer {
+			lockTimes *times;
+			clockT::time_point acquired;
+			~holdTimer() {
+				times->hold.add(clockT::now() - acquired);
+			}
+		} timer { times, acquired };
+		return f();
 	}
-	~RAIIFD() {
-		close(fd);
+
+public:
+	static inline thread_local lockTimes *times = nullptr;
+
+	sharedHeap(Allocator &_alloc, bool _locking) :
+			alloc(_alloc), locking(_locking) {
 	}
-	operator int() const {
-		return fd;
+
+	void* allocate(size_t size) {
+		return withLock([&]() {
+			return alloc.allocate(size);
+		});
+	}
+	void deallocate(void *ptr, size_t size) {
+		withLock([&]() {
+			alloc.deallocate(ptr, size);
+		});
+	}
+	void reset() {
+		alloc.reset();
 	}
 };
 
-size_t percent(size_t def, size_t file) {
-	return ((double) file / def) * 100;
-}
+template<typename T, typename Heap>
+struct sharedHeapAllocator {
+	typedef T value_type;
+	Heap *heap;
 
-struct BenchmarkAllocators {
+	sharedHeapAllocator(Heap *_heap) :
+			heap(_heap) {
+	}
+	template<typename U>
+	sharedHeapAllocator(const sharedHeapAllocator<U, Heap> &other) :
+			heap(other.heap) {
+	}
+	T* allocate(size_t n) {
+		return static_cast<T*>(heap->allocate(n * sizeof(T)));
+	}
+	void deallocate(T *p, size_t n) {
+		heap->deallocate(p, n * sizeof(T));
+	}
+	template<typename U>
+	bool operator==(const sharedHeapAllocator<U, Heap> &other) const {
+		return heap == other.heap;
+	}
+	template<typename U>
+	bool operator!=(const sharedHeapAllocator<U, Heap> &other) const {
+		return heap != other.heap;
+	}
+};
 
-	static void printHeader() {
-		std::cout << "Name\tavrgAlloc\tworstAlloc\tavrgDealloc\tworstDealloc\n";
+// blocks handed from one thread to another for freeing
+struct mailbox {
+	std::mutex mutex;
+	std::vector<std::pair<void*, uint32_t>> items;
+
+	void put(std::vector<std::pair<void*, uint32_t>> &batch) {
+		std::lock_guard<std::mutex> lock(mutex);
+		items.insert(items.end(), batch.begin(), batch.end());
+		batch.clear();
+	}
+	void take(std::vector<std::pair<void*, uint32_t>> &out) {
+		std::lock_guard<std::mutex> lock(mutex);
+		out.swap(items);
 	}
-	static constexpr const char *seperator = "\t\t";
-	static void printDatum(const char *name, benchmarkDatum data) {
+};
 
-		std::cout << name << "\t" << data.allocAvrg << seperator
-				<< data.allocWorst << seperator << data.deallocAvrg << seperator
-				<< data.deallocWorst << "\n";
+// A trace is a fixed sequence of allocations and frees over numbered slots,
+// generated once with a fixed seed and replayed identically against every allocator.
+struct traceOp {
+	uint32_t slot;
+	uint32_t size; // 0 frees the slot
+};
+
+struct trace {
+	std::string name;
+	size_t slotCount = 0;
+	std::vector<traceOp> ops;
+};
+
+// mostly small objects with a tail of larger ones, roughly what containers of records produce
+class sizeDistribution {
+	std::discrete_distribution<int> bucket { 10, 15, 20, 10, 15, 10, 8, 5, 4, 2,
+			1 };
+	static constexpr uint32_t limits[] = { 8, 16, 32, 48, 64, 128, 256, 512,
+			1024, 4096, 65536 };
+
+public:
+	template<typename Rng>
+	uint32_t operator()(Rng &rng) {
+		int b = bucket(rng);
+		uint32_t low = b == 0 ? 1 : limits[b - 1] + 1;
+		return std::uniform_int_distribution<uint32_t>(low, limits[b])(rng);
+	}
+};
+
+struct traceGenerator {
+	// objects die in random order, the live set stays around liveCount
+	static trace randomLifetime(size_t opCount, size_t liveCount,
+			uint32_t seed = 1) {
+		std::mt19937 rng(seed);
+		sizeDistribution sizes;
+		trace t { "randomLifetime", liveCount, { } };
+		std::vector<uint32_t> freeSlots(liveCount);
+		std::vector<uint32_t> liveSlots;
+		for (uint32_t i = 0; i < liveCount; ++i) {
+			freeSlots[i] = liveCount - 1 - i;
+		}
+		while (t.ops.size() < opCount) {
+			bool doAlloc = liveSlots.empty()
+					|| (!freeSlots.empty() && rng() % 2 == 0);
+			if (doAlloc) {
+				uint32_t slot = freeSlots.back();
+				freeSlots.pop_back();
+				liveSlots.push_back(slot);
+				t.ops.push_back( { slot, sizes(rng) });
+			} else {
+				size_t pick = rng() % liveSlots.size();
+				uint32_t slot = liveSlots[pick];
+				liveSlots[pick] = liveSlots.back();
+				liveSlots.pop_back();
+				freeSlots.push_back(slot);
+				t.ops.push_back( { slot, 0 });
+			}
+		}
+		for (uint32_t slot : liveSlots) {
+			t.ops.push_back( { slot, 0 });
+		}
+		return t;
+	}
+
+	// a queue between a producer and a consumer, blocks are freed in allocation order
+	static trace producerConsumer(size_t opCount, size_t window,
+			uint32_t seed = 2) {
+		std::mt19937 rng(seed);
+		sizeDistribution sizes;
+		trace t { "producerConsumer", window + 1, { } };
+		std::deque<uint32_t> queue;
+		uint32_t nextSlot = 0;
+		while (t.ops.size() < opCount) {
+			uint32_t slot = nextSlot;
+			nextSlot = (nextSlot + 1) % (window + 1);
+			t.ops.push_back( { slot, sizes(rng) });
+			queue.push_back(slot);
+			if (queue.size() > window) {
+				t.ops.push_back( { queue.front(), 0 });
+				queue.pop_front();
+			}
+		}
+		for (uint32_t slot : queue) {
+			t.ops.push_back( { slot, 0 });
+		}
+		return t;
 	}
-	static void printPercentCompare(benchmarkDatum def, benchmarkDatum file) {
-		std::cout << "comp:\t" << percent(def.allocAvrg, file.allocAvrg)
-				<< seperator << percent(def.allocWorst, file.allocWorst)
-				<< seperator << percent(def.deallocAvrg, file.deallocAvrg)
-				<< seperator << percent(def.deallocWorst, file.deallocWorst)
-				<< "\n";
+
+	// request handling: allocate a batch of temporaries, then free them all
+	static trace phases(size_t opCount, size_t batch, uint32_t seed = 3) {
+		std::mt19937 rng(seed);
+		sizeDistribution sizes;
+		trace t { "phases", batch, { } };
+		while (t.ops.size() < opCount) {
+			for (uint32_t slot = 0; slot < batch; ++slot) {
+				t.ops.push_back( { slot, sizes(rng) });
+			}
+			for (uint32_t slot = 0; slot < batch; ++slot) {
+				t.ops.push_back( { static_cast<uint32_t>(batch - 1 - slot), 0 });
+			}
+		}
+		return t;
 	}
-	static void compareResults(benchmarkDatum def, benchmarkDatum file) {
-		printHeader();
-		printDatum("def:", def);
-		printDatum("file:", file);
-		printPercentCompare(def, file);
+
+	// page sized and bigger buffers
+	static trace largeBlocks(size_t opCount, size_t liveCount, uint32_t seed =
+			4) {
+		trace t = randomLifetime(opCount, liveCount, seed);
+		std::mt19937 rng(seed);
+		std::uniform_int_distribution<uint32_t> large(4096, 1 << 20);
+		for (auto &op : t.ops) {
+			if (op.size != 0) {
+				op.size = large(rng);
+			}
+		}
+		t.name = "largeBlocks";
+		return t;
 	}
+};
 
-	static void test() {
-		//RAIIFD fd("benchmarkAlloc.txt");
+struct suiteOptions {
+	size_t ops = 200000;
+	size_t warmupOps = 20000;
+	size_t repetitions = 3;
+	resultWriter::format fmt = resultWriter::format::table;
+	std::string only;
+	size_t maxThreads = std::max(1u, std::thread::hardware_concurrency());
+	// memory system suite: one heap per size, filled to memoryFill of its size
+	std::vector<size_t> memoryHeapSizes { 1ul << 30 };
+	double memoryFill = 0.25;
+	bool dropCache = false;
+	void *memoryHeapAdress = (void*) 0x600000000000;
+	const char *memoryHeapPath = "benchmarkMemory.bin";
+	// replays a recorded allocation trace against the simulated policies instead of running the suite
+	std::string replayTrace;
+	void *heapAdress = (void*) 0x500000000000;
+	size_t heapSize = 1ul << 32;
+	const char *heapPath = "benchmarkAlloc.txt";
+};
 
-		RAIIFD fd("benchmarkAlloc.txt");
-		void *ptr = (void*) 0x500000000000;
-		size_t memsz = 4096 * 5000;
-		inFileAllocator::detail::FileMemoryManagerHandler handler(fd, ptr,
-				memsz);
-		handler.setDefCstr();
+// Replays traces and container workloads, once with per operation timing
+// (latency mode) and then untimed (throughput mode, best of repetitions).
+// The heap is reset once per scenario, repetitions reuse what the previous one freed.
+class benchmarkSuite {
+	suiteOptions options;
+	resultWriter writer;
 
-		BenchmarkSingleAllocator<inFileAllocator::detail::fileAllocator<char>> fileAlloc;
-		BenchmarkSingleAllocator<std::allocator<char>> defAlloc;
+	template<typename Allocator>
+	static void replay(Allocator &alloc, const trace &t,
+			std::vector<std::pair<void*, uint32_t>> &slots, size_t limit,
+			latencyRecorder *latencies) {
+		size_t count = std::min(limit, t.ops.size());
+		for (size_t i = 0; i < count; ++i) {
+			const traceOp &op = t.ops[i];
+			auto &slot = slots[op.slot];
+			auto start = latencies ? clockT::now() : clockT::time_point();
+			if (op.size != 0) {
+				slot.first = alloc.allocate(op.size);
+				slot.second = op.size;
+				*static_cast<char*>(slot.first) = 1;
+			} else {
+				alloc.deallocate(slot.first, slot.second);
+				slot.first = nullptr;
+			}
+			if (latencies) {
+				latencies->add(clockT::now() - start);
+			}
+		}
+		for (auto &slot : slots) {
+			if (slot.first != nullptr) {
+				alloc.deallocate(slot.first, slot.second);
+				slot.first = nullptr;
+			}
+		}
+	}
 
-		std::cout << "allocateSmallSizesNoKeep\n";
-		compareResults(defAlloc.allocateSmallSizesNoKeep(),
-				fileAlloc.allocateSmallSizesNoKeep());
-		handler.getManager()->reset();
+	template<typename Allocator>
+	void runTrace(Allocator &alloc, const char *allocName, const trace &t) {
+		if (!options.only.empty() && options.only != t.name
+				&& options.only != allocName) {
+			return;
+		}
+		std::vector<std::pair<void*, uint32_t>> slots(t.slotCount, { nullptr,
+				0 });
+		benchmarkResult result;
+		result.suite = "trace";
+		result.scenario = t.name;
+		result.allocator = allocName;
+		result.ops = t.ops.size();
 
+		alloc.reset();
+		replay(alloc, t, slots, options.warmupOps, nullptr);
+		latencyRecorder latencies;
+		latencies.reserve(t.ops.size());
+		replay(alloc, t, slots, t.ops.size(), &latencies);
+		latencies.fill(result);
 
-		std::cout << "allocateSmallSizesYesKeep\n";
-				compareResults(defAlloc.allocateSmallSizesYesKeep(),
-						fileAlloc.allocateSmallSizesYesKeep());
-				handler.getManager()->reset();
+		double best = std::numeric_limits<double>::max();
+		for (size_t rep = 0; rep < options.repetitions; ++rep) {
+			auto start = clockT::now();
+			replay(alloc, t, slots, t.ops.size(), nullptr);
+			best = std::min(best,
+					std::chrono::duration<double>(clockT::now() - start).count());
+		}
+		result.seconds = best;
+		result.opsPerSec = t.ops.size() / best;
+		writer.write(result);
+	}
 
+	template<typename Allocator>
+	void runContainers(Allocator &alloc) {
+		if (!options.only.empty() && options.only != "containers"
+				&& options.only != Allocator::name) {
+			return;
+		}
+		using intAlloc = typename Allocator::template containerAllocator<int>;
+		using vecT = std::vector<int, intAlloc>;
+		using mapAlloc = typename Allocator::template containerAllocator<std::pair<const int, int>>;
+		using mapT = std::map<int, int, std::less<int>, mapAlloc>;
 
+		auto measure = [&](const char *scenario, size_t ops, auto body) {
+			benchmarkResult result;
+			result.suite = "container";
+			result.scenario = scenario;
+			result.allocator = Allocator::name;
+			result.ops = ops;
+			double best = std::numeric_limits<double>::max();
+			alloc.reset();
+			for (size_t rep = 0; rep < options.repetitions + 1; ++rep) {
+				auto start = clockT::now();
+				body();
+				double took = std::chrono::duration<double>(clockT::now() - start).count();
+				// the first round is warmup
+				if (rep != 0) {
+					best = std::min(best, took);
+				}
+			}
+			result.seconds = best;
+			result.opsPerSec = ops / best;
+			writer.write(result);
+		};
 
-		std::cout << "\n\nallocateAlotOnce\n";
-		compareResults(defAlloc.allocateAlotOnce(),
-				fileAlloc.allocateAlotOnce());
-		handler.getManager()->reset();
+		size_t vecCount = 1000;
+		size_t perVec = options.ops / vecCount;
+		measure("vectorGrowth", vecCount * perVec, [&]() {
+			std::vector<vecT> vecs(vecCount, vecT(alloc.template containerAlloc<int>()));
+			for (size_t i = 0; i < perVec; ++i) {
+				for (auto &vec : vecs) {
+					vec.push_back(static_cast<int>(i));
+				}
+			}
+		});
 
-		std::cout << "allocateDiffSizes\n";
-		compareResults(defAlloc.allocateDiffSizes(),
-				fileAlloc.allocateDiffSizes());
-		handler.getManager()->reset();
+		measure("mapChurn", options.ops, [&]() {
+			std::mt19937 rng(5);
+			mapT map(alloc.template containerAlloc<std::pair<const int, int>>());
+			for (size_t i = 0; i < options.ops; ++i) {
+				int key = static_cast<int>(rng() % 50000);
+				if (rng() % 3 == 0) {
+					map.erase(key);
+				} else {
+					map[key] = static_cast<int>(i);
+				}
+			}
+		});
+	}
+
+	// Runs body(threadIndex, latencies) on threadCount threads that start together,
+	// returns the wall time from the common start until the last thread is done.
+	template<typename F>
+	static double runThreads(size_t threadCount, F body,
+			std::vector<latencyRecorder> *latencies) {
+		std::atomic<size_t> ready { 0 };
+		std::atomic<bool> go { false };
+		std::vector<std::thread> threads;
+		for (size_t i = 0; i < threadCount; ++i) {
+			threads.emplace_back([&, i]() {
+				ready++;
+				while (!go.load(std::memory_order_acquire)) {
+					std::this_thread::yield();
+				}
+				body(i, latencies ? &(*latencies)[i] : nullptr);
+			});
+		}
+		while (ready.load() != threadCount) {
+			std::this_thread::yield();
+		}
+		auto start = clockT::now();
+		go.store(true, std::memory_order_release);
+		for (auto &t : threads) {
+			t.join();
+		}
+		return std::chrono::duration<double>(clockT::now() - start).count();
+	}
+
+	// One scenario at one thread count: an instrumented run for latencies and lock times,
+	// then untimed runs for throughput. body returns the number of operations it did.
+	template<typename Heap, typename F>
+	void measureThreads(Heap &heap, const char *scenario, const char *allocName,
+			size_t threadCount, F body) {
+		using lockTimes = typename Heap::lockTimes;
+		benchmarkResult result;
+		result.suite = "scale";
+		result.scenario = scenario;
+		result.allocator = allocName;
+		result.threads = threadCount;
+		std::atomic<size_t> ops { 0 };
+
+		heap.reset();
+		std::vector<latencyRecorder> latencies(threadCount);
+		std::vector<lockTimes> times(threadCount);
+		runThreads(threadCount, [&](size_t i, latencyRecorder *lat) {
+			Heap::times = &times[i];
+			ops += body(i, lat);
+			Heap::times = nullptr;
+		}, &latencies);
+		latencyRecorder all;
+		lockTimes allTimes;
+		for (size_t i = 0; i < threadCount; ++i) {
+			all.merge(latencies[i]);
+			allTimes.wait.merge(times[i].wait);
+			allTimes.hold.merge(times[i].hold);
+		}
+		all.fill(result);
+		result.ops = ops;
+
+		double best = std::numeric_limits<double>::max();
+		for (size_t rep = 0; rep < options.repetitions; ++rep) {
+			best = std::min(best, runThreads(threadCount, body, nullptr));
+		}
+		result.seconds = best;
+		result.opsPerSec = result.ops / best;
+		if (!allTimes.hold.empty()) {
+			result.extra.push_back( { "lock_hold_p50_ns",
+					allTimes.hold.percentile(0.5) });
+			result.extra.push_back( { "lock_hold_p99_ns",
+					allTimes.hold.percentile(0.99) });
+			result.extra.push_back( { "lock_wait_p50_ns",
+					allTimes.wait.percentile(0.5) });
+			result.extra.push_back( { "lock_wait_p99_ns",
+					allTimes.wait.percentile(0.99) });
+		}
+		writer.write(result);
+	}
+
+	template<typename Op>
+	static void timedOp(latencyRecorder *latencies, Op op) {
+		if (latencies == nullptr) {
+			op();
+			return;
+		}
+		auto start = clockT::now();
+		op();
+		latencies->add(clockT::now() - start);
+	}
+
+	// thread local, cross thread free and shared container workloads for 1, 2, 4, ... maxThreads
+	template<typename Heap>
+	void runScalability(Heap &heap, const char *allocName) {
+		if (!options.only.empty() && options.only != "scale"
+				&& options.only != allocName) {
+			return;
+		}
+		std::vector<size_t> threadCounts;
+		for (size_t n = 1; n < options.maxThreads; n *= 2) {
+			threadCounts.push_back(n);
+		}
+		threadCounts.push_back(options.maxThreads);
+		size_t opsPerThread = std::max<size_t>(options.ops / 4, 1000);
+
+		for (size_t threadCount : threadCounts) {
+			// every thread replays its own trace, the heap is the only thing shared
+			std::vector<trace> traces;
+			for (size_t i = 0; i < threadCount; ++i) {
+				traces.push_back(
+						traceGenerator::randomLifetime(opsPerThread, 1000,
+								static_cast<uint32_t>(i + 1)));
+			}
+			measureThreads(heap, "threadLocal", allocName, threadCount,
+					[&](size_t i, latencyRecorder *latencies) {
+						std::vector<std::pair<void*, uint32_t>> slots(
+								traces[i].slotCount, { nullptr, 0 });
+						replay(heap, traces[i], slots, traces[i].ops.size(),
+								latencies);
+						return traces[i].ops.size();
+					});
+
+			// thread i allocates and thread i+1 frees, in batches
+			std::vector<mailbox> mailboxes(threadCount);
+			measureThreads(heap, "crossThread", allocName, threadCount,
+					[&](size_t i, latencyRecorder *latencies) {
+						std::mt19937 rng(static_cast<uint32_t>(i + 1));
+						sizeDistribution sizes;
+						std::vector<std::pair<void*, uint32_t>> batch;
+						std::vector<std::pair<void*, uint32_t>> received;
+						size_t ops = 0;
+						auto drain = [&]() {
+							mailboxes[i].take(received);
+							for (auto &item : received) {
+								timedOp(latencies, [&]() {
+									heap.deallocate(item.first, item.second);
+								});
+							}
+							ops += received.size();
+							received.clear();
+						};
+						for (size_t n = 0; n < opsPerThread / 2; ++n) {
+							uint32_t size = sizes(rng);
+							void *ptr;
+							timedOp(latencies, [&]() {
+								ptr = heap.allocate(size);
+							});
+							*static_cast<char*>(ptr) = 1;
+							batch.push_back( { ptr, size });
+							if (batch.size() == 64) {
+								mailboxes[(i + 1) % threadCount].put(batch);
+								drain();
+							}
+						}
+						mailboxes[(i + 1) % threadCount].put(batch);
+						drain();
+						return opsPerThread / 2 + ops;
+					});
+			// blocks that arrived after their receiver was done
+			auto drainLeftovers = [&]() {
+				std::vector<std::pair<void*, uint32_t>> received;
+				for (auto &box : mailboxes) {
+					box.take(received);
+					for (auto &item : received) {
+						heap.deallocate(item.first, item.second);
+					}
+					received.clear();
+				}
+			};
+			drainLeftovers();
+
+			// one map behind its own mutex, its nodes come from the shared heap
+			using mapAlloc = sharedHeapAllocator<std::pair<const int, int>, Heap>;
+			using mapT = std::map<int, int, std::less<int>, mapAlloc>;
+			std::mutex mapMutex;
+			auto map = std::make_unique<mapT>(mapAlloc(&heap));
+			measureThreads(heap, "sharedContainer", allocName, threadCount,
+					[&](size_t i, latencyRecorder *latencies) {
+						std::mt19937 rng(static_cast<uint32_t>(i + 1));
+						for (size_t n = 0; n < opsPerThread; ++n) {
+							int key = static_cast<int>(rng() % 50000);
+							bool erase = rng() % 3 == 0;
+							timedOp(latencies, [&]() {
+								std::lock_guard<std::mutex> lock(mapMutex);
+								if (erase) {
+									map->erase(key);
+								} else {
+									(*map)[key] = static_cast<int>(n);
+								}
+							});
+						}
+						return opsPerThread;
+					});
+			map.reset();
+		}
+	}
+
+	static void touchPages(void *ptr, size_t size) {
+		for (size_t off = 0; off < size; off += inFileAllocator::detail::pageSize) {
+			static_cast<volatile char*>(ptr)[off] = 1;
+		}
+	}
+
+	static size_t readPages(void *ptr, size_t size) {
+		size_t sum = 0;
+		for (size_t off = 0; off < size; off += inFileAllocator::detail::pageSize) {
+			sum += static_cast<volatile char*>(ptr)[off];
+		}
+		return sum;
+	}
+
+	static double nsSince(clockT::time_point start) {
+		return std::chrono::duration<double, std::nano>(clockT::now() - start).count();
+	}
+
+	// Fills a heap of heapSize and reports, separately, the time spent inside the allocator
+	// and the time spent by the memory system: first touch of pages, writeback and reopening
+	// the file. The warm pass repeats the fill on pages that are already mapped, the
+	// difference to the cold pass is what faults cost the allocator itself.
+	void runMemoryHeap(size_t heapSize) {
+		using namespace inFileAllocator::detail;
+		benchmarkResult base;
+		base.suite = "memory";
+		base.allocator = "file";
+		auto row = [&](const char *scenario) {
+			benchmarkResult result = base;
+			result.scenario = scenario;
+			result.extra.push_back( { "heap_gb", heapSize / double(1ul << 30) });
+			return result;
+		};
+
+		unlink(options.memoryHeapPath);
+		RAIIFD fd(options.memoryHeapPath);
+		std::vector<std::pair<void*, uint32_t>> blocks;
+		size_t fillBytes = static_cast<size_t>(heapSize * options.memoryFill);
+		size_t pages = 0;
+		{
+			FileMemoryManagerHandler handler(fd, options.memoryHeapAdress,
+					heapSize);
+			FileMemoryManager *manager = handler.getManager();
+			std::mt19937 rng(6);
+			std::uniform_int_distribution<uint32_t> sizes(1024, 65536);
+
+			auto fill = [&](benchmarkResult &result, bool reuse) {
+				double allocNs = 0;
+				double touchNs = 0;
+				resourceUsage before = resourceUsage::now();
+				if (reuse) {
+					for (auto &b : blocks) {
+						auto start = clockT::now();
+						b.first = manager->allocate(b.second);
+						allocNs += nsSince(start);
+						start = clockT::now();
+						touchPages(b.first, b.second);
+						touchNs += nsSince(start);
+					}
+				} else {
+					size_t filled = 0;
+					while (filled < fillBytes) {
+						uint32_t size = sizes(rng);
+						auto start = clockT::now();
+						void *ptr = manager->allocate(size);
+						allocNs += nsSince(start);
+						start = clockT::now();
+						touchPages(ptr, size);
+						touchNs += nsSince(start);
+						blocks.push_back( { ptr, size });
+						filled += size;
+						pages += (size + pageSize - 1) / pageSize;
+					}
+				}
+				resourceUsage used = resourceUsage::now() - before;
+				result.ops = blocks.size();
+				result.seconds = (allocNs + touchNs) / 1e9;
+				result.opsPerSec = blocks.size() / result.seconds;
+				result.meanNs = (allocNs + touchNs) / blocks.size();
+				result.extra.push_back( { "allocator_ns_per_op", allocNs
+						/ blocks.size() });
+				result.extra.push_back( { "touch_ns_per_page", touchNs / pages });
+				result.extra.push_back( { "minor_faults", double(used.minorFaults) });
+				result.extra.push_back( { "major_faults", double(used.majorFaults) });
+			};
+
+			benchmarkResult cold = row("fillCold");
+			fill(cold, false);
+			writer.write(cold);
+
+			// dirty pages go to the file, the volume is what the block layer saw
+			benchmarkResult writeback = row("writeback");
+			resourceUsage before = resourceUsage::now();
+			auto start = clockT::now();
+			msync(options.memoryHeapAdress, manager->getFilehandler().size,
+					MS_SYNC);
+			writeback.seconds = nsSince(start) / 1e9;
+			resourceUsage used = resourceUsage::now() - before;
+			writeback.ops = pages;
+			writeback.opsPerSec = pages / writeback.seconds;
+			writeback.extra.push_back( { "write_mb", used.writeBytes / 1e6 });
+			writer.write(writeback);
+
+			for (auto &b : blocks) {
+				manager->deallocate(b.first, b.second);
+			}
+			benchmarkResult warm = row("fillWarm");
+			fill(warm, true);
+			writer.write(warm);
+			msync(options.memoryHeapAdress, manager->getFilehandler().size,
+					MS_SYNC);
+		}
+
+		// reopen with the file possibly evicted from the page cache, then read every live page
+		fsync(fd);
+		if (options.dropCache) {
+			posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		}
+		benchmarkResult coldOpen = row("coldOpen");
+		resourceUsage before = resourceUsage::now();
+		auto start = clockT::now();
+		{
+			FileMemoryManagerHandler handler(fd, options.memoryHeapAdress,
+					heapSize);
+			double openNs = nsSince(start);
+			auto readStart = clockT::now();
+			size_t sum = 0;
+			for (auto &b : blocks) {
+				sum += readPages(b.first, b.second);
+			}
+			double readNs = nsSince(readStart);
+			resourceUsage used = resourceUsage::now() - before;
+			coldOpen.ops = pages;
+			coldOpen.seconds = (openNs + readNs) / 1e9;
+			coldOpen.opsPerSec = pages / coldOpen.seconds;
+			coldOpen.extra.push_back( { "open_us", openNs / 1e3 });
+			coldOpen.extra.push_back( { "read_ns_per_page", readNs / pages });
+			coldOpen.extra.push_back( { "minor_faults", double(used.minorFaults) });
+			coldOpen.extra.push_back( { "major_faults", double(used.majorFaults) });
+			coldOpen.extra.push_back( { "read_mb", used.readBytes / 1e6 });
+			coldOpen.extra.push_back( { "cache_dropped", double(options.dropCache) });
+			coldOpen.extra.push_back( { "checksum", double(sum != 0) });
+			handler.getManager()->reset();
+		}
+		writer.write(coldOpen);
+		unlink(options.memoryHeapPath);
+	}
+
+	void runMemorySystem() {
+		if (!options.only.empty() && options.only != "memory") {
+			return;
+		}
+		for (size_t heapSize : options.memoryHeapSizes) {
+			runMemoryHeap(heapSize);
+		}
+	}
+
+	// Alloc/free churn on a live set larger than the caches, once per reuse policy. Every op
+	// frees a random live block, allocates one of the same size and writes all of it, so the
+	// policy decides whether that write lands on the block just freed or on a cold one.
+	void runReuse(inFileAllocator::detail::FileMemoryManager *manager) {
+		using namespace inFileAllocator::detail;
+		if (!options.only.empty() && options.only != "reuse") {
+			return;
+		}
+		const std::pair<reusePolicy, const char*> policies[] = { {
+				reusePolicy::lifo, "churnLifo" }, { reusePolicy::fifo,
+				"churnFifo" }, { reusePolicy::addressOrdered,
+				"churnAddressOrdered" } };
+		size_t liveCount = 200000;
+		cacheMissCounter misses;
+		reusePolicy previous = manager->getReusePolicy();
+		for (auto &policy : policies) {
+			manager->reset();
+			manager->setReusePolicy(policy.first);
+			std::mt19937 rng(9);
+			std::uniform_int_distribution<uint32_t> sizes(32, 480);
+			std::vector<std::pair<void*, uint32_t>> live(liveCount);
+			for (auto &block : live) {
+				block.second = sizes(rng);
+				block.first = manager->allocate(block.second);
+				memset(block.first, 1, block.second);
+			}
+			// half the blocks are freed first, so the lists hold blocks of every age
+			std::uniform_int_distribution<size_t> pick(0, liveCount - 1);
+			for (size_t i = 0; i < liveCount / 2; ++i) {
+				auto &block = live[pick(rng)];
+				if (block.first != nullptr) {
+					manager->deallocate(block.first, block.second);
+					block.first = nullptr;
+				}
+			}
+
+			benchmarkResult result;
+			result.suite = "reuse";
+			result.scenario = policy.second;
+			result.allocator = "file";
+			result.ops = options.ops;
+			resourceUsage before = resourceUsage::now();
+			if (misses.available()) {
+				misses.start();
+			}
+			auto start = clockT::now();
+			for (size_t i = 0; i < options.ops; ++i) {
+				auto &block = live[pick(rng)];
+				if (block.first != nullptr) {
+					manager->deallocate(block.first, block.second);
+				}
+				block.first = manager->allocate(block.second);
+				memset(block.first, static_cast<int>(i), block.second);
+			}
+			result.seconds = nsSince(start) / 1e9;
+			uint64_t missCount = misses.available() ? misses.stop() : 0;
+			resourceUsage used = resourceUsage::now() - before;
+			result.opsPerSec = options.ops / result.seconds;
+			result.meanNs = result.seconds * 1e9 / options.ops;
+			result.extra.push_back( { "minor_faults", double(used.minorFaults) });
+			result.extra.push_back( { "major_faults", double(used.majorFaults) });
+			if (misses.available()) {
+				result.extra.push_back( { "cache_misses_per_op", double(missCount)
+						/ options.ops });
+			}
+			result.extra.push_back( { "file_mb", manager->getFilehandler().size
+					/ 1e6 });
+			writer.write(result);
+		}
+		manager->reset();
+		manager->setReusePolicy(previous);
+	}
+
+public:
+	benchmarkSuite(suiteOptions _options, std::ostream &out) :
+			options(_options), writer(out, _options.fmt) {
+	}
+
+	resultWriter& getWriter() {
+		return writer;
+	}
+
+	const suiteOptions& getOptions() const {
+		return options;
+	}
+
+	// peak file size, fragmentation and class utilization of a recorded trace per policy
+	void replayRecorded() {
+		using namespace inFileAllocator::detail;
+		std::vector<traceEvent> events = readTrace(options.replayTrace);
+		for (auto &p : simulation::defaultPolicies()) {
+			simulation::report r = simulation::replay(events, *p);
+			if (options.fmt == resultWriter::format::table) {
+				simulation::writeReport(writer.stream(), r);
+				continue;
+			}
+			benchmarkResult result;
+			result.suite = "replay";
+			result.scenario = options.replayTrace;
+			result.allocator = r.policy;
+			result.ops = r.events;
+			result.extra.push_back( { "peak_file_bytes", double(r.peakFileBytes) });
+			result.extra.push_back( { "peak_requested_bytes", double(
+					r.peakRequestedBytes) });
+			result.extra.push_back( { "internal_fragmentation",
+					r.internalFragmentation });
+			result.extra.push_back( { "external_fragmentation",
+					r.externalFragmentation });
+			writer.write(result);
+		}
 	}
 
+	void run() {
+		if (!options.replayTrace.empty()) {
+			replayRecorded();
+			return;
+		}
+		std::vector<trace> traces;
+		traces.push_back(traceGenerator::randomLifetime(options.ops, 10000));
+		traces.push_back(traceGenerator::producerConsumer(options.ops, 1000));
+		traces.push_back(traceGenerator::phases(options.ops, 500));
+		traces.push_back(
+				traceGenerator::largeBlocks(options.ops / 20, 100));
+
+		RAIIFD fd(options.heapPath);
+		inFileAllocator::detail::FileMemoryManagerHandler handler(fd,
+				options.heapAdress, options.heapSize);
+		fileHeapAllocator fileAlloc { handler.getManager() };
+		stdHeapAllocator stdAlloc;
+		dlMallocAllocator jemalloc("jemalloc", { "libjemalloc.so.2",
+				"libjemalloc.so" });
+		dlMallocAllocator tcmalloc("tcmalloc", { "libtcmalloc_minimal.so.4",
+				"libtcmalloc.so.4" });
+#ifdef INFILEALLOCATOR_BENCH_BOOST
+		boostMappedFileAllocator boostAlloc("benchmarkBoost.bin",
+				options.heapSize / 4);
+#endif
+
+		for (auto &t : traces) {
+			runTrace(fileAlloc, fileAlloc.name, t);
+			runTrace(stdAlloc, stdAlloc.name, t);
+			if (jemalloc.available())
+				runTrace(jemalloc, jemalloc.name, t);
+			if (tcmalloc.available())
+				runTrace(tcmalloc, tcmalloc.name, t);
+#ifdef INFILEALLOCATOR_BENCH_BOOST
+			runTrace(boostAlloc, boostAlloc.name, t);
+#endif
+		}
+		runContainers(fileAlloc);
+		runContainers(stdAlloc);
+
+		// the file heap needs the external lock, malloc is shared as is
+		sharedHeap<fileHeapAllocator> fileShared(fileAlloc, true);
+		sharedHeap<stdHeapAllocator> stdShared(stdAlloc, false);
+		runScalability(fileShared, "file+lock");
+		runScalability(stdShared, "std");
+		runMemorySystem();
+		runReuse(handler.getManager());
+		handler.getManager()->reset();
+	}
 };
 
+// --format=table|csv|json --ops=N --reps=N --threads=N --only=scenario|allocator|reuse
+// --heap-sizes=1G,16G,100G --fill=0.25 --drop-cache --replay-trace=path
+inline suiteOptions parseOptions(int argc, char **argv) {
+	suiteOptions options;
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		auto value = [&](const char *prefix) -> const char* {
+			size_t len = strlen(prefix);
+			return arg.compare(0, len, prefix) == 0 ? argv[i] + len : nullptr;
+		};
+		if (const char *v = value("--format=")) {
+			std::string f = v;
+			options.fmt = f == "csv" ? resultWriter::format::csv :
+							f == "json" ?
+									resultWriter::format::json :
+									resultWriter::format::table;
+		} else if (const char *v = value("--ops=")) {
+			options.ops = std::stoul(v);
+			options.warmupOps = options.ops / 10;
+		} else if (const char *v = value("--reps=")) {
+			options.repetitions = std::max(1ul, std::stoul(v));
+		} else if (const char *v = value("--threads=")) {
+			options.maxThreads = std::max(1ul, std::stoul(v));
+		} else if (const char *v = value("--heap-sizes=")) {
+			options.memoryHeapSizes.clear();
+			std::stringstream list(v);
+			std::string item;
+			while (std::getline(list, item, ',')) {
+				size_t size = std::stoul(item);
+				switch (item.back()) {
+				case 'G':
+				case 'g':
+					size <<= 30;
+					break;
+				case 'M':
+				case 'm':
+					size <<= 20;
+					break;
+				}
+				options.memoryHeapSizes.push_back(size);
+			}
+		} else if (const char *v = value("--fill=")) {
+			options.memoryFill = std::stod(v);
+		} else if (const char *v = value("--replay-trace=")) {
+			options.replayTrace = v;
+		} else if (arg == "--drop-cache") {
+			options.dropCache = true;
+		} else if (const char *v = value("--only=")) {
+			options.only = v;
+		}
+	}
+	return options;
+}
+
+}
+
 #endif /* BENCHMARK_HPP_ */
@@ -0,0 +1,528 @@
+#ifndef INFILEBTREE_HPP_
+#define INFILEBTREE_HPP_
+
+#include "InFileAllocator.hpp"
+#include <immintrin.h>
+#include <type_traits>
+
+namespace inFileAllocator {
+namespace detail {
+
+// Key search inside a node: binary search down to a window of keys that fits a few
+// vector registers, then count the keys below the target with AVX2 when the cpu has it.
+namespace nodeSearch {
+
+constexpr size_t window = 32;
+
+inline bool hasAvx2() {
+	static const bool avx2 = __builtin_cpu_supports("avx2");
+	return avx2;
+}
+
+template<typename Key>
+constexpr bool vectorizable = std::is_integral_v<Key>
+		&& (sizeof(Key) == 4 || sizeof(Key) == 8);
+
+// ordering of unsigned keys survives the signed compare when the top bit is flipped
+template<typename Key>
+constexpr uint64_t signFlip =
+		std::is_signed_v<Key> ? 0 : static_cast<uint64_t>(1) << (sizeof(Key) * 8 - 1);
+
+template<typename Key>
+__attribute__((target("avx2"))) size_t countAvx2(const Key *keys, size_t n,
+		Key key, bool countLess) {
+	size_t count = 0;
+	size_t i = 0;
+	if constexpr (sizeof(Key) == 8) {
+		__m256i flip = _mm256_set1_epi64x(static_cast<int64_t>(signFlip<Key>));
+		__m256i target = _mm256_xor_si256(
+				_mm256_set1_epi64x(static_cast<int64_t>(key)), flip);
+		for (; i + 4 <= n; i += 4) {
+			__m256i k = _mm256_xor_si256(
+					_mm256_loadu_si256(reinterpret_cast<const __m256i*>(keys + i)),
+					flip);
+			__m256i cmp = countLess ?
+					_mm256_cmpgt_epi64(target, k) : _mm256_cmpgt_epi64(k, target);
+			count += __builtin_popcount(
+					_mm256_movemask_pd(_mm256_castsi256_pd(cmp)));
+		}
+	} else {
+		__m256i flip = _mm256_set1_epi32(static_cast<int32_t>(signFlip<Key>));
+		__m256i target = _mm256_xor_si256(
+				_mm256_set1_epi32(static_cast<int32_t>(key)), flip);
+		for (; i + 8 <= n; i += 8) {
+			__m256i k = _mm256_xor_si256(
+					_mm256_loadu_si256(reinterpret_cast<const __m256i*>(keys + i)),
+					flip);
+			__m256i cmp = countLess ?
+					_mm256_cmpgt_epi32(target, k) : _mm256_cmpgt_epi32(k, target);
+			count += __builtin_popcount(
+					_mm256_movemask_ps(_mm256_castsi256_ps(cmp)));
+		}
+	}
+	for (; i < n; ++i) {
+		count += countLess ? keys[i] < key : key < keys[i];
+	}
+	return count;
+}
+
+// keys[0..n) < key when countLess, else key < keys[0..n)
+template<typename Key>
+size_t count(const Key *keys, size_t n, const Key &key, bool countLess) {
+	if constexpr (vectorizable<Key>) {
+		if (hasAvx2()) {
+			return countAvx2(keys, n, key, countLess);
+		}
+	}
+	size_t count = 0;
+	for (size_t i = 0; i < n; ++i) {
+		count += countLess ? keys[i] < key : key < keys[i];
+	}
+	return count;
+}
+
+// first index with keys[i] >= key
+template<typename Key>
+size_t lowerBound(const Key *keys, size_t n, const Key &key) {
+	size_t lo = 0;
+	size_t hi = n;
+	while (hi - lo > window) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (keys[mid] < key) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo + count(keys + lo, hi - lo, key, true);
+}
+
+// first index with keys[i] > key
+template<typename Key>
+size_t upperBound(const Key *keys, size_t n, const Key &key) {
+	size_t lo = 0;
+	size_t hi = n;
+	while (hi - lo > window) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (key < keys[mid]) {
+			hi = mid;
+		} else {
+			lo = mid + 1;
+		}
+	}
+	return hi - count(keys + lo, hi - lo, key, false);
+}
+
+}
+
+// B+tree whose nodes are NodeSize blocks of the file heap, so a lookup touches one page
+// per level: with 4KiB nodes and 8 byte keys an inner node holds 255 children and
+// four levels cover more than four billion keys. Values live in the leaves only and
+// the leaves are chained for range scans. Keys and values are copied as bytes.
+// The tree object itself can live in the heap (objectManager::aquire), node pointers stay
+// valid because the heap is always mapped at the same address.
+// Erase does not rebalance, leaves can become underfull or empty and are only freed by clear.
+template<typename Key, typename Value, size_t NodeSize = pageSize>
+class fileBTree {
+	static_assert(std::is_trivially_copyable_v<Key>);
+	static_assert(std::is_trivially_copyable_v<Value>);
+	static_assert(isPowerOf2<NodeSize> && NodeSize >= 256);
+
+	struct nodeHeader {
+		uint32_t count;
+		uint32_t isLeaf;
+		nodeHeader *next; // next leaf, unused in inner nodes
+	};
+
+	static constexpr size_t leafCapacity = (NodeSize - sizeof(nodeHeader))
+			/ (sizeof(Key) + sizeof(Value));
+	static constexpr size_t innerCapacity = (NodeSize - sizeof(nodeHeader)
+			- sizeof(void*)) / (sizeof(Key) + sizeof(void*));
+	static_assert(leafCapacity >= 4 && innerCapacity >= 4);
+
+	struct leafNode {
+		nodeHeader header;
+		Key keys[leafCapacity];
+		Value values[leafCapacity];
+	};
+
+	struct innerNode {
+		nodeHeader header;
+		Key keys[innerCapacity];
+		nodeHeader *children[innerCapacity + 1];
+	};
+	static_assert(sizeof(leafNode) <= NodeSize && sizeof(innerNode) <= NodeSize);
+
+	static constexpr size_t requestSize = NodeSize;
+
+	FileMemoryManager *manager;
+	nodeHeader *root = nullptr;
+	leafNode *firstLeaf = nullptr;
+	size_t height = 0; // levels including the leaves
+	size_t count = 0;
+
+	static leafNode* asLeaf(nodeHeader *node) {
+		return reinterpret_cast<leafNode*>(node);
+	}
+
+	static innerNode* asInner(nodeHeader *node) {
+		return reinterpret_cast<innerNode*>(node);
+	}
+
+	nodeHeader* newNode(bool isLeaf) {
+		nodeHeader *node = reinterpret_cast<nodeHeader*>(manager->allocate(
+				requestSize));
+		node->count = 0;
+		node->isLeaf = isLeaf;
+		node->next = nullptr;
+		return node;
+	}
+
+	void freeNode(nodeHeader *node) {
+		manager->deallocate(node, requestSize);
+	}
+
+	void freeSubtree(nodeHeader *node) {
+		if (!node->isLeaf) {
+			innerNode *inner = asInner(node);
+			for (size_t i = 0; i <= inner->header.count; ++i) {
+				freeSubtree(inner->children[i]);
+			}
+		}
+		freeNode(node);
+	}
+
+	leafNode* findLeaf(const Key &key) const {
+		nodeHeader *node = root;
+		while (node != nullptr && !node->isLeaf) {
+			innerNode *inner = asInner(node);
+			node = inner->children[nodeSearch::upperBound(inner->keys,
+					inner->header.count, key)];
+		}
+		return asLeaf(node);
+	}
+
+	bool isFull(nodeHeader *node) const {
+		return node->count
+				== (node->isLeaf ? leafCapacity : innerCapacity);
+	}
+
+	// splits the full child idx of parent, which has room for one more key
+	void splitChild(innerNode *parent, size_t idx) {
+		nodeHeader *child = parent->children[idx];
+		nodeHeader *right = newNode(child->isLeaf);
+		Key separator;
+		if (child->isLeaf) {
+			leafNode *l = asLeaf(child);
+			leafNode *r = asLeaf(right);
+			size_t keep = leafCapacity / 2;
+			size_t move = l->header.count - keep;
+			memcpy(r->keys, l->keys + keep, move * sizeof(Key));
+			memcpy(r->values, l->values + keep, move * sizeof(Value));
+			l->header.count = keep;
+			r->header.count = move;
+			r->header.next = l->header.next;
+			l->header.next = right;
+			separator = r->keys[0];
+		} else {
+			innerNode *l = asInner(child);
+			innerNode *r = asInner(right);
+			size_t mid = innerCapacity / 2;
+			size_t move = l->header.count - mid - 1;
+			separator = l->keys[mid];
+			memcpy(r->keys, l->keys + mid + 1, move * sizeof(Key));
+			memcpy(r->children, l->children + mid + 1,
+					(move + 1) * sizeof(nodeHeader*));
+			l->header.count = mid;
+			r->header.count = move;
+		}
+		size_t n = parent->header.count;
+		memmove(parent->keys + idx + 1, parent->keys + idx,
+				(n - idx) * sizeof(Key));
+		memmove(parent->children + idx + 2, parent->children + idx + 1,
+				(n - idx) * sizeof(nodeHeader*));
+		parent->keys[idx] = separator;
+		parent->children[idx + 1] = right;
+		parent->header.count = n + 1;
+	}
+
+	static void prefetchNode(const void *node) {
+		for (size_t off = 0; off < std::min<size_t>(NodeSize, 256); off += 64) {
+			__builtin_prefetch(static_cast<const char*>(node) + off);
+		}
+	}
+
+public:
+	// position in a leaf, end() has no leaf
+	class iterator {
+		leafNode *leaf;
+		size_t index;
+		bool adviseNext;
+
+		void skipEmpty() {
+			while (leaf != nullptr && index >= leaf->header.count) {
+				leaf = asLeaf(leaf->header.next);
+				index = 0;
+				if (leaf != nullptr) {
+					prefetchNext();
+				}
+			}
+		}
+
+		// the next leaf is loaded while this one is read, cold pages are read ahead by the kernel
+		void prefetchNext() {
+			nodeHeader *next = leaf->header.next;
+			if (next == nullptr) {
+				return;
+			}
+			prefetchNode(next);
+			if (adviseNext && NodeSize >= pageSize) {
+				madvise(next, NodeSize, MADV_WILLNEED);
+			}
+		}
+
+	public:
+		iterator(leafNode *_leaf, size_t _index, bool _adviseNext = false) :
+				leaf(_leaf), index(_index), adviseNext(_adviseNext) {
+			if (leaf != nullptr) {
+				prefetchNext();
+			}
+			skipEmpty();
+		}
+
+		const Key& key() const {
+			return leaf->keys[index];
+		}
+
+		Value& value() const {
+			return leaf->values[index];
+		}
+
+		iterator& operator++() {
+			index++;
+			skipEmpty();
+			return *this;
+		}
+
+		bool operator==(const iterator &other) const {
+			return leaf == other.leaf && (leaf == nullptr || index == other.index);
+		}
+
+		bool operator!=(const iterator &other) const {
+			return !(*this == other);
+		}
+	};
+
+	fileBTree(FileMemoryManager *_manager) :
+			manager(_manager) {
+	}
+
+	fileBTree(const fileBTree&) = delete;
+	fileBTree& operator=(const fileBTree&) = delete;
+
+	~fileBTree() {
+		clear();
+	}
+
+	void clear() {
+		if (root != nullptr) {
+			freeSubtree(root);
+		}
+		root = nullptr;
+		firstLeaf = nullptr;
+		height = 0;
+		count = 0;
+	}
+
+	size_t size() const {
+		return count;
+	}
+
+	bool empty() const {
+		return count == 0;
+	}
+
+	size_t getHeight() const {
+		return height;
+	}
+
+	static constexpr size_t getLeafCapacity() {
+		return leafCapacity;
+	}
+
+	static constexpr size_t getInnerCapacity() {
+		return innerCapacity;
+	}
+
+	// returns false and leaves the value alone when key is already there
+	bool insert(const Key &key, const Value &value) {
+		if (root == nullptr) {
+			root = newNode(true);
+			firstLeaf = asLeaf(root);
+			height = 1;
+		}
+		// full nodes are split on the way down, so a split never has to go back up
+		if (isFull(root)) {
+			innerNode *newRoot = asInner(newNode(false));
+			newRoot->children[0] = root;
+			splitChild(newRoot, 0);
+			root = &newRoot->header;
+			height++;
+		}
+		nodeHeader *node = root;
+		while (!node->isLeaf) {
+			innerNode *inner = asInner(node);
+			size_t idx = nodeSearch::upperBound(inner->keys, inner->header.count,
+					key);
+			if (isFull(inner->children[idx])) {
+				splitChild(inner, idx);
+				if (!(key < inner->keys[idx])) {
+					idx++;
+				}
+			}
+			node = inner->children[idx];
+		}
+		leafNode *leaf = asLeaf(node);
+		size_t n = leaf->header.count;
+		size_t pos = nodeSearch::lowerBound(leaf->keys, n, key);
+		if (pos < n && !(key < leaf->keys[pos])) {
+			return false;
+		}
+		memmove(leaf->keys + pos + 1, leaf->keys + pos, (n - pos) * sizeof(Key));
+		memmove(leaf->values + pos + 1, leaf->values + pos,
+				(n - pos) * sizeof(Value));
+		leaf->keys[pos] = key;
+		leaf->values[pos] = value;
+		leaf->header.count = n + 1;
+		count++;
+		return true;
+	}
+
+	Value* find(const Key &key) {
+		leafNode *leaf = findLeaf(key);
+		if (leaf == nullptr) {
+			return nullptr;
+		}
+		size_t pos = nodeSearch::lowerBound(leaf->keys, leaf->header.count, key);
+		if (pos < leaf->header.count && !(key < leaf->keys[pos])) {
+			return &leaf->values[pos];
+		}
+		return nullptr;
+	}
+
+	bool erase(const Key &key) {
+		leafNode *leaf = findLeaf(key);
+		if (leaf == nullptr) {
+			return false;
+		}
+		size_t n = leaf->header.count;
+		size_t pos = nodeSearch::lowerBound(leaf->keys, n, key);
+		if (pos == n || key < leaf->keys[pos]) {
+			return false;
+		}
+		memmove(leaf->keys + pos, leaf->keys + pos + 1,
+				(n - pos - 1) * sizeof(Key));
+		memmove(leaf->values + pos, leaf->values + pos + 1,
+				(n - pos - 1) * sizeof(Value));
+		leaf->header.count = n - 1;
+		count--;
+		return true;
+	}
+
+	// Builds the tree bottom up from pairs sorted by unique, ascending key. Leaves are
+	// filled to fill of their capacity, leaving room for later inserts. The tree has to be empty.
+	template<typename It>
+	void bulkLoad(It first, It last, double fill = 1.0) {
+		if (root != nullptr) {
+			throw std::runtime_error("fileBTree::bulkLoad on a tree that is not empty");
+		}
+		size_t perLeaf = std::max<size_t>(1,
+				std::min<size_t>(leafCapacity, leafCapacity * fill));
+		std::vector<std::pair<Key, nodeHeader*>> level;
+		leafNode *previous = nullptr;
+		for (It it = first; it != last;) {
+			leafNode *leaf = asLeaf(newNode(true));
+			while (it != last && leaf->header.count < perLeaf) {
+				leaf->keys[leaf->header.count] = it->first;
+				leaf->values[leaf->header.count] = it->second;
+				leaf->header.count++;
+				++it;
+			}
+			count += leaf->header.count;
+			if (previous != nullptr) {
+				previous->header.next = &leaf->header;
+			} else {
+				firstLeaf = leaf;
+			}
+			previous = leaf;
+			level.push_back( { leaf->keys[0], &leaf->header });
+		}
+		if (level.empty()) {
+			return;
+		}
+		height = 1;
+		while (level.size() > 1) {
+			std::vector<std::pair<Key, nodeHeader*>> parents;
+			size_t perInner = innerCapacity + 1;
+			for (size_t i = 0; i < level.size();) {
+				size_t end = std::min(level.size(), i + perInner);
+				// do not leave a single child for the last node
+				if (level.size() - end == 1) {
+					end--;
+				}
+				innerNode *inner = asInner(newNode(false));
+				inner->children[0] = level[i].second;
+				for (size_t c = i + 1; c < end; ++c) {
+					inner->keys[c - i - 1] = level[c].first;
+					inner->children[c - i] = level[c].second;
+				}
+				inner->header.count = end - i - 1;
+				parents.push_back( { level[i].first, &inner->header });
+				i = end;
+			}
+			level.swap(parents);
+			height++;
+		}
+		root = level[0].second;
+	}
+
+	iterator begin(bool adviseNext = false) {
+		return iterator(firstLeaf, 0, adviseNext);
+	}
+
+	iterator end() {
+		return iterator(nullptr, 0);
+	}
+
+	// first entry with a key not below key
+	iterator lowerBound(const Key &key, bool adviseNext = false) {
+		leafNode *leaf = findLeaf(key);
+		if (leaf == nullptr) {
+			return end();
+		}
+		return iterator(leaf,
+				nodeSearch::lowerBound(leaf->keys, leaf->header.count, key),
+				adviseNext);
+	}
+
+	// calls func(key, value) for keys in [from, to), returns how many it visited.
+	// adviseNext asks the kernel for each next leaf, for trees that are not in the page cache
+	template<typename F>
+	size_t scan(const Key &from, const Key &to, F func, bool adviseNext = false) {
+		size_t visited = 0;
+		for (iterator it = lowerBound(from, adviseNext); it != end(); ++it) {
+			if (!(it.key() < to)) {
+				break;
+			}
+			func(it.key(), it.value());
+			visited++;
+		}
+		return visited;
+	}
+
+};
+
+}
+}
+
+#endif /* INFILEBTREE_HPP_ */
@@ -0,0 +1,433 @@
+#ifndef INFILECHECKSUM_HPP_
+#define INFILECHECKSUM_HPP_
+
+#include "InFileAllocator.hpp"
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <thread>
+
+namespace inFileAllocator {
+namespace detail {
+
+// crc32c (Castagnoli), with the SSE4.2 crc32 instruction where the cpu has it.
+namespace crc32c {
+
+constexpr uint32_t polynomial = 0x82f63b78;
+
+inline const uint32_t* table() {
+	static const std::array<uint32_t, 256> values = [] {
+		std::array<uint32_t, 256> t { };
+		for (uint32_t i = 0; i < 256; ++i) {
+			uint32_t crc = i;
+			for (int bit = 0; bit < 8; ++bit) {
+				crc = (crc >> 1) ^ (crc & 1 ? polynomial : 0);
+			}
+			t[i] = crc;
+		}
+		return t;
+	}();
+	return values.data();
+}
+
+INFILEALLOCATOR_NO_ASAN inline uint32_t software(uint32_t crc, const uint8_t *data, size_t len) {
+	const uint32_t *t = table();
+	for (size_t i = 0; i < len; ++i) {
+		crc = t[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+	}
+	return crc;
+}
+
+#if defined(__x86_64__)
+inline bool hasHardware() {
+	static const bool has = __builtin_cpu_supports("sse4.2");
+	return has;
+}
+
+__attribute__((target("sse4.2"))) INFILEALLOCATOR_NO_ASAN inline uint32_t hardware(uint32_t crc,
+		const uint8_t *data, size_t len) {
+	uint64_t c = crc;
+	size_t i = 0;
+	for (; i + 8 <= len; i += 8) {
+		uint64_t word;
+		memcpy(&word, data + i, sizeof(word));
+		c = __builtin_ia32_crc32di(c, word);
+	}
+	for (; i < len; ++i) {
+		c = __builtin_ia32_crc32qi(static_cast<uint32_t>(c), data[i]);
+	}
+	return static_cast<uint32_t>(c);
+}
+
+// The instruction takes 3 cycles but starts one per cycle, so four independent buffers
+// run close to three times as fast as one.
+__attribute__((target("sse4.2"))) INFILEALLOCATOR_NO_ASAN inline void hardware4(uint32_t crc[4],
+		const uint8_t *const data[4], size_t len) {
+	uint64_t c[4] = { crc[0], crc[1], crc[2], crc[3] };
+	size_t i = 0;
+	for (; i + 8 <= len; i += 8) {
+		for (int j = 0; j < 4; ++j) {
+			uint64_t word;
+			memcpy(&word, data[j] + i, sizeof(word));
+			c[j] = __builtin_ia32_crc32di(c[j], word);
+		}
+	}
+	for (int j = 0; j < 4; ++j) {
+		crc[j] = hardware(static_cast<uint32_t>(c[j]), data[j] + i, len - i);
+	}
+}
+#else
+inline bool hasHardware() {
+	return false;
+}
+#endif
+
+inline uint32_t compute(const void *data, size_t len) {
+	auto *bytes = static_cast<const uint8_t*>(data);
+#if defined(__x86_64__)
+	if (hasHardware()) {
+		return ~hardware(~0u, bytes, len);
+	}
+#endif
+	return ~software(~0u, bytes, len);
+}
+
+// checksums of count buffers, buffers of the same length next to each other go four at once
+inline void computeMany(const uint8_t *const *data, const size_t *lens,
+		size_t count, uint32_t *out) {
+	size_t i = 0;
+#if defined(__x86_64__)
+	if (hasHardware()) {
+		for (; i + 4 <= count; i += 4) {
+			if (lens[i] != lens[i + 1] || lens[i] != lens[i + 2]
+					|| lens[i] != lens[i + 3]) {
+				break;
+			}
+			uint32_t crc[4] = { ~0u, ~0u, ~0u, ~0u };
+			hardware4(crc, data + i, lens[i]);
+			for (int j = 0; j < 4; ++j) {
+				out[i + j] = ~crc[j];
+			}
+		}
+	}
+#endif
+	for (; i < count; ++i) {
+		out[i] = compute(data[i], lens[i]);
+	}
+}
+
+}
+
+// Checksums of the heap file in extents of 2^extentPow bytes, kept in a sidecar file.
+// commit brings the checksums of the extents written since the last commit up to date and
+// makes heap and sidecar durable, verify and heapScrubber compare the heap with them.
+//
+// The allocator marks the extents it writes. Writes of the application into blocks it got
+// before the last commit have to be announced with markDirty, before writing. Extents
+// written since the last commit are never reported, so the heap may be used while it is
+// scrubbed, but commit needs the writers to pause. The header is written without marking,
+// so its extent is only verified where the heap is opened read only. A crash between
+// syncing the heap and writing the sidecar makes the extents of that commit fail; commit
+// again once the heap is known good.
+class heapChecksums {
+	struct sidecarHeader {
+		uint64_t magic;
+		uint64_t extentPow;
+		uint64_t committedSize;
+	};
+	static constexpr uint64_t sidecarMagic = 0x6372633332630001;
+
+	FileMemoryManagerHandler &handler;
+	MemoryFileHandler &fileHandler;
+	int sidecarFd;
+	size_t extentPow;
+	size_t capacity;
+	std::unique_ptr<std::atomic<uint32_t>[]> sums;
+	std::unique_ptr<std::atomic<uint64_t>[]> dirty;
+	// bytes of the file the checksums cover, the last extent may be partial
+	std::atomic<size_t> committedSize { 0 };
+	std::mutex commitMutex;
+	dirtyTracking::tracker *tracker = nullptr;
+
+	size_t extentSize() const {
+		return static_cast<size_t>(1) << extentPow;
+	}
+
+	bool isDirty(size_t extent) const {
+		return (dirty[extent / 64].load() >> (extent % 64)) & 1;
+	}
+
+	Forceduint8_t* extentAdress(size_t extent) const {
+		return fileHandler.dataAdress + (extent << extentPow);
+	}
+
+	size_t extentLength(size_t extent, size_t end) const {
+		return std::min(extentSize(), end - (extent << extentPow));
+	}
+
+	void computeExtents(const std::vector<size_t> &extents, size_t end,
+			uint32_t *out) const {
+		std::vector<const uint8_t*> data(extents.size());
+		std::vector<size_t> lens(extents.size());
+		for (size_t i = 0; i < extents.size(); ++i) {
+			data[i] = extentAdress(extents[i]);
+			lens[i] = extentLength(extents[i], end);
+		}
+		crc32c::computeMany(data.data(), lens.data(), extents.size(), out);
+	}
+
+	void writeSidecar(const void *data, size_t len, off_t offset) {
+		auto *bytes = static_cast<const uint8_t*>(data);
+		while (len != 0) {
+			ssize_t n = pwrite(sidecarFd, bytes, len, offset);
+			if (n < 0 && errno == EINTR) {
+				continue;
+			}
+			if (n <= 0) {
+				throw std::runtime_error("heapChecksums: failed to write sidecar");
+			}
+			bytes += n;
+			len -= n;
+			offset += n;
+		}
+	}
+
+	void loadSidecar() {
+		sidecarHeader header { };
+		if (pread(sidecarFd, &header, sizeof(header), 0)
+				!= static_cast<ssize_t>(sizeof(header))
+				|| header.magic != sidecarMagic || header.extentPow != extentPow) {
+			return;
+		}
+		size_t size = std::min<size_t>(header.committedSize,
+				capacity << extentPow);
+		size_t count = (size + extentSize() - 1) >> extentPow;
+		std::vector<uint32_t> stored(count);
+		if (pread(sidecarFd, stored.data(), count * sizeof(uint32_t),
+				sizeof(header)) != static_cast<ssize_t>(count * sizeof(uint32_t))) {
+			return;
+		}
+		for (size_t i = 0; i < count; ++i) {
+			sums[i].store(stored[i]);
+		}
+		committedSize.store(size);
+	}
+
+public:
+	heapChecksums(FileMemoryManagerHandler &_handler, int _sidecarFd,
+			size_t _extentPow = 16) :
+			handler(_handler), fileHandler(
+					_handler.getManager()->getFilehandler()), sidecarFd(
+					_sidecarFd), extentPow(_extentPow) {
+		if (extentPow < 12 || extentPow > 30) {
+			throw std::runtime_error(
+					"heapChecksums: extents have to be between a page and 1GiB");
+		}
+		size_t bytes = std::max(fileHandler.reservedMemSize + pageSize,
+				fileHandler.size);
+		capacity = (bytes + extentSize() - 1) >> extentPow;
+		sums.reset(new std::atomic<uint32_t>[capacity]());
+		dirty.reset(new std::atomic<uint64_t>[(capacity + 63) / 64]());
+		loadSidecar();
+		if (!handler.isReadOnly()) {
+			tracker = dirtyTracking::attach(fileHandler.dataAdress, dirty.get(),
+					extentPow);
+			dirty[0].fetch_or(1);
+		}
+	}
+
+	heapChecksums(const heapChecksums&) = delete;
+
+	~heapChecksums() {
+		if (tracker != nullptr) {
+			dirtyTracking::detach(tracker);
+		}
+	}
+
+	// before writing len bytes at ptr in a block that was allocated before the last commit
+	void markDirty(const void *ptr, size_t len) {
+		fileHandler.touchedRange(ptr, len);
+	}
+
+	// Recomputes the checksums of the extents written since the last commit, syncs the heap
+	// and then the sidecar. Returns the number of extents that were recomputed.
+	size_t commit() {
+		std::lock_guard<std::mutex> lock(commitMutex);
+		if (handler.isReadOnly()) {
+			throw std::runtime_error("heapChecksums: a read only heap can not commit");
+		}
+		size_t end = fileHandler.size;
+		size_t count = (end + extentSize() - 1) >> extentPow;
+		// the header is written without marking, the old last extent may have grown
+		size_t firstNew = committedSize.load() >> extentPow;
+		std::vector<size_t> extents { 0 };
+		for (size_t word = 0; word < (capacity + 63) / 64; ++word) {
+			uint64_t bits = dirty[word].exchange(0);
+			for (size_t extent = word * 64; extent < word * 64 + 64; ++extent) {
+				if (extent != 0 && extent < count
+						&& (((bits >> (extent % 64)) & 1) || extent >= firstNew)) {
+					extents.push_back(extent);
+				}
+			}
+		}
+		std::vector<uint32_t> values(extents.size());
+		computeExtents(extents, end, values.data());
+		for (size_t i = 0; i < extents.size(); ++i) {
+			sums[extents[i]].store(values[i]);
+		}
+
+		if (msync(fileHandler.dataAdress, end, MS_SYNC) != 0
+				|| fdatasync(fileHandler.fd) != 0) {
+			throw std::runtime_error("heapChecksums: failed to sync heap");
+		}
+		// runs of changed checksums go out in one write each
+		for (size_t i = 0; i < extents.size();) {
+			size_t j = i + 1;
+			while (j < extents.size() && extents[j] == extents[j - 1] + 1) {
+				++j;
+			}
+			writeSidecar(values.data() + i, (j - i) * sizeof(uint32_t),
+					sizeof(sidecarHeader) + extents[i] * sizeof(uint32_t));
+			i = j;
+		}
+		sidecarHeader header { sidecarMagic, extentPow, end };
+		writeSidecar(&header, sizeof(header), 0);
+		if (ftruncate(sidecarFd, sizeof(header) + count * sizeof(uint32_t)) != 0
+				|| fdatasync(sidecarFd) != 0) {
+			throw std::runtime_error("heapChecksums: failed to sync sidecar");
+		}
+		committedSize.store(end);
+		dirty[0].fetch_or(1);
+		return extents.size();
+	}
+
+	// Checks the committed extents from first up to first + count that were not written since
+	// the last commit, returns the file offsets of those that do not match.
+	std::vector<off_t> verifyExtents(size_t first, size_t count) {
+		size_t end = std::min(committedSize.load(), fileHandler.size);
+		std::vector<size_t> extents;
+		for (size_t extent = first; extent < first + count; ++extent) {
+			if ((extent + 1) << extentPow > end
+					&& (extent << extentPow >= end
+							|| end != committedSize.load())) {
+				break;
+			}
+			if (!isDirty(extent)) {
+				extents.push_back(extent);
+			}
+		}
+		std::vector<uint32_t> values(extents.size());
+		computeExtents(extents, end, values.data());
+		std::vector<off_t> bad;
+		for (size_t i = 0; i < extents.size(); ++i) {
+			// a write that raced with the computation marked its extent first
+			if (values[i] != sums[extents[i]].load() && !isDirty(extents[i])) {
+				bad.push_back(static_cast<off_t>(extents[i] << extentPow));
+			}
+		}
+		return bad;
+	}
+
+	std::vector<off_t> verify(const void *ptr, size_t len) {
+		size_t offset = fileHandler.fileOffset(ptr);
+		size_t first = offset >> extentPow;
+		return verifyExtents(first,
+				((offset + std::max<size_t>(len, 1) - 1) >> extentPow) - first + 1);
+	}
+
+	std::vector<off_t> verifyAll() {
+		return verifyExtents(0, extentCount());
+	}
+
+	// extents the checksums cover
+	size_t extentCount() const {
+		return (committedSize.load() + extentSize() - 1) >> extentPow;
+	}
+
+	size_t getExtentPow() const {
+		return extentPow;
+	}
+};
+
+// Verifies the whole heap over and over from a background thread, a batch of extents at a
+// time and at most bytesPerSecond (0 for no limit), and calls onCorrupt with the file offset
+// of every extent that fails. It takes no lock of the heap.
+class heapScrubber {
+	heapChecksums &checksums;
+	std::function<void(off_t)> onCorrupt;
+	size_t bytesPerSecond;
+	std::chrono::milliseconds pause;
+	std::atomic<size_t> passes { 0 };
+	std::mutex mutex;
+	std::condition_variable cond;
+	bool stopping = false;
+	std::thread worker;
+
+	static constexpr size_t batchExtents = 64;
+
+	void run() {
+		std::unique_lock<std::mutex> lock(mutex);
+		do {
+			size_t count = checksums.extentCount();
+			for (size_t first = 0; first < count && !stopping; first +=
+					batchExtents) {
+				lock.unlock();
+				auto start = std::chrono::steady_clock::now();
+				for (off_t offset : checksums.verifyExtents(first, batchExtents)) {
+					onCorrupt(offset);
+				}
+				lock.lock();
+				if (bytesPerSecond != 0) {
+					auto budget = std::chrono::nanoseconds(
+							static_cast<int64_t>(static_cast<unsigned __int128>(
+									batchExtents << checksums.getExtentPow())
+									* 1000000000u / bytesPerSecond));
+					cond.wait_until(lock, start + budget, [&] {
+						return stopping;
+					});
+				}
+			}
+			if (!stopping) {
+				passes.fetch_add(1);
+				cond.notify_all();
+			}
+		} while (!cond.wait_for(lock, pause, [&] {
+			return stopping;
+		}));
+	}
+
+public:
+	heapScrubber(heapChecksums &_checksums,
+			std::function<void(off_t)> _onCorrupt, size_t _bytesPerSecond = 0,
+			std::chrono::milliseconds _pause = std::chrono::seconds(60)) :
+			checksums(_checksums), onCorrupt(std::move(_onCorrupt)), bytesPerSecond(
+					_bytesPerSecond), pause(_pause), worker(&heapScrubber::run,
+					this) {
+	}
+
+	~heapScrubber() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		cond.notify_all();
+		worker.join();
+	}
+
+	size_t completedPasses() const {
+		return passes.load();
+	}
+
+	// blocks until count passes are done
+	void waitForPasses(size_t count) {
+		std::unique_lock<std::mutex> lock(mutex);
+		cond.wait(lock, [&] {
+			return passes.load() >= count;
+		});
+	}
+};
+
+}
+}
+
+#endif /* INFILECHECKSUM_HPP_ */
@@ -0,0 +1,199 @@
+#ifndef INFILECOMPACTOR_HPP_
+#define INFILECOMPACTOR_HPP_
+
+#include "InFileAllocator.hpp"
+#include <chrono>
+#include <iterator>
+
+namespace inFileAllocator {
+namespace detail {
+
+struct compactionStats {
+	size_t itemsVisited = 0;
+	size_t blocksMoved = 0;
+	size_t bytesMoved = 0;
+	size_t bytesPunched = 0;
+	size_t bytesTrimmed = 0;
+	size_t passes = 0;
+};
+
+// Incrementally moves registered blocks into lower free blocks of their size class,
+// then punches out free chunks and truncates the free tail of the file.
+// Work is split into items so runSlice can stop after its time budget.
+class heapCompactor {
+	struct handleEntry {
+		void **slot;
+		size_t size;
+	};
+
+	enum class phase {
+		handles, containers, punch, trim
+	};
+
+	static constexpr size_t firstPunchIndex = 13 - IndexOffset;
+
+	FileMemoryManager *manager;
+	std::vector<handleEntry> handles;
+	std::vector<std::function<void(heapCompactor&)>> containers;
+	phase current = phase::handles;
+	size_t cursor = 0;
+	compactionStats stats;
+
+	size_t phaseItemCount(phase p) const {
+		switch (p) {
+		case phase::handles:
+			return handles.size();
+		case phase::containers:
+			return containers.size();
+		case phase::punch:
+			return SpanList::spanCount() - firstPunchIndex;
+		case phase::trim:
+			return 1;
+		}
+		return 0;
+	}
+
+	void nextPhase() {
+		cursor = 0;
+		switch (current) {
+		case phase::handles:
+			current = phase::containers;
+			break;
+		case phase::containers:
+			current = phase::punch;
+			break;
+		case phase::punch:
+			current = phase::trim;
+			break;
+		case phase::trim:
+			current = phase::handles;
+			stats.passes++;
+			break;
+		}
+	}
+
+	void runItem() {
+		switch (current) {
+		case phase::handles: {
+			handleEntry &entry = handles[cursor];
+			if (*entry.slot != nullptr) {
+				*entry.slot = relocate(*entry.slot, entry.size);
+			}
+			break;
+		}
+		case phase::containers:
+			containers[cursor](*this);
+			break;
+		case phase::punch:
+			stats.bytesPunched += manager->punchFreeBlocks(
+					firstPunchIndex + cursor);
+			break;
+		case phase::trim:
+			stats.bytesTrimmed += manager->trimTail();
+			break;
+		}
+		stats.itemsVisited++;
+		cursor++;
+	}
+
+	// runs one item, returns true when it closed a pass
+	bool step() {
+		while (cursor >= phaseItemCount(current)) {
+			bool lastPhase = current == phase::trim;
+			nextPhase();
+			if (lastPhase) {
+				return true;
+			}
+		}
+		runItem();
+		return false;
+	}
+
+public:
+	heapCompactor(FileMemoryManager *_manager) :
+			manager(_manager) {
+	}
+
+	template<typename T>
+	void registerHandle(T *&slot, size_t count = 1) {
+		handles.push_back( { reinterpret_cast<void**>(&slot), count * sizeof(T) });
+	}
+
+	// func is called once per pass and should call relocate/relocateVector for the blocks it owns
+	void registerContainer(std::function<void(heapCompactor&)> func) {
+		containers.push_back(std::move(func));
+	}
+
+	template<typename T, typename Alloc>
+	void registerContainer(std::vector<T, Alloc> &vec) {
+		registerContainer([&vec](heapCompactor &compactor) {
+			compactor.relocateVector(vec);
+		});
+	}
+
+	void* relocate(void *ptr, size_t size) {
+		void *newPtr = manager->relocate(ptr, size);
+		if (newPtr != ptr) {
+			stats.blocksMoved++;
+			stats.bytesMoved += size;
+		}
+		return newPtr;
+	}
+
+	template<typename T, typename Alloc>
+	void relocateVector(std::vector<T, Alloc> &vec) {
+		size_t bytes = vec.capacity() * sizeof(T);
+		if (bytes == 0 || !manager->preferLowerBlock(vec.data(), bytes)) {
+			return;
+		}
+		std::vector<T, Alloc> tmp(vec.get_allocator());
+		tmp.reserve(vec.capacity());
+		std::move(vec.begin(), vec.end(), std::back_inserter(tmp));
+		vec.swap(tmp);
+		stats.blocksMoved++;
+		stats.bytesMoved += bytes;
+	}
+
+	// returns true when a full pass finished inside this slice
+	bool runSlice(std::chrono::microseconds budget) {
+		auto deadline = std::chrono::steady_clock::now() + budget;
+		do {
+			if (step()) {
+				return true;
+			}
+		} while (std::chrono::steady_clock::now() < deadline);
+		return false;
+	}
+
+	void runPass() {
+		while (!step()) {
+		}
+	}
+
+	// fraction of the current pass that is done
+	double progress() const {
+		size_t total = 0;
+		size_t done = 0;
+		for (phase p : { phase::handles, phase::containers, phase::punch,
+				phase::trim }) {
+			size_t count = phaseItemCount(p);
+			if (p < current) {
+				done += count;
+			} else if (p == current) {
+				done += std::min(cursor, count);
+			}
+			total += count;
+		}
+		return total == 0 ? 1.0 : static_cast<double>(done) / total;
+	}
+
+	const compactionStats& getStats() const {
+		return stats;
+	}
+
+};
+
+}
+}
+
+#endif /* INFILECOMPACTOR_HPP_ */
@@ -0,0 +1,552 @@
+#ifndef INFILEEXPORT_HPP_
+#define INFILEEXPORT_HPP_
+
+#include "InFileAllocator.hpp"
+#include <algorithm>
+#include <future>
+#include <istream>
+#include <ostream>
+#include <thread>
+
+namespace inFileAllocator {
+namespace detail {
+
+// Small LZ77 block codec in the spirit of lz4: a token holds the literal count and match length,
+// matches are found through a hash of the next 4 bytes and copied from up to 64KiB back.
+namespace blockCodec {
+
+constexpr size_t minMatch = 4;
+constexpr unsigned int hashBits = 14;
+
+inline uint32_t read32(const uint8_t *ptr) {
+	uint32_t value;
+	memcpy(&value, ptr, sizeof(value));
+	return value;
+}
+
+inline void writeLength(std::vector<uint8_t> &out, size_t len) {
+	while (len >= 255) {
+		out.push_back(255);
+		len -= 255;
+	}
+	out.push_back(static_cast<uint8_t>(len));
+}
+
+inline void emitSequence(std::vector<uint8_t> &out, const uint8_t *literals,
+		size_t litLen, size_t offset, size_t matchLen) {
+	size_t matchCode = matchLen == 0 ? 0 : matchLen - minMatch;
+	out.push_back(
+			static_cast<uint8_t>((std::min<size_t>(litLen, 15) << 4)
+					| std::min<size_t>(matchCode, 15)));
+	if (litLen >= 15)
+		writeLength(out, litLen - 15);
+	out.insert(out.end(), literals, literals + litLen);
+	if (matchLen == 0)
+		return;
+	out.push_back(static_cast<uint8_t>(offset));
+	out.push_back(static_cast<uint8_t>(offset >> 8));
+	if (matchCode >= 15)
+		writeLength(out, matchCode - 15);
+}
+
+inline void compress(const uint8_t *src, size_t len, std::vector<uint8_t> &out) {
+	std::vector<uint32_t> table(1u << hashBits, 0);
+	size_t anchor = 0;
+	size_t pos = 0;
+	while (pos + minMatch <= len) {
+		uint32_t sequence = read32(src + pos);
+		uint32_t hash = (sequence * 2654435761u) >> (32 - hashBits);
+		size_t candidate = table[hash];
+		table[hash] = static_cast<uint32_t>(pos + 1);
+		if (candidate == 0 || pos + 1 - candidate > 65535
+				|| read32(src + candidate - 1) != sequence) {
+			pos++;
+			continue;
+		}
+		candidate--;
+		size_t matchLen = minMatch;
+		while (pos + matchLen < len
+				&& src[candidate + matchLen] == src[pos + matchLen]) {
+			matchLen++;
+		}
+		emitSequence(out, src + anchor, pos - anchor, pos - candidate, matchLen);
+		pos += matchLen;
+		anchor = pos;
+	}
+	emitSequence(out, src + anchor, len - anchor, 0, 0);
+}
+
+inline size_t readLength(const uint8_t *&in, const uint8_t *end) {
+	size_t len = 0;
+	uint8_t byte;
+	do {
+		if (in >= end)
+			throw std::runtime_error("blockCodec: truncated length");
+		byte = *in++;
+		len += byte;
+	} while (byte == 255);
+	return len;
+}
+
+inline void decompress(const uint8_t *in, size_t inLen, uint8_t *out,
+		size_t outLen) {
+	const uint8_t *end = in + inLen;
+	size_t pos = 0;
+	while (in < end) {
+		uint8_t token = *in++;
+		size_t litLen = token >> 4;
+		if (litLen == 15)
+			litLen += readLength(in, end);
+		if (litLen > static_cast<size_t>(end - in) || pos + litLen > outLen)
+			throw std::runtime_error("blockCodec: corrupt literals");
+		memcpy(out + pos, in, litLen);
+		in += litLen;
+		pos += litLen;
+		if (in == end)
+			break;
+		if (end - in < 2)
+			throw std::runtime_error("blockCodec: truncated offset");
+		size_t offset = in[0] | (static_cast<size_t>(in[1]) << 8);
+		in += 2;
+		size_t matchLen = token & 15;
+		if (matchLen == 15)
+			matchLen += readLength(in, end);
+		matchLen += minMatch;
+		if (offset == 0 || offset > pos || pos + matchLen > outLen)
+			throw std::runtime_error("blockCodec: corrupt match");
+		for (size_t i = 0; i < matchLen; ++i, ++pos) {
+			out[pos] = out[pos - offset];
+		}
+	}
+	if (pos != outLen)
+		throw std::runtime_error("blockCodec: size mismatch");
+}
+
+}
+
+// Splits a byte stream into frames and compresses batches of frames on several threads.
+class frameWriter {
+	static constexpr uint8_t storedRaw = 0;
+	static constexpr uint8_t storedCompressed = 1;
+
+	std::ostream &out;
+	size_t frameSize;
+	size_t batchSize;
+	std::vector<std::vector<uint8_t>> frames;
+	size_t written = 0;
+
+	void writeFrame(const std::vector<uint8_t> &raw,
+			const std::vector<uint8_t> &packed) {
+		bool compressed = packed.size() < raw.size();
+		const std::vector<uint8_t> &payload = compressed ? packed : raw;
+		uint32_t rawLen = static_cast<uint32_t>(raw.size());
+		uint32_t payloadLen = static_cast<uint32_t>(payload.size());
+		uint8_t method = compressed ? storedCompressed : storedRaw;
+		out.write(reinterpret_cast<const char*>(&rawLen), sizeof(rawLen));
+		out.write(reinterpret_cast<const char*>(&payloadLen),
+				sizeof(payloadLen));
+		out.write(reinterpret_cast<const char*>(&method), sizeof(method));
+		out.write(reinterpret_cast<const char*>(payload.data()), payloadLen);
+		written += sizeof(rawLen) + sizeof(payloadLen) + sizeof(method)
+				+ payloadLen;
+	}
+
+	void flushBatch() {
+		std::vector<std::future<std::vector<uint8_t>>> packed;
+		for (auto &frame : frames) {
+			packed.push_back(std::async(std::launch::async, [&frame]() {
+				std::vector<uint8_t> result;
+				result.reserve(frame.size() / 2);
+				blockCodec::compress(frame.data(), frame.size(), result);
+				return result;
+			}));
+		}
+		for (size_t i = 0; i < frames.size(); ++i) {
+			writeFrame(frames[i], packed[i].get());
+		}
+		frames.clear();
+	}
+
+public:
+	frameWriter(std::ostream &_out, size_t _frameSize = 1ul << 20) :
+			out(_out), frameSize(_frameSize), batchSize(
+					std::max(1u, std::thread::hardware_concurrency())) {
+	}
+
+	void write(const void *data, size_t len) {
+		const uint8_t *bytes = static_cast<const uint8_t*>(data);
+		while (len > 0) {
+			if (frames.empty() || frames.back().size() == frameSize) {
+				if (frames.size() == batchSize) {
+					flushBatch();
+				}
+				frames.emplace_back();
+				frames.back().reserve(frameSize);
+			}
+			auto &frame = frames.back();
+			size_t count = std::min(len, frameSize - frame.size());
+			frame.insert(frame.end(), bytes, bytes + count);
+			bytes += count;
+			len -= count;
+		}
+	}
+
+	template<typename T>
+	void writeValue(const T &value) {
+		write(&value, sizeof(T));
+	}
+
+	void finish() {
+		flushBatch();
+		uint32_t zero = 0;
+		out.write(reinterpret_cast<const char*>(&zero), sizeof(zero));
+		out.flush();
+	}
+
+	size_t bytesWritten() const {
+		return written;
+	}
+};
+
+class frameReader {
+	std::istream &in;
+	size_t batchSize;
+	std::vector<std::vector<uint8_t>> frames;
+	size_t frameIndex = 0;
+	size_t framePos = 0;
+	bool ended = false;
+
+	void readBatch() {
+		struct packedFrame {
+			uint32_t rawLen;
+			uint8_t method;
+			std::vector<uint8_t> payload;
+		};
+		std::vector<packedFrame> packed;
+		while (!ended && packed.size() < batchSize) {
+			packedFrame frame;
+			uint32_t payloadLen = 0;
+			if (!in.read(reinterpret_cast<char*>(&frame.rawLen),
+					sizeof(frame.rawLen))) {
+				throw std::runtime_error("frameReader: truncated stream");
+			}
+			if (frame.rawLen == 0) {
+				ended = true;
+				break;
+			}
+			if (!in.read(reinterpret_cast<char*>(&payloadLen),
+					sizeof(payloadLen))
+					|| !in.read(reinterpret_cast<char*>(&frame.method),
+							sizeof(frame.method))) {
+				throw std::runtime_error("frameReader: truncated frame header");
+			}
+			if (frame.method > 1 || (frame.method == 0 && payloadLen != frame.rawLen)) {
+				throw std::runtime_error("frameReader: corrupt frame header");
+			}
+			frame.payload.resize(payloadLen);
+			if (!in.read(reinterpret_cast<char*>(frame.payload.data()),
+					payloadLen)) {
+				throw std::runtime_error("frameReader: truncated frame");
+			}
+			packed.push_back(std::move(frame));
+		}
+		std::vector<std::future<std::vector<uint8_t>>> unpacked;
+		for (auto &frame : packed) {
+			unpacked.push_back(std::async(std::launch::async, [&frame]() {
+				if (frame.method == 0) {
+					return std::move(frame.payload);
+				}
+				std::vector<uint8_t> result(frame.rawLen);
+				blockCodec::decompress(frame.payload.data(),
+						frame.payload.size(), result.data(), result.size());
+				return result;
+			}));
+		}
+		frames.clear();
+		for (auto &frame : unpacked) {
+			frames.push_back(frame.get());
+		}
+		frameIndex = 0;
+		framePos = 0;
+	}
+
+public:
+	frameReader(std::istream &_in) :
+			in(_in), batchSize(std::max(1u, std::thread::hardware_concurrency())) {
+	}
+
+	void read(void *data, size_t len) {
+		uint8_t *bytes = static_cast<uint8_t*>(data);
+		while (len > 0) {
+			if (frameIndex == frames.size()) {
+				if (ended) {
+					throw std::runtime_error("frameReader: unexpected end");
+				}
+				readBatch();
+				continue;
+			}
+			auto &frame = frames[frameIndex];
+			size_t count = std::min(len, frame.size() - framePos);
+			memcpy(bytes, frame.data() + framePos, count);
+			bytes += count;
+			len -= count;
+			framePos += count;
+			if (framePos == frame.size()) {
+				frameIndex++;
+				framePos = 0;
+			}
+		}
+	}
+
+	template<typename T>
+	T readValue() {
+		T value;
+		read(&value, sizeof(T));
+		return value;
+	}
+};
+
+namespace exportFormat {
+
+// 03 since the header carries the reuse policy and whether pointers were rebased
+constexpr uint64_t magic = 0x3330504145484649; // "IFHEAP03"
+constexpr uint8_t extentRecord = 'E';
+constexpr uint8_t endRecord = 'Z';
+constexpr size_t maxExtent = 1ul << 20;
+
+struct header {
+	uint64_t magic;
+	uint64_t pageSize;
+	uint64_t usedSize;
+	uint64_t objOffset;
+	uint64_t arenaOffset;
+	uint64_t arenaCount;
+	uint64_t freeCount;
+	uint64_t reuse;
+	// address of the exported heap, an export without rebased pointers only fits there
+	uint64_t base;
+	uint64_t rebased;
+};
+
+struct freeBlock {
+	uint64_t offset;
+	uint64_t blockSize;
+	int64_t node;
+};
+
+// pointers into the heap are stored as offsets from its base, 0 stays null
+inline uint64_t toOffset(const void *ptr, const Forceduint8_t *base) {
+	return ptr == nullptr ? 0 : static_cast<const Forceduint8_t*>(ptr) - base;
+}
+
+}
+
+// Writes the live blocks of a heap into a stream. Free blocks and the free map table are
+// only recorded by position.
+//
+// With a pointerFilter the stream is address independent: aligned words whose value lies in
+// the mapped range and that the filter takes for pointers are written as offsets and flagged
+// in a per extent bitmap. Without one nothing is rebased and the export can only be imported
+// into a heap at the same address. rebaseAll takes every word in the range for a pointer,
+// an integer that happens to lie there comes back changed by the distance the heap moved.
+class heapExporter {
+public:
+	// whether the word at slot, whose value lies in the mapped range, is a pointer
+	using pointerFilter = std::function<bool(const void *slot)>;
+
+	static bool rebaseAll(const void*) {
+		return true;
+	}
+
+private:
+	FileMemoryManager &manager;
+	Forceduint8_t *base;
+	Forceduint8_t *limit;
+	pointerFilter isPointer;
+
+	void writeExtent(frameWriter &writer, Forceduint8_t *begin,
+			Forceduint8_t *end) {
+		std::vector<uint8_t> relocBits;
+		std::vector<uint64_t> words;
+		for (; begin < end; begin += exportFormat::maxExtent) {
+			size_t len = std::min<size_t>(end - begin, exportFormat::maxExtent);
+			size_t wordCount = len / sizeof(uint64_t);
+			relocBits.assign((wordCount + 7) / 8, 0);
+			words.resize(wordCount);
+			debugHeap::readHeap(words.data(), begin, len);
+			for (size_t i = 0; isPointer && i < wordCount; ++i) {
+				if (words[i] >= reinterpret_cast<uint64_t>(base)
+						&& words[i] < reinterpret_cast<uint64_t>(limit)
+						&& isPointer(begin + i * sizeof(uint64_t))) {
+					words[i] -= reinterpret_cast<uint64_t>(base);
+					relocBits[i / 8] |= 1 << (i % 8);
+				}
+			}
+			writer.writeValue(exportFormat::extentRecord);
+			writer.writeValue<uint64_t>(begin - base);
+			writer.writeValue<uint64_t>(len);
+			writer.write(relocBits.data(), relocBits.size());
+			writer.write(words.data(), len);
+		}
+	}
+
+public:
+	heapExporter(FileMemoryManager &_manager, pointerFilter _isPointer =
+			nullptr) :
+			manager(_manager), base(_manager.getFilehandler().dataAdress), limit(
+					base + _manager.getFilehandler().mappedMemSize + pageSize), isPointer(
+					std::move(_isPointer)) {
+	}
+
+	// returns the number of bytes written to out
+	size_t write(std::ostream &out) {
+		std::vector<exportFormat::freeBlock> freeBlocks;
+		manager.forEachFreeBlock([&](void *block, size_t blockSize, int node) {
+			freeBlocks.push_back( { exportFormat::toOffset(block, base),
+					blockSize, node });
+		});
+		// the importing heap builds its own table, the pages of this one come back free; the
+		// table is whole chunks, so its pieces are blocks that do not merge
+		MemoryFileHandler &fileHandler = manager.getFilehandler();
+		if (fileHandler.freeMap != nullptr) {
+			auto *run = reinterpret_cast<Forceduint8_t*>(fileHandler.freeMap);
+			size_t bytes = fileHandler.freeMapChunks * sizeof(*fileHandler.freeMap);
+			while (bytes != 0) {
+				size_t blockSize = static_cast<size_t>(1)
+						<< (63 - __builtin_clzll(bytes));
+				freeBlocks.push_back( { exportFormat::toOffset(run, base),
+						blockSize, -1 });
+				run += blockSize;
+				bytes -= blockSize;
+			}
+		}
+		std::sort(freeBlocks.begin(), freeBlocks.end(),
+				[](const auto &a, const auto &b) {
+					return a.offset < b.offset;
+				});
+
+		frameWriter writer(out);
+		exportFormat::header head { exportFormat::magic, pageSize,
+				manager.getFilehandler().size, exportFormat::toOffset(
+						manager.getObjPtr(), base), exportFormat::toOffset(
+						manager.getNodeArenas(), base),
+				manager.getNodeArenaCount(), freeBlocks.size(),
+				static_cast<uint64_t>(manager.getReusePolicy()),
+				reinterpret_cast<uint64_t>(base), isPointer != nullptr };
+		writer.writeValue(head);
+		writer.write(freeBlocks.data(),
+				freeBlocks.size() * sizeof(exportFormat::freeBlock));
+
+		Forceduint8_t *cursor = base + pageSize;
+		for (auto &block : freeBlocks) {
+			if (base + block.offset > cursor) {
+				writeExtent(writer, cursor, base + block.offset);
+			}
+			cursor = base + block.offset + block.blockSize;
+		}
+		writeExtent(writer, cursor, manager.getFilehandler().top());
+		writer.writeValue(exportFormat::endRecord);
+		writer.finish();
+		return writer.bytesWritten();
+	}
+};
+
+// Rebuilds an exported heap inside the (possibly differently placed) heap of manager,
+// which is reset first.
+class heapImporter {
+	FileMemoryManager &manager;
+
+	template<typename T>
+	T* fromOffset(uint64_t offset) {
+		return offset == 0 ?
+				nullptr :
+				reinterpret_cast<T*>(manager.getFilehandler().dataAdress + offset);
+	}
+
+public:
+	heapImporter(FileMemoryManager &_manager) :
+			manager(_manager) {
+	}
+
+	void read(std::istream &in) {
+		frameReader reader(in);
+		auto head = reader.readValue<exportFormat::header>();
+		if (head.magic != exportFormat::magic || head.pageSize != pageSize) {
+			throw std::runtime_error("heapImporter: not a heap export");
+		}
+		if (head.reuse > static_cast<uint64_t>(reusePolicy::addressOrdered)) {
+			throw std::runtime_error("heapImporter: unknown reuse policy");
+		}
+		if (!head.rebased
+				&& head.base
+						!= reinterpret_cast<uint64_t>(manager.getFilehandler().dataAdress)) {
+			throw std::runtime_error(
+					"heapImporter: pointers were not rebased, import at the exported address");
+		}
+		std::vector<exportFormat::freeBlock> freeBlocks(head.freeCount);
+		reader.read(freeBlocks.data(),
+				freeBlocks.size() * sizeof(exportFormat::freeBlock));
+
+		manager.reset();
+		// before the free blocks go back to the lists, the policy orders them
+		manager.setReusePolicy(static_cast<reusePolicy>(head.reuse));
+		MemoryFileHandler &fileHandler = manager.getFilehandler();
+		if (head.usedSize > pageSize) {
+			fileHandler.getFreePages((head.usedSize - pageSize) / pageSize);
+		}
+		uint64_t base = reinterpret_cast<uint64_t>(fileHandler.dataAdress);
+
+		std::vector<uint8_t> relocBits;
+		uint8_t record;
+		while ((record = reader.readValue<uint8_t>())
+				== exportFormat::extentRecord) {
+			uint64_t offset = reader.readValue<uint64_t>();
+			uint64_t len = reader.readValue<uint64_t>();
+			if (offset < pageSize || offset + len > head.usedSize) {
+				throw std::runtime_error("heapImporter: extent out of range");
+			}
+			size_t wordCount = len / sizeof(uint64_t);
+			relocBits.resize((wordCount + 7) / 8);
+			reader.read(relocBits.data(), relocBits.size());
+			uint64_t *words = fromOffset<uint64_t>(offset);
+			reader.read(words, len);
+			for (size_t i = 0; i < wordCount; ++i) {
+				if (relocBits[i / 8] & (1 << (i % 8))) {
+					words[i] += base;
+				}
+			}
+		}
+
+		if (record != exportFormat::endRecord) {
+			throw std::runtime_error("heapImporter: unknown record");
+		}
+
+		manager.objPtr = fromOffset<void>(head.objOffset);
+		if (head.arenaCount != 0) {
+			manager.nodeArenas = fromOffset<SpanList>(head.arenaOffset);
+			manager.nodeArenaCount = head.arenaCount;
+			for (size_t i = 0; i < head.arenaCount; ++i) {
+				manager.nodeArenas[i].resetAll();
+			}
+		}
+		for (auto &block : freeBlocks) {
+			manager.deallocateBlockOnNode(fromOffset<void>(block.offset),
+					block.blockSize, static_cast<int>(block.node));
+		}
+	}
+};
+
+// see heapExporter for the words that are taken for pointers, by default none
+inline size_t exportHeap(FileMemoryManager &manager, std::ostream &out,
+		heapExporter::pointerFilter isPointer = nullptr) {
+	return heapExporter(manager, std::move(isPointer)).write(out);
+}
+
+inline void importHeap(FileMemoryManager &manager, std::istream &in) {
+	heapImporter(manager).read(in);
+}
+
+}
+}
+
+#endif /* INFILEEXPORT_HPP_ */
@@ -0,0 +1,388 @@
+#ifndef INFILEIOENGINE_HPP_
+#define INFILEIOENGINE_HPP_
+
+#include "InFileAllocator.hpp"
+#include <linux/io_uring.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <thread>
+
+namespace inFileAllocator {
+namespace detail {
+
+struct ioEngineOptions {
+	unsigned int queueDepth = 64;
+	unsigned int fallbackThreads = 2;
+	bool forceThreadPool = false;
+};
+
+// Submits writeback, flush and readahead of heap ranges without blocking the caller.
+// Uses io_uring when the kernel allows it, otherwise a small thread pool doing the same syscalls.
+// Every call returns a future holding 0 or a negative errno.
+class ioEngine {
+	enum class opKind {
+		writeback, flush, prefetch
+	};
+
+	struct request {
+		opKind kind;
+		off_t offset;
+		size_t len;
+		bool wait;
+		std::promise<int> done;
+		size_t pending = 0;
+		int result = 0;
+	};
+
+	struct uringState {
+		int fd = -1;
+		void *sqRing = MAP_FAILED;
+		void *cqRing = MAP_FAILED;
+		size_t sqRingSize = 0;
+		size_t cqRingSize = 0;
+		io_uring_sqe *sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+		size_t sqesSize = 0;
+		unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+		unsigned *cqHead, *cqTail, *cqMask;
+		io_uring_cqe *cqes;
+		unsigned entries = 0;
+	};
+
+	// io_uring sync_file_range and fadvise take a 32 bit length
+	static constexpr size_t maxOpLen = 1ul << 30;
+
+	int fd;
+	Forceduint8_t *dataAdress;
+	uringState ring;
+	bool uring = false;
+	bool stopping = false;
+	std::mutex mutex;
+	std::condition_variable cond;
+	std::deque<request*> queue;
+	unsigned inFlight = 0;
+	std::vector<std::thread> workers;
+
+	static int uringSetup(unsigned entries, io_uring_params *params) {
+		return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+	}
+
+	static int uringEnter(int ringFd, unsigned toSubmit, unsigned minComplete,
+			unsigned flags) {
+		return static_cast<int>(syscall(__NR_io_uring_enter, ringFd, toSubmit,
+				minComplete, flags, nullptr, 0));
+	}
+
+	bool supportsOps(int ringFd) {
+		size_t probeSize = sizeof(io_uring_probe)
+				+ 256 * sizeof(io_uring_probe_op);
+		std::vector<char> buffer(probeSize, 0);
+		auto *probe = reinterpret_cast<io_uring_probe*>(buffer.data());
+		if (syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_PROBE,
+				probe, 256) != 0) {
+			return false;
+		}
+		for (int op : { IORING_OP_SYNC_FILE_RANGE, IORING_OP_FSYNC,
+				IORING_OP_FADVISE, IORING_OP_NOP }) {
+			if (op > probe->last_op
+					|| !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	bool setupRing(unsigned entries) {
+		io_uring_params params;
+		memset(&params, 0, sizeof(params));
+		params.flags = IORING_SETUP_CQSIZE;
+		params.cq_entries = entries * 2;
+		ring.fd = uringSetup(entries, &params);
+		if (ring.fd < 0) {
+			return false;
+		}
+		if (!supportsOps(ring.fd)) {
+			return false;
+		}
+		ring.entries = params.sq_entries;
+		ring.sqRingSize = params.sq_off.array
+				+ params.sq_entries * sizeof(unsigned);
+		ring.cqRingSize = params.cq_off.cqes
+				+ params.cq_entries * sizeof(io_uring_cqe);
+		bool singleMap = params.features & IORING_FEAT_SINGLE_MMAP;
+		if (singleMap) {
+			ring.sqRingSize = ring.cqRingSize = std::max(ring.sqRingSize,
+					ring.cqRingSize);
+		}
+		ring.sqRing = mmap(nullptr, ring.sqRingSize, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+		if (ring.sqRing == MAP_FAILED) {
+			return false;
+		}
+		if (singleMap) {
+			ring.cqRing = ring.sqRing;
+		} else {
+			ring.cqRing = mmap(nullptr, ring.cqRingSize, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+			if (ring.cqRing == MAP_FAILED) {
+				return false;
+			}
+		}
+		ring.sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+		ring.sqes = static_cast<io_uring_sqe*>(mmap(nullptr, ring.sqesSize,
+				PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd,
+				IORING_OFF_SQES));
+		if (ring.sqes == MAP_FAILED) {
+			return false;
+		}
+		char *sq = static_cast<char*>(ring.sqRing);
+		char *cq = static_cast<char*>(ring.cqRing);
+		ring.sqHead = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+		ring.sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+		ring.sqMask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+		ring.sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+		ring.cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+		ring.cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+		ring.cqMask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+		ring.cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+		return true;
+	}
+
+	void teardownRing() {
+		if (ring.sqes != MAP_FAILED)
+			munmap(ring.sqes, ring.sqesSize);
+		if (ring.cqRing != MAP_FAILED && ring.cqRing != ring.sqRing)
+			munmap(ring.cqRing, ring.cqRingSize);
+		if (ring.sqRing != MAP_FAILED)
+			munmap(ring.sqRing, ring.sqRingSize);
+		if (ring.fd >= 0)
+			close(ring.fd);
+		ring = uringState();
+	}
+
+	// caller holds mutex and has checked that a slot is free
+	void pushSqe(const request *req, off_t offset, size_t len) {
+		unsigned tail = *ring.sqTail;
+		unsigned index = tail & *ring.sqMask;
+		io_uring_sqe *sqe = &ring.sqes[index];
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->fd = fd;
+		sqe->off = offset;
+		sqe->len = static_cast<__u32>(len);
+		sqe->user_data = reinterpret_cast<__u64>(req);
+		if (req == nullptr) {
+			sqe->opcode = IORING_OP_NOP;
+		} else {
+			switch (req->kind) {
+			case opKind::writeback:
+				sqe->opcode = IORING_OP_SYNC_FILE_RANGE;
+				sqe->sync_range_flags = SYNC_FILE_RANGE_WRITE
+						| (req->wait ?
+								SYNC_FILE_RANGE_WAIT_BEFORE
+										| SYNC_FILE_RANGE_WAIT_AFTER :
+								0);
+				break;
+			case opKind::flush:
+				sqe->opcode = IORING_OP_FSYNC;
+				sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+				sqe->len = 0;
+				break;
+			case opKind::prefetch:
+				sqe->opcode = IORING_OP_FADVISE;
+				sqe->fadvise_advice = POSIX_FADV_WILLNEED;
+				break;
+			}
+		}
+		ring.sqArray[index] = index;
+		__atomic_store_n(ring.sqTail, tail + 1, __ATOMIC_RELEASE);
+		inFlight++;
+	}
+
+	void submitUring(request *req) {
+		std::vector<std::pair<off_t, size_t>> pieces;
+		if (req->kind == opKind::flush) {
+			pieces.emplace_back(0, 0);
+		} else {
+			for (size_t done = 0; done < req->len; done += maxOpLen) {
+				pieces.emplace_back(req->offset + done,
+						std::min(maxOpLen, req->len - done));
+			}
+		}
+		std::unique_lock<std::mutex> lock(mutex);
+		req->pending = pieces.size();
+		for (auto &piece : pieces) {
+			cond.wait(lock, [&] {
+				return inFlight < ring.entries;
+			});
+			pushSqe(req, piece.first, piece.second);
+			uringEnter(ring.fd, 1, 0, 0);
+		}
+	}
+
+	void reapLoop() {
+		while (true) {
+			unsigned head = *ring.cqHead;
+			if (head == __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE)) {
+				uringEnter(ring.fd, 0, 1, IORING_ENTER_GETEVENTS);
+				continue;
+			}
+			io_uring_cqe cqe = ring.cqes[head & *ring.cqMask];
+			__atomic_store_n(ring.cqHead, head + 1, __ATOMIC_RELEASE);
+			request *req = reinterpret_cast<request*>(cqe.user_data);
+			std::unique_lock<std::mutex> lock(mutex);
+			inFlight--;
+			cond.notify_all();
+			// the stop nop is the last submission, so nothing is left once in flight drops to 0
+			bool last = stopping && inFlight == 0;
+			if (req != nullptr) {
+				if (cqe.res < 0 && req->result == 0) {
+					req->result = cqe.res;
+				}
+				if (--req->pending == 0) {
+					lock.unlock();
+					finish(req, req->result);
+				}
+			}
+			if (last) {
+				return;
+			}
+		}
+	}
+
+	int runSync(const request &req) {
+		int res = 0;
+		switch (req.kind) {
+		case opKind::writeback:
+			res = sync_file_range(fd, req.offset, req.len,
+					SYNC_FILE_RANGE_WRITE
+							| (req.wait ?
+									SYNC_FILE_RANGE_WAIT_BEFORE
+											| SYNC_FILE_RANGE_WAIT_AFTER :
+									0));
+			return res == 0 ? 0 : -errno;
+		case opKind::flush:
+			res = fdatasync(fd);
+			return res == 0 ? 0 : -errno;
+		case opKind::prefetch:
+			return -posix_fadvise(fd, req.offset, req.len, POSIX_FADV_WILLNEED);
+		}
+		return 0;
+	}
+
+	void workerLoop() {
+		while (true) {
+			request *req;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				cond.wait(lock, [&] {
+					return stopping || !queue.empty();
+				});
+				if (queue.empty()) {
+					return;
+				}
+				req = queue.front();
+				queue.pop_front();
+			}
+			finish(req, runSync(*req));
+		}
+	}
+
+	void finish(request *req, int result) {
+		req->done.set_value(result);
+		delete req;
+	}
+
+	std::future<int> submit(opKind kind, void *adr, size_t len, bool wait) {
+		request *req = new request { kind, 0, 0, wait, std::promise<int>() };
+		if (kind != opKind::flush) {
+			Forceduint8_t *begin = static_cast<Forceduint8_t*>(adr);
+			size_t start = (begin - dataAdress) & ~(pageSize - 1);
+			size_t end = (begin + len - dataAdress + pageSize - 1)
+					& ~(pageSize - 1);
+			req->offset = start;
+			req->len = end - start;
+		}
+		std::future<int> future = req->done.get_future();
+		if (uring) {
+			submitUring(req);
+		} else {
+			std::lock_guard<std::mutex> lock(mutex);
+			queue.push_back(req);
+			cond.notify_one();
+		}
+		return future;
+	}
+
+public:
+	ioEngine(FileMemoryManagerHandler &handler, ioEngineOptions options =
+			ioEngineOptions()) :
+			fd(handler.getManager()->getFilehandler().fd), dataAdress(
+					handler.getManager()->getFilehandler().dataAdress) {
+		if (!options.forceThreadPool && setupRing(options.queueDepth)) {
+			uring = true;
+			workers.emplace_back(&ioEngine::reapLoop, this);
+		} else {
+			teardownRing();
+			for (unsigned i = 0; i < std::max(1u, options.fallbackThreads);
+					++i) {
+				workers.emplace_back(&ioEngine::workerLoop, this);
+			}
+		}
+	}
+
+	ioEngine(const ioEngine&) = delete;
+	ioEngine& operator=(const ioEngine&) = delete;
+
+	~ioEngine() {
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			stopping = true;
+			if (uring) {
+				cond.wait(lock, [&] {
+					return inFlight < ring.entries;
+				});
+				pushSqe(nullptr, 0, 0);
+				uringEnter(ring.fd, 1, 0, 0);
+			}
+			cond.notify_all();
+		}
+		for (auto &worker : workers) {
+			worker.join();
+		}
+		teardownRing();
+	}
+
+	// starts writeback of the pages under [adr, adr+len), wait also waits for it to reach the disk
+	std::future<int> writeback(void *adr, size_t len, bool wait = false) {
+		return submit(opKind::writeback, adr, len, wait);
+	}
+
+	// fdatasync of the whole heap file
+	std::future<int> flush() {
+		return submit(opKind::flush, nullptr, 0, false);
+	}
+
+	// reads the pages under [adr, adr+len) into the page cache
+	std::future<int> prefetch(void *adr, size_t len) {
+		return submit(opKind::prefetch, adr, len, false);
+	}
+
+	bool usesIoUring() const {
+		return uring;
+	}
+
+};
+
+inline ioEngine& attachIoEngine(FileMemoryManagerHandler &handler,
+		ioEngineOptions options = ioEngineOptions()) {
+	auto engine = std::make_shared<ioEngine>(handler, options);
+	handler.attachIoEngine(engine);
+	return *engine;
+}
+
+}
+}
+
+#endif /* INFILEIOENGINE_HPP_ */
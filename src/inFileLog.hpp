@@ -0,0 +1,383 @@
+#ifndef INFILELOG_HPP_
+#define INFILELOG_HPP_
+
+#include "InFileAllocator.hpp"
+#include <chrono>
+#include <cstring>
+#include <thread>
+#include <type_traits>
+
+namespace inFileAllocator {
+namespace detail {
+
+// Append-only log of T in a chain of SegmentSize blocks of the file heap, blocks of
+// 64KiB and up are page runs from the end of the file. Entries never move, so an append
+// costs the same at any length, and whole segments are freed from the head by trimBefore.
+//
+// An append reserves its index with one fetch_add, writes the entry and publishes it by
+// setting the commit flag of its slot, so appends within a segment never wait for each
+// other. Readers stop at the first slot that is not committed and see a gap-free prefix.
+// The next segment is allocated under the heap mutex when the current one is half full.
+// append is not lock-free: an append that runs past the last segment before it is
+// allocated backs off until it is. Readers tail the log without locks; trimming never
+// frees what a reader has not read.
+//
+// The log can live in the heap (objectManager::aquire). Segment allocation and trimming use
+// the heap, which callers share behind their own lock: pass that mutex, and pass it again to
+// attach after the heap was reopened.
+template<typename T, size_t SegmentSize = pow2<20>>
+class fileLog {
+	static_assert(std::is_trivially_copyable_v<T>);
+	static_assert(isPowerOf2<SegmentSize>);
+
+	struct segment {
+		std::atomic<segment*> next;
+		uint64_t firstIndex;
+	};
+
+	// a segment holds one commit flag per slot after its header, then the entries
+	static constexpr uint64_t perSegment = (SegmentSize - sizeof(segment)
+			- alignof(T)) / (sizeof(T) + 1);
+	static constexpr size_t itemOffset = (sizeof(segment) + perSegment
+			+ alignof(T) - 1) / alignof(T) * alignof(T);
+	static_assert(perSegment >= 2);
+	static_assert(itemOffset + perSegment * sizeof(T) <= SegmentSize);
+	static constexpr size_t requestSize = SegmentSize;
+	static constexpr size_t maxReaders = 16;
+	static constexpr uint64_t noReader = ~static_cast<uint64_t>(0);
+
+	FileMemoryManager *manager;
+	std::mutex *heapMutex;
+	std::atomic<segment*> head;
+	std::atomic<segment*> tail;
+	// newest segment an append started in, appends search forward from here
+	std::atomic<segment*> writeHint;
+	std::atomic<uint64_t> reserved;
+	// end of the committed prefix and its segment, advanced under trimMutex
+	std::atomic<uint64_t> published;
+	segment *publishedSegment;
+	std::atomic<uint64_t> headIndex;
+	std::atomic<bool> growing;
+	std::atomic<uint64_t> readerPos[maxReaders];
+	std::mutex trimMutex;
+	// Trimmed segments from retired up to retiredStop. An append can still be walking
+	// them from an old writeHint, so they are freed once every index reserved before
+	// they were unlinked is published. Committing is the last thing an append does.
+	segment *retired = nullptr;
+	segment *retiredStop = nullptr;
+	uint64_t retiredUntil = 0;
+
+	static T* items(segment *s) {
+		return reinterpret_cast<T*>(reinterpret_cast<Forceduint8_t*>(s)
+				+ itemOffset);
+	}
+
+	static std::atomic<uint8_t>* committed(segment *s) {
+		return reinterpret_cast<std::atomic<uint8_t>*>(reinterpret_cast<Forceduint8_t*>(s)
+				+ sizeof(segment));
+	}
+
+	segment* newSegment(uint64_t firstIndex) {
+		segment *s;
+		if (heapMutex != nullptr) {
+			std::lock_guard<std::mutex> lock(*heapMutex);
+			s = reinterpret_cast<segment*>(manager->allocate(requestSize));
+		} else {
+			s = reinterpret_cast<segment*>(manager->allocate(requestSize));
+		}
+		s->next.store(nullptr, std::memory_order_relaxed);
+		s->firstIndex = firstIndex;
+		std::memset(static_cast<void*>(committed(s)), 0, perSegment);
+		return s;
+	}
+
+	void freeSegment(segment *s) {
+		if (heapMutex != nullptr) {
+			std::lock_guard<std::mutex> lock(*heapMutex);
+			manager->deallocate(s, requestSize);
+		} else {
+			manager->deallocate(s, requestSize);
+		}
+	}
+
+	// appends the segment after s, unless someone else already did or is doing it
+	void grow(segment *s) {
+		bool expected = false;
+		if (!growing.compare_exchange_strong(expected, true,
+				std::memory_order_acquire)) {
+			return;
+		}
+		if (s->next.load(std::memory_order_acquire) == nullptr) {
+			segment *next = newSegment(s->firstIndex + perSegment);
+			s->next.store(next, std::memory_order_release);
+			tail.store(next, std::memory_order_release);
+		}
+		growing.store(false, std::memory_order_release);
+	}
+
+	// waits on another append growing the log, which may have been preempted when threads
+	// outnumber cores
+	static void backoff(size_t spins) {
+		if (spins < 64) {
+			std::this_thread::yield();
+		} else {
+			std::this_thread::sleep_for(std::chrono::microseconds(50));
+		}
+	}
+
+	segment* segmentFor(uint64_t index) {
+		segment *s = writeHint.load(std::memory_order_acquire);
+		if (index < s->firstIndex) {
+			// a later append moved the hint past this index, its segment is not trimmed
+			// as long as the index is not committed
+			s = head.load(std::memory_order_acquire);
+		}
+		size_t spins = 0;
+		while (index >= s->firstIndex + perSegment) {
+			segment *next = s->next.load(std::memory_order_acquire);
+			if (next == nullptr) {
+				grow(s);
+				backoff(spins++);
+				continue;
+			}
+			s = next;
+		}
+		return s;
+	}
+
+	// moves published over the slots committed since, trimMutex has to be held
+	uint64_t advancePublished() {
+		uint64_t pos = published.load(std::memory_order_relaxed);
+		segment *s = publishedSegment;
+		while (true) {
+			if (pos == s->firstIndex + perSegment) {
+				segment *next = s->next.load(std::memory_order_acquire);
+				if (next == nullptr) {
+					break;
+				}
+				s = next;
+			}
+			if (committed(s)[pos - s->firstIndex].load(std::memory_order_acquire)
+					== 0) {
+				break;
+			}
+			++pos;
+		}
+		publishedSegment = s;
+		published.store(pos, std::memory_order_release);
+		return pos;
+	}
+
+	uint64_t minReaderPos() {
+		uint64_t pos = noReader;
+		for (auto &r : readerPos) {
+			pos = std::min(pos, r.load(std::memory_order_acquire));
+		}
+		return pos;
+	}
+
+public:
+	class reader {
+		fileLog *log;
+		size_t slot;
+		segment *current;
+		uint64_t pos;
+
+	public:
+		reader(fileLog *_log, size_t _slot, segment *_current, uint64_t _pos) :
+				log(_log), slot(_slot), current(_current), pos(_pos) {
+		}
+
+		reader(reader &&other) :
+				log(other.log), slot(other.slot), current(other.current), pos(
+						other.pos) {
+			other.log = nullptr;
+		}
+
+		reader(const reader&) = delete;
+
+		~reader() {
+			if (log != nullptr) {
+				log->readerPos[slot].store(noReader, std::memory_order_release);
+			}
+		}
+
+		// calls func(index, entry) for committed entries not read yet, up to max of them,
+		// and stops at the first slot that is not committed
+		template<typename F>
+		size_t poll(F func, size_t max = std::numeric_limits<size_t>::max()) {
+			size_t count = 0;
+			for (; count < max; ++pos, ++count) {
+				if (pos >= current->firstIndex + perSegment) {
+					segment *next = current->next.load(std::memory_order_acquire);
+					if (next == nullptr) {
+						break;
+					}
+					current = next;
+				}
+				uint64_t offset = pos - current->firstIndex;
+				if (committed(current)[offset].load(std::memory_order_acquire) == 0) {
+					break;
+				}
+				func(pos, items(current)[offset]);
+			}
+			log->readerPos[slot].store(pos, std::memory_order_release);
+			return count;
+		}
+
+		uint64_t position() const {
+			return pos;
+		}
+	};
+
+	fileLog(FileMemoryManager *_manager, std::mutex *_heapMutex = nullptr) :
+			manager(_manager), heapMutex(_heapMutex), reserved(0), published(0), headIndex(
+					0), growing(false) {
+		segment *first = newSegment(0);
+		head.store(first);
+		tail.store(first);
+		writeHint.store(first);
+		publishedSegment = first;
+		for (auto &r : readerPos) {
+			r.store(noReader);
+		}
+	}
+
+	fileLog(const fileLog&) = delete;
+	fileLog& operator=(const fileLog&) = delete;
+
+	~fileLog() {
+		segment *s = retired != nullptr ? retired : head.load();
+		while (s != nullptr) {
+			segment *next = s->next.load();
+			freeSegment(s);
+			s = next;
+		}
+	}
+
+	// after the heap was mapped again: appends that were reserved but not published are
+	// dropped, with the ones committed after them, and readers of the previous run are
+	// forgotten
+	void attach(std::mutex *_heapMutex = nullptr) {
+		heapMutex = _heapMutex;
+		new (&trimMutex) std::mutex();
+		growing.store(false);
+		uint64_t committedEnd = advancePublished();
+		for (segment *s = publishedSegment; s != nullptr; s = s->next.load()) {
+			uint64_t from = committedEnd > s->firstIndex ?
+					committedEnd - s->firstIndex : 0;
+			if (from < perSegment) {
+				std::memset(static_cast<void*>(committed(s) + from), 0,
+						perSegment - from);
+			}
+		}
+		writeHint.store(publishedSegment);
+		reserved.store(committedEnd);
+		retiredUntil = 0;
+		for (auto &r : readerPos) {
+			r.store(noReader);
+		}
+	}
+
+	uint64_t append(const T &item) {
+		uint64_t index = reserved.fetch_add(1, std::memory_order_relaxed);
+		segment *s = segmentFor(index);
+		uint64_t offset = index - s->firstIndex;
+		items(s)[offset] = item;
+		if (offset == perSegment / 2
+				&& s->next.load(std::memory_order_acquire) == nullptr) {
+			grow(s);
+		}
+		if (offset == 0) {
+			segment *hint = writeHint.load(std::memory_order_acquire);
+			while (hint->firstIndex < s->firstIndex
+					&& !writeHint.compare_exchange_weak(hint, s,
+							std::memory_order_release, std::memory_order_acquire)) {
+			}
+		}
+		committed(s)[offset].store(1, std::memory_order_release);
+		return index;
+	}
+
+	// index one past the last entry readers can see, entries committed after a gap are
+	// not counted until the gap is filled
+	uint64_t end() {
+		std::lock_guard<std::mutex> lock(trimMutex);
+		return advancePublished();
+	}
+
+	// first entry that was not trimmed
+	uint64_t begin() const {
+		return headIndex.load(std::memory_order_acquire);
+	}
+
+	size_t size() {
+		return end() - begin();
+	}
+
+	static constexpr uint64_t entriesPerSegment() {
+		return perSegment;
+	}
+
+	// starts at from, or at the head if that was trimmed already
+	reader openReader(uint64_t from = 0) {
+		std::lock_guard<std::mutex> lock(trimMutex);
+		from = std::min(std::max(from, begin()), advancePublished());
+		for (size_t slot = 0; slot < maxReaders; ++slot) {
+			uint64_t expected = noReader;
+			if (readerPos[slot].compare_exchange_strong(expected, from)) {
+				segment *s = head.load(std::memory_order_acquire);
+				segment *next;
+				while (from >= s->firstIndex + perSegment && (next =
+						s->next.load(std::memory_order_acquire)) != nullptr) {
+					s = next;
+				}
+				return reader(this, slot, s, from);
+			}
+		}
+		throw std::runtime_error("fileLog: too many readers");
+	}
+
+	// Unlinks the segments that only hold entries below index, stopping at entries open
+	// readers still have to read and at the segment appends are working in. Their memory
+	// goes back to the heap on a later call, see retired. Returns the freed bytes.
+	size_t trimBefore(uint64_t index) {
+		std::lock_guard<std::mutex> lock(trimMutex);
+		size_t freed = 0;
+		uint64_t committedEnd = advancePublished();
+		if (retired != nullptr && committedEnd >= retiredUntil) {
+			while (retired != retiredStop) {
+				segment *next = retired->next.load(std::memory_order_acquire);
+				freeSegment(retired);
+				freed += SegmentSize;
+				retired = next;
+			}
+			retired = nullptr;
+		}
+		if (retired != nullptr) {
+			return freed;
+		}
+		index = std::min( { index, committedEnd, minReaderPos() });
+		segment *first = head.load(std::memory_order_acquire);
+		segment *s = first;
+		segment *hint = writeHint.load(std::memory_order_acquire);
+		// a reader at the very end of a segment still goes through its next pointer
+		while (s != hint && s->firstIndex + perSegment < index) {
+			s = s->next.load(std::memory_order_acquire);
+		}
+		if (s != first) {
+			head.store(s, std::memory_order_release);
+			headIndex.store(s->firstIndex, std::memory_order_release);
+			retired = first;
+			retiredStop = s;
+			retiredUntil = reserved.load();
+		}
+		return freed;
+	}
+
+};
+
+}
+}
+
+#endif /* INFILELOG_HPP_ */
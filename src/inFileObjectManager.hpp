@@ -3,15 +3,56 @@
 
 #include "InFileAllocator.hpp"
 #include <unordered_map>
+#include <unordered_set>
 namespace inFileAllocator {
 namespace detail {
 using keyT = size_t;
+
+class objectManager;
+
+// Cached result of objectManager::aquire. Dereferencing compares the generation it was
+// resolved in with the manager's, which changes on release and resetFile; only then the key
+// is looked up again, and a handle whose object is gone throws.
+template<typename U>
+class persistentHandle {
+	objectManager *manager;
+	keyT key;
+	U *ptr;
+	uint64_t generation;
+
+	U* revalidate();
+
+public:
+	persistentHandle(objectManager *_manager, keyT _key, U *_ptr,
+			uint64_t _generation) :
+			manager(_manager), key(_key), ptr(_ptr), generation(_generation) {
+	}
+
+	U* get();
+
+	U& operator*() {
+		return *get();
+	}
+
+	U* operator->() {
+		return get();
+	}
+
+	keyT getKey() const {
+		return key;
+	}
+};
+
 class objectManager {
+	template<typename U>
+	friend class persistentHandle;
 
 	using ptrType = std::pair<size_t,void*>; // {hash of type, ptrToObject}
 	using mapT = std::unordered_map<keyT,ptrType,std::hash<keyT>,std::equal_to<keyT>,fileAllocator<ptrType>>;
 	FileMemoryManagerHandler handler;
 	mapT *obj;
+	// bumped whenever an object may have gone away, see persistentHandle
+	uint64_t generation = 0;
 
 	template<typename T, typename ... Args>
 	ptrType createObject(Args &&... args) {
@@ -25,7 +66,6 @@ class objectManager {
 public:
 
 	objectManager(int fd, void *adrs, size_t mappedMemSize):handler(fd,adrs,mappedMemSize){
-		handler.setDefCstr();
 		obj = handler.getManager()->getObj<mapT>();
 	}
 
@@ -46,6 +86,64 @@ public:
 		}
 	}
 
+	// the same lookup once, later dereferences of the handle skip it
+	template<typename U, typename ... Args>
+	persistentHandle<U> aquireHandle(keyT key, Args &&... args) {
+		U &object = aquire<U>(key, std::forward<Args>(args)...);
+		return persistentHandle<U>(this, key, &object, generation);
+	}
+
+	// destroys and frees the object under key, false if there is none
+	template<typename U>
+	bool release(keyT key) {
+		auto iter = obj->find(key);
+		if (iter == obj->end()) {
+			return false;
+		}
+		if (iter->second.first != typeid(U).hash_code()) {
+			throw std::runtime_error(
+					"objectManager::release(), typeid.hash_code of released object is mismatched with what it is");
+		}
+		fileAllocator<U> alloc(handler.getManager());
+		U *ptr = reinterpret_cast<U*>(iter->second.second);
+		alloc.destroy(ptr);
+		alloc.deallocate(ptr, 1);
+		obj->erase(iter);
+		++generation;
+		return true;
+	}
+
+	// Constructs a U for every key and runs build(key, object) on it, spread over workers
+	// threads that allocate from sub-heaps of regionBytes each (see
+	// FileMemoryManager::parallelBuild). The objects enter the directory once all are built.
+	template<typename U, typename F>
+	void buildParallel(const std::vector<keyT> &keys, size_t workers,
+			size_t regionBytes, F build) {
+		// checked up front, a second object under a key could not enter the directory
+		std::unordered_set<keyT> given;
+		for (keyT key : keys) {
+			if (obj->count(key) != 0) {
+				throw std::runtime_error(
+						"objectManager::buildParallel(), key is already taken");
+			}
+			if (!given.insert(key).second) {
+				throw std::runtime_error(
+						"objectManager::buildParallel(), key is given twice");
+			}
+		}
+		std::vector<ptrType> built(keys.size(), ptrType(0, nullptr));
+		handler.getManager()->parallelBuild(workers, regionBytes,
+				[&](size_t worker) {
+					for (size_t i = worker; i < keys.size(); i += workers) {
+						built[i] = createObject<U>();
+						build(keys[i], *reinterpret_cast<U*>(built[i].second));
+					}
+				});
+		for (size_t i = 0; i < keys.size(); ++i) {
+			obj->emplace(keys[i], built[i]);
+		}
+	}
+
 	template<typename T>
 	fileAllocator<T> getAllocator(){
 		return fileAllocator<T>(handler.getManager());
@@ -54,6 +152,7 @@ public:
 	void resetFile(){
 		handler.getManager()->reset();
 		obj = handler.getManager()->getObj<mapT>();
+		++generation;
 	}
 
 	FileMemoryManagerHandler& getHandler(){
@@ -62,6 +161,30 @@ public:
 
 };
 
+template<typename U>
+U* persistentHandle<U>::revalidate() {
+	auto iter = manager->obj->find(key);
+	if (iter == manager->obj->end()) {
+		throw std::runtime_error(
+				"persistentHandle: object was released or the file reset");
+	}
+	if (iter->second.first != typeid(U).hash_code()) {
+		throw std::runtime_error(
+				"persistentHandle: key now holds an object of another type");
+	}
+	ptr = reinterpret_cast<U*>(iter->second.second);
+	generation = manager->generation;
+	return ptr;
+}
+
+template<typename U>
+inline U* persistentHandle<U>::get() {
+	if (generation != manager->generation) {
+		return revalidate();
+	}
+	return ptr;
+}
+
 }
 
 }
@@ -0,0 +1,226 @@
+#ifndef INFILESTATS_HPP_
+#define INFILESTATS_HPP_
+
+#include "InFileAllocator.hpp"
+#include <chrono>
+#include <condition_variable>
+#include <ostream>
+#include <sstream>
+#include <thread>
+
+namespace inFileAllocator {
+namespace detail {
+
+struct sizeClassStats {
+	size_t blockSize = 0;
+	uint64_t allocations = 0;
+	uint64_t deallocations = 0;
+	uint64_t splits = 0;
+	uint64_t merges = 0;
+	uint64_t freeBlocks = 0;
+
+	int64_t liveBlocks() const {
+		return static_cast<int64_t>(allocations - deallocations);
+	}
+};
+
+struct heapStatsSnapshot {
+	std::vector<sizeClassStats> classes;
+	uint64_t freePagesCalls = 0;
+	uint64_t pagesHandedOut = 0;
+	size_t mappedBytes = 0;
+	size_t bumpBytes = 0;
+	size_t freeListBytes = 0;
+};
+
+// Sums the per thread counters of manager. With walkFreeLists the free lists are
+// walked as well to count free blocks, which touches every free block.
+inline heapStatsSnapshot takeSnapshot(FileMemoryManager &manager,
+		bool walkFreeLists = true) {
+	heapStatsSnapshot snapshot;
+	snapshot.classes.resize(stats::classCount);
+	for (size_t i = 0; i < stats::classCount; ++i) {
+		snapshot.classes[i].blockSize = static_cast<size_t>(1)
+				<< (i + IndexOffset);
+	}
+	stats::registry::instance().forOwner(&manager,
+			[&](const stats::block &b) {
+				for (size_t i = 0; i < stats::classCount; ++i) {
+					snapshot.classes[i].allocations += b.allocations[i].get();
+					snapshot.classes[i].deallocations +=
+							b.deallocations[i].get();
+					snapshot.classes[i].splits += b.splits[i].get();
+					snapshot.classes[i].merges += b.merges[i].get();
+				}
+				snapshot.freePagesCalls += b.freePagesCalls.get();
+				snapshot.pagesHandedOut += b.pagesHandedOut.get();
+			});
+	MemoryFileHandler &fileHandler = manager.getFilehandler();
+	snapshot.mappedBytes = fileHandler.mappedMemSize;
+	snapshot.bumpBytes = fileHandler.size - pageSize;
+	if (walkFreeLists) {
+		manager.forEachFreeBlock([&](void*, size_t blockSize, int) {
+			snapshot.classes[sizeToIndex(blockSize)].freeBlocks++;
+			snapshot.freeListBytes += blockSize;
+		});
+	}
+	return snapshot;
+}
+
+// Prometheus text exposition format, classes without any activity are left out.
+inline void writePrometheus(std::ostream &out,
+		const heapStatsSnapshot &snapshot, const std::string &prefix =
+				"infile_heap") {
+	auto perClass = [&](const char *name, const char *type, const char *help,
+			auto value) {
+		out << "# HELP " << prefix << '_' << name << ' ' << help << '\n';
+		out << "# TYPE " << prefix << '_' << name << ' ' << type << '\n';
+		for (auto &c : snapshot.classes) {
+			if (c.allocations == 0 && c.deallocations == 0 && c.splits == 0
+					&& c.merges == 0 && c.freeBlocks == 0) {
+				continue;
+			}
+			out << prefix << '_' << name << "{size_class=\"" << c.blockSize
+					<< "\"} " << value(c) << '\n';
+		}
+	};
+	auto single = [&](const char *name, const char *type, const char *help,
+			uint64_t value) {
+		out << "# HELP " << prefix << '_' << name << ' ' << help << '\n';
+		out << "# TYPE " << prefix << '_' << name << ' ' << type << '\n';
+		out << prefix << '_' << name << ' ' << value << '\n';
+	};
+	perClass("allocations_total", "counter", "Blocks handed out per size class.",
+			[](const sizeClassStats &c) {
+				return c.allocations;
+			});
+	perClass("deallocations_total", "counter",
+			"Blocks given back per size class.", [](const sizeClassStats &c) {
+				return c.deallocations;
+			});
+	perClass("live_blocks", "gauge", "Allocated blocks per size class.",
+			[](const sizeClassStats &c) {
+				return c.liveBlocks();
+			});
+	perClass("splits_total", "counter",
+			"Blocks split into two buddies per size class.",
+			[](const sizeClassStats &c) {
+				return c.splits;
+			});
+	perClass("merges_total", "counter",
+			"Buddy pairs merged into the next size class.",
+			[](const sizeClassStats &c) {
+				return c.merges;
+			});
+	perClass("free_blocks", "gauge", "Blocks on the free lists per size class.",
+			[](const sizeClassStats &c) {
+				return c.freeBlocks;
+			});
+	single("get_free_pages_calls_total", "counter",
+			"Calls that took pages from the end of the file.",
+			snapshot.freePagesCalls);
+	single("pages_handed_out_total", "counter",
+			"Pages taken from the end of the file.", snapshot.pagesHandedOut);
+	single("mapped_bytes", "gauge", "Size of the mapping.", snapshot.mappedBytes);
+	single("bump_bytes", "gauge", "Bytes below the growth cursor.",
+			snapshot.bumpBytes);
+	single("free_list_bytes", "gauge", "Bytes in blocks on the free lists.",
+			snapshot.freeListBytes);
+}
+
+// writes to a temporary file first, so a textfile collector never sees half a file
+inline void writePrometheusFile(const std::string &path,
+		const heapStatsSnapshot &snapshot) {
+	std::string tmpPath = path + ".tmp";
+	{
+		std::ofstream out(tmpPath, std::ios::trunc);
+		writePrometheus(out, snapshot);
+		if (!out) {
+			throw std::runtime_error("failed to write " + tmpPath);
+		}
+	}
+	if (rename(tmpPath.c_str(), path.c_str()) != 0) {
+		throw std::runtime_error("failed to rename " + tmpPath);
+	}
+}
+
+// for sockets and pipes, returns false when the fd stops accepting data
+inline bool writePrometheusFd(int fd, const heapStatsSnapshot &snapshot) {
+	std::ostringstream out;
+	writePrometheus(out, snapshot);
+	std::string text = out.str();
+	size_t written = 0;
+	while (written < text.size()) {
+		ssize_t res = write(fd, text.data() + written, text.size() - written);
+		if (res < 0 && errno == EINTR) {
+			continue;
+		}
+		if (res <= 0) {
+			return false;
+		}
+		written += res;
+	}
+	return true;
+}
+
+// Writes a snapshot to a file or fd right away and then every interval from a background thread.
+// The heap is read without a lock, so counts may be slightly off while other threads allocate;
+// free lists are only walked when walkFreeLists is set.
+class prometheusExporter {
+	FileMemoryManager &manager;
+	std::string path;
+	int fd = -1;
+	bool walkFreeLists;
+	std::chrono::milliseconds interval;
+	std::mutex mutex;
+	std::condition_variable cond;
+	bool stopping = false;
+	std::thread worker;
+
+	void run() {
+		std::unique_lock<std::mutex> lock(mutex);
+		do {
+			heapStatsSnapshot snapshot = takeSnapshot(manager, walkFreeLists);
+			if (fd >= 0) {
+				if (!writePrometheusFd(fd, snapshot)) {
+					return;
+				}
+			} else {
+				try {
+					writePrometheusFile(path, snapshot);
+				} catch (const std::runtime_error&) {
+					// the next interval tries again
+				}
+			}
+		} while (!cond.wait_for(lock, interval, [&] {
+			return stopping;
+		}));
+	}
+
+public:
+	prometheusExporter(FileMemoryManager &_manager, const std::string &_path,
+			std::chrono::milliseconds _interval, bool _walkFreeLists = false) :
+			manager(_manager), path(_path), walkFreeLists(_walkFreeLists), interval(
+					_interval), worker(&prometheusExporter::run, this) {
+	}
+
+	prometheusExporter(FileMemoryManager &_manager, int _fd,
+			std::chrono::milliseconds _interval, bool _walkFreeLists = false) :
+			manager(_manager), fd(_fd), walkFreeLists(_walkFreeLists), interval(
+					_interval), worker(&prometheusExporter::run, this) {
+	}
+
+	~prometheusExporter() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		cond.notify_all();
+		worker.join();
+	}
+};
+
+}
+}
+
+#endif /* INFILESTATS_HPP_ */
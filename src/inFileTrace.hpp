@@ -0,0 +1,490 @@
+#ifndef INFILETRACE_HPP_
+#define INFILETRACE_HPP_
+
+#include "InFileAllocator.hpp"
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <unordered_map>
+
+namespace inFileAllocator {
+namespace detail {
+
+// Binary trace file: the magic, then one record per call of two LEB128 varints,
+// (offset / 32) << 1 | isAllocation and the requested size. Offsets are from the
+// start of the heap data, so a trace does not depend on where the heap was mapped.
+namespace traceFormat {
+
+constexpr uint64_t magic = 0x3145434152544649; // "IFTRACE1"
+constexpr unsigned int offsetShift = 5;
+
+inline void putVarint(std::vector<uint8_t> &out, uint64_t value) {
+	while (value >= 0x80) {
+		out.push_back(static_cast<uint8_t>(value | 0x80));
+		value >>= 7;
+	}
+	out.push_back(static_cast<uint8_t>(value));
+}
+
+inline bool getVarint(std::istream &in, uint64_t &value) {
+	value = 0;
+	for (unsigned int shift = 0; shift < 64; shift += 7) {
+		int c = in.get();
+		if (c == EOF) {
+			return false;
+		}
+		value |= static_cast<uint64_t>(c & 0x7f) << shift;
+		if ((c & 0x80) == 0) {
+			return true;
+		}
+	}
+	throw std::runtime_error("broken varint in trace");
+}
+
+}
+
+struct traceEvent {
+	bool allocation;
+	uint64_t offset;
+	uint64_t size;
+};
+
+// Records the calls on one heap into a file while it is alive. Heaps are used under an
+// external lock, so the mutex here is normally uncontended; records are buffered and
+// written in 1MiB pieces. Only one recorder can be installed at a time.
+class traceRecorder: public tracing::sink {
+	FileMemoryManager *manager;
+	const Forceduint8_t *dataStart;
+	std::ofstream out;
+	std::mutex mutex;
+	std::vector<uint8_t> buffer;
+	uint64_t eventCount = 0;
+
+	static constexpr size_t flushSize = 1 << 20;
+
+	void record(const void *owner, const void *ptr, size_t size,
+			bool allocation) {
+		if (owner != manager) {
+			return;
+		}
+		uint64_t offset = static_cast<const Forceduint8_t*>(ptr) - dataStart;
+		std::lock_guard<std::mutex> lock(mutex);
+		traceFormat::putVarint(buffer,
+				(offset >> traceFormat::offsetShift) << 1 | allocation);
+		traceFormat::putVarint(buffer, size);
+		eventCount++;
+		if (buffer.size() >= flushSize) {
+			flushLocked();
+		}
+	}
+
+	void flushLocked() {
+		out.write(reinterpret_cast<const char*>(buffer.data()), buffer.size());
+		buffer.clear();
+	}
+
+public:
+	traceRecorder(FileMemoryManager *_manager, const std::string &path) :
+			manager(_manager), dataStart(
+					_manager->getFilehandler().dataAdress + pageSize), out(path,
+					std::ios::binary | std::ios::trunc) {
+		if (!out) {
+			throw std::runtime_error("failed to open " + path);
+		}
+		out.write(reinterpret_cast<const char*>(&traceFormat::magic),
+				sizeof(traceFormat::magic));
+		buffer.reserve(flushSize + 32);
+		tracing::sink *expected = nullptr;
+		if (!tracing::activeSink.compare_exchange_strong(expected, this)) {
+			throw std::runtime_error("a trace recorder is already installed");
+		}
+	}
+
+	// calls still running on other threads must be done before the recorder goes away
+	~traceRecorder() {
+		tracing::activeSink.store(nullptr);
+		std::lock_guard<std::mutex> lock(mutex);
+		flushLocked();
+	}
+
+	void onAllocate(const void *owner, const void *ptr, size_t size) override {
+		record(owner, ptr, size, true);
+	}
+
+	void onDeallocate(const void *owner, const void *ptr, size_t size)
+			override {
+		record(owner, ptr, size, false);
+	}
+
+	uint64_t getEventCount() {
+		std::lock_guard<std::mutex> lock(mutex);
+		return eventCount;
+	}
+};
+
+inline std::vector<traceEvent> readTrace(std::istream &in) {
+	uint64_t magic = 0;
+	in.read(reinterpret_cast<char*>(&magic), sizeof(magic));
+	if (!in || magic != traceFormat::magic) {
+		throw std::runtime_error("not an allocation trace");
+	}
+	std::vector<traceEvent> events;
+	uint64_t key;
+	uint64_t size;
+	while (traceFormat::getVarint(in, key)) {
+		if (!traceFormat::getVarint(in, size)) {
+			throw std::runtime_error("truncated allocation trace");
+		}
+		events.push_back( { (key & 1) != 0, (key >> 1)
+				<< traceFormat::offsetShift, size });
+	}
+	return events;
+}
+
+inline std::vector<traceEvent> readTrace(const std::string &path) {
+	std::ifstream in(path, std::ios::binary);
+	if (!in) {
+		throw std::runtime_error("failed to open " + path);
+	}
+	return readTrace(in);
+}
+
+// Offline models of allocation policies, they only track offsets and never touch memory.
+namespace simulation {
+
+struct classUsage {
+	uint64_t blockSize = 0;
+	uint64_t allocations = 0;
+	uint64_t requestedBytes = 0;
+	uint64_t live = 0;
+	uint64_t peakLive = 0;
+
+	// share of the handed out block bytes that was asked for
+	double utilization() const {
+		return allocations == 0 ?
+				0 : static_cast<double>(requestedBytes) / (allocations * blockSize);
+	}
+};
+
+struct report {
+	std::string policy;
+	uint64_t events = 0;
+	uint64_t peakFileBytes = 0;
+	uint64_t peakRequestedBytes = 0;
+	// both taken when the requested bytes peaked
+	double internalFragmentation = 0;
+	double externalFragmentation = 0;
+	std::vector<classUsage> classes;
+};
+
+class policy {
+public:
+	virtual ~policy() = default;
+	virtual std::string name() const = 0;
+	// returns the offset of the block and its class, the block size is classSize(cls)
+	// or whole pages when that is 0
+	virtual uint64_t allocate(uint64_t size, size_t &cls) = 0;
+	virtual void deallocate(uint64_t offset, uint64_t size, size_t cls) = 0;
+	virtual uint64_t classSize(size_t cls) const = 0;
+	virtual size_t classCount() const = 0;
+	virtual uint64_t fileBytes() const = 0;
+};
+
+struct buddyOptions {
+	// what the heap does by default: 2^k classes starting at 32 bytes, buddies merge below
+	// 64KiB and free blocks are reused LIFO; exactPowerUp sends a request of exactly 2^k to
+	// 2^(k+1), as the heap did before
+	bool exactPowerUp = false;
+	unsigned int mergeBelowPow = 16;
+	unsigned int chunkPow = 16;
+	bool lifo = true;
+};
+
+class buddyPolicy: public policy {
+	static constexpr unsigned int minPow = IndexOffset;
+	static constexpr unsigned int maxPow = 62;
+	buddyOptions options;
+	uint64_t top = 0;
+	std::vector<std::deque<uint64_t>> lists;
+	// free blocks by offset, list entries not found here are stale
+	std::unordered_map<uint64_t, size_t> freeBlocks;
+
+	void pushFree(uint64_t offset, size_t cls) {
+		while (cls + minPow < options.mergeBelowPow) {
+			uint64_t buddy = offset ^ classSize(cls);
+			auto it = freeBlocks.find(buddy);
+			if (it == freeBlocks.end() || it->second != cls) {
+				break;
+			}
+			freeBlocks.erase(it);
+			offset = std::min(offset, buddy);
+			cls++;
+		}
+		freeBlocks[offset] = cls;
+		lists[cls].push_back(offset);
+	}
+
+	bool popFree(size_t cls, uint64_t &offset) {
+		auto &list = lists[cls];
+		while (!list.empty()) {
+			uint64_t candidate;
+			if (options.lifo) {
+				candidate = list.back();
+				list.pop_back();
+			} else {
+				candidate = list.front();
+				list.pop_front();
+			}
+			auto it = freeBlocks.find(candidate);
+			if (it != freeBlocks.end() && it->second == cls) {
+				freeBlocks.erase(it);
+				offset = candidate;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	uint64_t takeBlock(size_t cls) {
+		uint64_t offset;
+		if (popFree(cls, offset)) {
+			return offset;
+		}
+		if (cls + minPow >= options.chunkPow) {
+			offset = top;
+			top += classSize(cls);
+			return offset;
+		}
+		offset = takeBlock(cls + 1);
+		pushFree(offset + classSize(cls), cls);
+		return offset;
+	}
+
+public:
+	buddyPolicy(buddyOptions _options = buddyOptions()) :
+			options(_options), lists(maxPow - minPow + 1) {
+	}
+
+	std::string name() const override {
+		return std::string("buddy") + (options.exactPowerUp ? "-powerup" : "")
+				+ (options.lifo ? "" : "-fifo")
+				+ (options.mergeBelowPow <= minPow ?
+						std::string("-nomerge") :
+						"-merge<"
+								+ std::to_string(
+										static_cast<uint64_t>(1)
+												<< options.mergeBelowPow));
+	}
+
+	uint64_t allocate(uint64_t size, size_t &cls) override {
+		unsigned int pow = minPow;
+		while ((static_cast<uint64_t>(1) << pow) < size
+				|| (options.exactPowerUp
+						&& (static_cast<uint64_t>(1) << pow) == size)) {
+			pow++;
+		}
+		cls = pow - minPow;
+		return takeBlock(cls);
+	}
+
+	void deallocate(uint64_t offset, uint64_t, size_t cls) override {
+		pushFree(offset, cls);
+	}
+
+	uint64_t classSize(size_t cls) const override {
+		return static_cast<uint64_t>(1) << (cls + minPow);
+	}
+
+	size_t classCount() const override {
+		return lists.size();
+	}
+
+	uint64_t fileBytes() const override {
+		return top;
+	}
+};
+
+// Size classes with perDoubling steps between powers of two (16, 20, 24, 28, 32, ... for 4),
+// blocks are carved from chunks of their class and never merged, large blocks get whole pages
+// and are only reused for the same page count.
+class segregatedPolicy: public policy {
+	unsigned int perDoubling;
+	uint64_t chunkSize;
+	std::vector<uint64_t> sizes;
+	std::vector<std::vector<uint64_t>> lists;
+	std::vector<std::pair<uint64_t, uint64_t>> carving; // next, end per class
+	std::multimap<uint64_t, uint64_t> freePages; // size, offset
+	uint64_t top = 0;
+
+public:
+	segregatedPolicy(unsigned int _perDoubling = 4, uint64_t _chunkSize = 1 << 16) :
+			perDoubling(_perDoubling), chunkSize(_chunkSize) {
+		for (uint64_t pow = 4; sizes.empty() || sizes.back() < chunkSize / 4;
+				++pow) {
+			for (unsigned int step = 0; step < perDoubling; ++step) {
+				sizes.push_back(
+						(static_cast<uint64_t>(1) << pow)
+								+ step * ((static_cast<uint64_t>(1) << pow) / perDoubling));
+			}
+		}
+		lists.resize(sizes.size());
+		carving.resize(sizes.size(), { 0, 0 });
+	}
+
+	std::string name() const override {
+		return "segregated-" + std::to_string(perDoubling) + "-per-doubling";
+	}
+
+	uint64_t allocate(uint64_t size, size_t &cls) override {
+		cls = std::lower_bound(sizes.begin(), sizes.end(), size) - sizes.begin();
+		if (cls == sizes.size()) {
+			uint64_t bytes = (size + pageSize - 1) / pageSize * pageSize;
+			auto it = freePages.find(bytes);
+			if (it != freePages.end()) {
+				uint64_t offset = it->second;
+				freePages.erase(it);
+				return offset;
+			}
+			uint64_t offset = top;
+			top += bytes;
+			return offset;
+		}
+		if (!lists[cls].empty()) {
+			uint64_t offset = lists[cls].back();
+			lists[cls].pop_back();
+			return offset;
+		}
+		auto &range = carving[cls];
+		if (range.first + sizes[cls] > range.second) {
+			range = {top, top + chunkSize};
+			top += chunkSize;
+		}
+		uint64_t offset = range.first;
+		range.first += sizes[cls];
+		return offset;
+	}
+
+	void deallocate(uint64_t offset, uint64_t size, size_t cls) override {
+		if (cls < sizes.size()) {
+			lists[cls].push_back(offset);
+		} else {
+			freePages.emplace((size + pageSize - 1) / pageSize * pageSize, offset);
+		}
+	}
+
+	uint64_t classSize(size_t cls) const override {
+		return cls < sizes.size() ? sizes[cls] : 0;
+	}
+
+	size_t classCount() const override {
+		return sizes.size() + 1;
+	}
+
+	uint64_t fileBytes() const override {
+		return top;
+	}
+};
+
+// Replays events against p. Frees of unknown offsets are skipped, a trace may start
+// on a heap that already had live blocks.
+inline report replay(const std::vector<traceEvent> &events, policy &p) {
+	report result;
+	result.policy = p.name();
+	result.classes.resize(p.classCount());
+	for (size_t i = 0; i < result.classes.size(); ++i) {
+		result.classes[i].blockSize = p.classSize(i);
+	}
+	struct liveBlock {
+		uint64_t offset;
+		uint64_t size;
+		size_t cls;
+	};
+	std::unordered_map<uint64_t, liveBlock> live;
+	uint64_t requested = 0;
+	uint64_t blockBytes = 0;
+
+	for (const traceEvent &e : events) {
+		result.events++;
+		if (e.allocation) {
+			size_t cls;
+			uint64_t offset = p.allocate(e.size, cls);
+			uint64_t bytes = p.classSize(cls);
+			if (bytes == 0) {
+				bytes = (e.size + pageSize - 1) / pageSize * pageSize;
+			}
+			live[e.offset] = {offset, e.size, cls};
+			requested += e.size;
+			blockBytes += bytes;
+			classUsage &usage = result.classes[cls];
+			usage.allocations++;
+			usage.requestedBytes += e.size;
+			usage.peakLive = std::max(usage.peakLive, ++usage.live);
+			if (usage.blockSize == 0) {
+				usage.blockSize = bytes;
+			}
+		} else {
+			auto it = live.find(e.offset);
+			if (it == live.end()) {
+				continue;
+			}
+			liveBlock block = it->second;
+			live.erase(it);
+			uint64_t bytes = p.classSize(block.cls);
+			if (bytes == 0) {
+				bytes = (block.size + pageSize - 1) / pageSize * pageSize;
+			}
+			p.deallocate(block.offset, block.size, block.cls);
+			requested -= block.size;
+			blockBytes -= bytes;
+			result.classes[block.cls].live--;
+		}
+		result.peakFileBytes = std::max(result.peakFileBytes, p.fileBytes());
+		if (requested > result.peakRequestedBytes) {
+			result.peakRequestedBytes = requested;
+			result.internalFragmentation = 1.0
+					- static_cast<double>(requested) / blockBytes;
+			result.externalFragmentation = 1.0
+					- static_cast<double>(blockBytes) / p.fileBytes();
+		}
+	}
+	return result;
+}
+
+inline void writeReport(std::ostream &out, const report &r) {
+	out << r.policy << ": events " << r.events << ", peak file "
+			<< r.peakFileBytes << " B, peak requested " << r.peakRequestedBytes
+			<< " B, internal fragmentation " << r.internalFragmentation
+			<< ", external fragmentation " << r.externalFragmentation << '\n';
+	for (auto &c : r.classes) {
+		if (c.allocations == 0) {
+			continue;
+		}
+		out << "  class " << c.blockSize << ": allocations " << c.allocations
+				<< ", peak live " << c.peakLive << ", utilization "
+				<< c.utilization() << '\n';
+	}
+}
+
+// the current heap layout and a few variants worth comparing it to
+inline std::vector<std::unique_ptr<policy>> defaultPolicies() {
+	std::vector<std::unique_ptr<policy>> policies;
+	policies.push_back(std::make_unique<buddyPolicy>());
+	buddyOptions powerUp;
+	powerUp.exactPowerUp = true;
+	policies.push_back(std::make_unique<buddyPolicy>(powerUp));
+	buddyOptions fifo;
+	fifo.lifo = false;
+	policies.push_back(std::make_unique<buddyPolicy>(fifo));
+	buddyOptions noMerge;
+	noMerge.mergeBelowPow = 0;
+	policies.push_back(std::make_unique<buddyPolicy>(noMerge));
+	policies.push_back(std::make_unique<segregatedPolicy>(4));
+	return policies;
+}
+
+}
+
+}
+}
+
+#endif /* INFILETRACE_HPP_ */
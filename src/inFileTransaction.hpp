@@ -0,0 +1,428 @@
+#ifndef INFILETRANSACTION_HPP_
+#define INFILETRANSACTION_HPP_
+
+#include "InFileAllocator.hpp"
+#include "inFileChecksum.hpp"
+#include <condition_variable>
+#include <set>
+
+namespace inFileAllocator {
+namespace detail {
+
+class transactionLog;
+
+// Allocations, frees and writes to the heap that take effect together. A block is allocated
+// right away and given back on abort. A free waits for the commit. A range is declared
+// before it is written and gets its old bytes back on abort. A transaction that is neither
+// committed nor aborted is aborted when it is destroyed.
+class transaction {
+	friend class transactionLog;
+
+	transactionLog *log;
+	uint64_t id;
+	std::vector<std::pair<void*, size_t>> allocations;
+	std::vector<std::pair<void*, std::vector<uint8_t>>> undo;
+	std::vector<std::pair<void*, size_t>> frees;
+
+	transaction(transactionLog *_log, uint64_t _id) :
+			log(_log), id(_id) {
+	}
+
+public:
+	transaction(transaction &&other) :
+			log(other.log), id(other.id), allocations(
+					std::move(other.allocations)), undo(std::move(other.undo)), frees(
+					std::move(other.frees)) {
+		other.log = nullptr;
+	}
+
+	transaction(const transaction&) = delete;
+
+	~transaction();
+
+	Forceduint8_t* allocate(size_t size);
+
+	void deallocate(void *ptr, size_t size) {
+		frees.emplace_back(ptr, size);
+	}
+
+	// before writing len bytes at ptr, blocks allocated in this transaction need no declaring
+	void declare(void *ptr, size_t len);
+
+	// returns once the transaction is durable, see transactionLog
+	void commit();
+
+	void abort();
+
+	bool isActive() const {
+		return log != nullptr;
+	}
+};
+
+// Undo log of transactions on one heap, in a file of its own. Opening it rolls back the
+// transactions a crashed process left: declared ranges get their old bytes back and
+// allocations are freed.
+//
+// Records go to the log file before the heap changes. An allocation is announced by an
+// intent record before the block is taken and logged with its address after; a crash in
+// between leaks the block, which recovery counts in unresolvedAllocations. Commits are
+// grouped: the first committer flushes for everyone waiting, with one sync of the log for the
+// undo records, one msync of the heap and one sync for the commit records of the whole
+// group. syncUndo syncs every undo record before the range may be written. Turning it off
+// saves that sync, but a transaction that is still running when the power fails may be left
+// half done, as its undo records only get synced with the next group; a crash of the process
+// is always rolled back. Blocks freed by a transaction that was committed just before a
+// crash may leak.
+//
+// The heap is shared behind the callers' lock, pass that mutex as for fileLog.
+class transactionLog {
+	friend class transaction;
+
+	enum recordType : uint32_t {
+		undoRecord = 1, allocRecord, commitRecord, abortRecord, intentRecord
+	};
+
+	struct recordHeader {
+		uint32_t crc;
+		uint32_t type;
+		uint64_t txId;
+		uint64_t adr;
+		uint64_t len;
+	};
+
+	FileMemoryManager *manager;
+	int logFd;
+	std::mutex *heapMutex;
+	bool syncUndo;
+
+	std::mutex logMutex;
+	off_t appendOffset = 0;
+	uint64_t nextId = 1;
+	size_t active = 0;
+
+	std::mutex flushMutex;
+	std::condition_variable flushed;
+	bool flushing = false;
+	uint64_t requested = 0;
+	uint64_t done = 0;
+	std::vector<uint64_t> waiting;
+	size_t flushes = 0;
+	size_t recovered = 0;
+	size_t unresolved = 0;
+
+	template<typename F>
+	void withHeap(F func) {
+		if (heapMutex != nullptr) {
+			std::lock_guard<std::mutex> lock(*heapMutex);
+			func();
+		} else {
+			func();
+		}
+	}
+
+	static uint32_t recordCrc(const recordHeader &header, const void *payload) {
+		std::vector<uint8_t> bytes(sizeof(header) - sizeof(header.crc)
+				+ (payload != nullptr ? header.len : 0));
+		memcpy(bytes.data(), &header.type, sizeof(header) - sizeof(header.crc));
+		if (payload != nullptr) {
+			memcpy(bytes.data() + sizeof(header) - sizeof(header.crc), payload,
+					header.len);
+		}
+		return crc32c::compute(bytes.data(), bytes.size());
+	}
+
+	void writeAll(const void *data, size_t len, off_t offset) {
+		auto *bytes = static_cast<const uint8_t*>(data);
+		while (len != 0) {
+			ssize_t n = pwrite(logFd, bytes, len, offset);
+			if (n < 0 && errno == EINTR) {
+				continue;
+			}
+			if (n <= 0) {
+				throw std::runtime_error("transactionLog: failed to write log");
+			}
+			bytes += n;
+			len -= n;
+			offset += n;
+		}
+	}
+
+	void syncLog() {
+		if (fdatasync(logFd) != 0) {
+			throw std::runtime_error("transactionLog: failed to sync log");
+		}
+	}
+
+	// the payload of undo records is the len bytes at adr
+	void append(recordType type, uint64_t txId, const void *adr, size_t len) {
+		recordHeader header { 0, type, txId, reinterpret_cast<uint64_t>(adr),
+				len };
+		const void *payload = type == undoRecord ? adr : nullptr;
+		header.crc = recordCrc(header, payload);
+		std::vector<uint8_t> record(sizeof(header) + (payload ? len : 0));
+		memcpy(record.data(), &header, sizeof(header));
+		if (payload != nullptr) {
+			memcpy(record.data() + sizeof(header), payload, len);
+		}
+		std::lock_guard<std::mutex> lock(logMutex);
+		writeAll(record.data(), record.size(), appendOffset);
+		appendOffset += record.size();
+	}
+
+	void syncHeap() {
+		MemoryFileHandler &fileHandler = manager->getFilehandler();
+		size_t size;
+		withHeap([&] {
+			size = fileHandler.size;
+		});
+		if (msync(fileHandler.dataAdress, size, MS_SYNC) != 0) {
+			throw std::runtime_error("transactionLog: failed to sync heap");
+		}
+	}
+
+	void flushGroup(const std::vector<uint64_t> &group) {
+		syncLog();
+		syncHeap();
+		for (uint64_t txId : group) {
+			append(commitRecord, txId, nullptr, 0);
+		}
+		syncLog();
+		++flushes;
+	}
+
+	// the log is dropped whenever no transaction is running
+	void finished() {
+		std::lock_guard<std::mutex> lock(logMutex);
+		if (--active == 0 && appendOffset != 0) {
+			if (ftruncate(logFd, 0) == 0) {
+				appendOffset = 0;
+			}
+		}
+	}
+
+	uint64_t begun() {
+		std::lock_guard<std::mutex> lock(logMutex);
+		++active;
+		return nextId++;
+	}
+
+	void commit(transaction &tx) {
+		std::unique_lock<std::mutex> lock(flushMutex);
+		waiting.push_back(tx.id);
+		uint64_t ticket = ++requested;
+		while (done < ticket) {
+			if (flushing) {
+				flushed.wait(lock);
+				continue;
+			}
+			flushing = true;
+			std::vector<uint64_t> group;
+			group.swap(waiting);
+			uint64_t target = requested;
+			lock.unlock();
+			std::exception_ptr error;
+			try {
+				flushGroup(group);
+			} catch (...) {
+				error = std::current_exception();
+			}
+			lock.lock();
+			flushing = false;
+			flushed.notify_all();
+			if (error) {
+				// the others of the group flush again
+				waiting.insert(waiting.end(), group.begin(), group.end());
+				waiting.erase(
+						std::find(waiting.begin(), waiting.end(), tx.id));
+				lock.unlock();
+				abort(tx);
+				std::rethrow_exception(error);
+			}
+			done = target;
+		}
+		lock.unlock();
+		withHeap([&] {
+			for (auto &block : tx.frees) {
+				manager->deallocate(block.first, block.second);
+			}
+		});
+		finished();
+	}
+
+	// the abort record is synced after the heap, so a rolled back transaction is never
+	// rolled back again over later ones
+	void abort(transaction &tx) {
+		for (auto it = tx.undo.rbegin(); it != tx.undo.rend(); ++it) {
+			memcpy(it->first, it->second.data(), it->second.size());
+		}
+		withHeap([&] {
+			for (auto it = tx.allocations.rbegin(); it != tx.allocations.rend();
+					++it) {
+				manager->deallocate(it->first, it->second);
+			}
+		});
+		try {
+			syncHeap();
+			append(abortRecord, tx.id, nullptr, 0);
+			syncLog();
+		} catch (...) {
+			finished();
+			throw;
+		}
+		finished();
+	}
+
+	// rolls back what the log holds of transactions without a commit or abort record
+	void recover() {
+		struct stat st;
+		if (fstat(logFd, &st) != 0 || st.st_size == 0) {
+			return;
+		}
+		std::vector<uint8_t> bytes(st.st_size);
+		if (pread(logFd, bytes.data(), bytes.size(), 0)
+				!= static_cast<ssize_t>(bytes.size())) {
+			throw std::runtime_error("transactionLog: failed to read log");
+		}
+		std::vector<std::pair<recordHeader, const uint8_t*>> records;
+		std::set<uint64_t> finishedIds;
+		size_t pos = 0;
+		// a record torn by the crash ends the log
+		while (pos + sizeof(recordHeader) <= bytes.size()) {
+			recordHeader header;
+			memcpy(&header, bytes.data() + pos, sizeof(header));
+			size_t payloadLen = header.type == undoRecord ? header.len : 0;
+			if (header.type < undoRecord || header.type > intentRecord
+					|| pos + sizeof(header) + payloadLen > bytes.size()) {
+				break;
+			}
+			const uint8_t *payload =
+					payloadLen != 0 ? bytes.data() + pos + sizeof(header) : nullptr;
+			if (recordCrc(header, payload) != header.crc) {
+				break;
+			}
+			if (header.type == commitRecord || header.type == abortRecord) {
+				finishedIds.insert(header.txId);
+			}
+			records.emplace_back(header, payload);
+			pos += sizeof(header) + payloadLen;
+		}
+		std::set<uint64_t> rolledBack;
+		// intents of a transaction minus its logged allocations
+		std::map<uint64_t, int64_t> intents;
+		for (auto it = records.rbegin(); it != records.rend(); ++it) {
+			const recordHeader &header = it->first;
+			if (finishedIds.count(header.txId) != 0) {
+				continue;
+			}
+			void *adr = reinterpret_cast<void*>(header.adr);
+			if (header.type == undoRecord) {
+				memcpy(adr, it->second, header.len);
+			} else if (header.type == allocRecord) {
+				manager->deallocate(adr, header.len);
+				intents[header.txId]--;
+			} else if (header.type == intentRecord) {
+				intents[header.txId]++;
+			}
+			rolledBack.insert(header.txId);
+		}
+		recovered = rolledBack.size();
+		unresolved = 0;
+		for (auto &tx : intents) {
+			unresolved += static_cast<size_t>(std::max<int64_t>(tx.second, 0));
+		}
+		syncHeap();
+		if (ftruncate(logFd, 0) != 0) {
+			throw std::runtime_error("transactionLog: failed to truncate log");
+		}
+		syncLog();
+	}
+
+public:
+	transactionLog(FileMemoryManagerHandler &handler, int _logFd,
+			std::mutex *_heapMutex = nullptr, bool _syncUndo = true) :
+			manager(handler.getManager()), logFd(_logFd), heapMutex(_heapMutex), syncUndo(
+					_syncUndo) {
+		if (handler.isReadOnly()) {
+			throw std::runtime_error(
+					"transactionLog: a read only heap can not be changed");
+		}
+		recover();
+	}
+
+	transactionLog(const transactionLog&) = delete;
+
+	transaction begin() {
+		return transaction(this, begun());
+	}
+
+	// transactions rolled back when the log was opened
+	size_t recoveredTransactions() const {
+		return recovered;
+	}
+
+	// allocations of those that were announced but never logged with their address, the
+	// blocks may have been taken and are lost
+	size_t unresolvedAllocations() const {
+		return unresolved;
+	}
+
+	// groups flushed so far, each covering one or more commits
+	size_t flushCount() {
+		std::lock_guard<std::mutex> lock(flushMutex);
+		return flushes;
+	}
+};
+
+inline transaction::~transaction() {
+	if (log != nullptr) {
+		try {
+			abort();
+		} catch (const std::runtime_error&) {
+			// rolled back in memory, the log rolls it back again after a crash
+		}
+	}
+}
+
+inline Forceduint8_t* transaction::allocate(size_t size) {
+	log->append(transactionLog::intentRecord, id, nullptr, size);
+	Forceduint8_t *ptr;
+	log->withHeap([&] {
+		ptr = log->manager->allocate(size);
+	});
+	try {
+		log->append(transactionLog::allocRecord, id, ptr, size);
+	} catch (...) {
+		log->withHeap([&] {
+			log->manager->deallocate(ptr, size);
+		});
+		throw;
+	}
+	allocations.emplace_back(ptr, size);
+	return ptr;
+}
+
+inline void transaction::declare(void *ptr, size_t len) {
+	log->append(transactionLog::undoRecord, id, ptr, len);
+	if (log->syncUndo) {
+		log->syncLog();
+	}
+	auto *bytes = static_cast<const uint8_t*>(ptr);
+	undo.emplace_back(ptr, std::vector<uint8_t>(bytes, bytes + len));
+}
+
+inline void transaction::commit() {
+	transactionLog *l = log;
+	log = nullptr;
+	l->commit(*this);
+}
+
+inline void transaction::abort() {
+	transactionLog *l = log;
+	log = nullptr;
+	l->abort(*this);
+}
+
+}
+}
+
+#endif /* INFILETRANSACTION_HPP_ */
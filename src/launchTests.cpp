@@ -1,7 +1,6 @@
 #include <gtest/gtest.h>
 
 #include "tests.hpp"
-#include "benchmark.hpp"
 
 
 int main(int argc, char** argv){
@@ -1,5 +1,18 @@
 #include <gtest/gtest.h>
 #include "inFileObjectManager.hpp"
+#include "inFileCompactor.hpp"
+#include "inFileIoEngine.hpp"
+#include "inFileExport.hpp"
+#include "inFileStats.hpp"
+#include "inFileTrace.hpp"
+#include "inFileBTree.hpp"
+#include "inFileLog.hpp"
+#include "inFileChecksum.hpp"
+#include "inFileTransaction.hpp"
+#include <map>
+#include <random>
+#include <sstream>
+#include <sys/wait.h>
 
 #pragma once
 
@@ -73,11 +86,15 @@ TEST(SizeToIndex,runTime) {
 	testSizeToIndexRTHelper(1, 0);
 	testSizeToIndexRTHelper(8, 0);
 	testSizeToIndexRTHelper(31, 0);
-	testSizeToIndexRTHelper(32, 1);
+	testSizeToIndexRTHelper(32, 0);
+	testSizeToIndexRTHelper(33, 1);
 	testSizeToIndexRTHelper(63, 1);
-	testSizeToIndexRTHelper(64, 2);
+	testSizeToIndexRTHelper(64, 1);
+	testSizeToIndexRTHelper(65, 2);
 	testSizeToIndexRTHelper(127, 2);
-	testSizeToIndexRTHelper(128, 3);
+	testSizeToIndexRTHelper(128, 2);
+	testSizeToIndexRTHelper(129, 3);
+	testSizeToIndexRTHelper(4096, 7);
 
 }
 
@@ -121,6 +138,40 @@ TEST(objectManager,simpleTypes) {
 	close(fd);
 }
 
+TEST(objectManager,persistentHandle) {
+	int fd = open("testFile.txt", O_CREAT | O_RDWR, 0777);
+	ASSERT_NE(fd, -1);
+	void *ptr = (void*) 0x500000000000;
+	size_t memsz = 4096 * 32;
+	objectManager manager(fd, ptr, memsz);
+	manager.resetFile();
+
+	persistentHandle<int> number = manager.aquireHandle<int>(0, 5);
+	persistentHandle<double> other = manager.aquireHandle<double>(1, 1.5);
+	EXPECT_EQ(*number, 5);
+	*number = 7;
+	EXPECT_EQ(manager.aquire<int>(0), 7);
+	EXPECT_EQ(&*number, &manager.aquire<int>(0));
+
+	// releasing another object only costs the lookup again
+	EXPECT_TRUE(manager.release<double>(1));
+	EXPECT_FALSE(manager.release<double>(1));
+	EXPECT_EQ(*number, 7);
+	EXPECT_THROW(*other, std::runtime_error);
+	EXPECT_THROW(manager.release<float>(0), std::runtime_error);
+
+	EXPECT_TRUE(manager.release<int>(0));
+	EXPECT_THROW(*number, std::runtime_error);
+	manager.aquire<int>(0, 3);
+	EXPECT_EQ(*number, 3);
+
+	manager.resetFile();
+	EXPECT_THROW(*number, std::runtime_error);
+	manager.aquire<float>(0, 1.f);
+	EXPECT_THROW(*number, std::runtime_error);
+	close(fd);
+}
+
 struct TesterType {
 	static inline size_t count = 0;
 	static inline size_t snapShotCount;
@@ -181,6 +232,39 @@ struct autoFd {
 	}
 };
 
+#ifndef INFILEALLOCATOR_DEBUG_HEAP
+TEST(BuddyBlock,pairsFromFirstDataPage) {
+	// the first data page pairs with the next one, not with the header page
+	ASSERT_EQ(
+			UnusedMemBlock<4096>::interBuddyAdress(
+					reinterpret_cast<UnusedMemBlock<4096>*>(0x500000001000)),
+			reinterpret_cast<MemBlock<4096>*>(0x500000002000));
+
+	unlink("buddyTestFile.txt");
+	autoFd fd("buddyTestFile.txt");
+	ASSERT_NE(fd, -1);
+	void *ptr = (void*) 0x500000000000;
+	EXPECT_THROW(
+			FileMemoryManagerHandler(fd, static_cast<Forceduint8_t*>(ptr) + pageSize, 4096 * 32),
+			std::runtime_error);
+	FileMemoryManagerHandler handler(fd, ptr, 4096 * 32);
+	FileMemoryManager &manager = *handler.getManager();
+	Forceduint8_t *a = manager.allocate(4095);
+	Forceduint8_t *b = manager.allocate(4095);
+	EXPECT_EQ(a, static_cast<Forceduint8_t*>(ptr) + pageSize);
+	manager.deallocate(b, 4095);
+	manager.deallocate(a, 4095);
+	// the halves merge back into the chunk they were split from
+	std::vector<std::pair<void*, size_t>> free;
+	manager.forEachFreeBlock([&](void *block, size_t blockSize, int) {
+		free.emplace_back(block, blockSize);
+	});
+	ASSERT_EQ(free.size(), 1ul);
+	EXPECT_EQ(free[0].first, a);
+	EXPECT_EQ(free[0].second, pow2<16>);
+}
+#endif
+
 TEST(allocator,basicAlloc) {
 	autoFd fd("testFile.txt");
 	ASSERT_NE(fd, -1);
@@ -206,6 +290,348 @@ TEST(allocator,basicAlloc) {
 
 }
 
+// tests of block placement, size classes and reuse are left out of debug heap builds, whose
+// redzones and quarantine change all three
+#ifndef INFILEALLOCATOR_DEBUG_HEAP
+TEST(allocator,aligned) {
+	autoFd fd("testFile.txt");
+	ASSERT_NE(fd, -1);
+	void *ptr = (void*) 0x500000000000;
+	size_t memsz = 4096 * 32;
+	FileMemoryManagerHandler handler(fd, ptr, memsz);
+	FileMemoryManager &manager = *handler.getManager();
+	manager.reset();
+
+	for (size_t align : { 8ul, 64ul, 256ul, 4096ul }) {
+		for (size_t size : { 1ul, 24ul, 100ul, 3000ul, 40000ul }) {
+			Forceduint8_t *p = manager.allocateAligned(size, align);
+			EXPECT_EQ(reinterpret_cast<size_t>(p) % align, 0ul);
+			manager.deallocateAligned(p, size, align);
+		}
+	}
+	// a small request takes a block of the alignment, not more
+	Forceduint8_t *a = manager.allocateAligned(10, 64);
+	Forceduint8_t *b = manager.allocateAligned(10, 64);
+	EXPECT_EQ(std::abs(a - b), 64);
+	EXPECT_EQ(FileMemoryManager::alignedSize(10, 64), 64ul);
+	EXPECT_EQ(FileMemoryManager::alignedSize(100, 64), 100ul);
+	manager.deallocateAligned(a, 10, 64);
+	manager.deallocateAligned(b, 10, 64);
+	EXPECT_THROW(manager.allocateAligned(10, 8192), std::runtime_error);
+	EXPECT_THROW(manager.allocateAligned(10, 48), std::runtime_error);
+
+	struct alignas(64) line {
+		char data[8];
+	};
+	std::vector<line, fileAllocator<line>> lines { fileAllocator<line>(&manager) };
+	for (int i = 0; i < 5; ++i) {
+		lines.emplace_back();
+		EXPECT_EQ(reinterpret_cast<size_t>(lines.data()) % 64, 0ul);
+	}
+
+	fileMemoryResource resource(&manager);
+	std::pmr::vector<double> values(&resource);
+	values.assign(100, 1.0);
+	EXPECT_TRUE(manager.getFilehandler().dataAdress <= static_cast<void*>(values.data()));
+	void *page = resource.allocate(100, 4096);
+	EXPECT_EQ(reinterpret_cast<size_t>(page) % 4096, 0ul);
+	resource.deallocate(page, 100, 4096);
+	fileMemoryResource same(&manager);
+	EXPECT_TRUE(resource.is_equal(same));
+	EXPECT_FALSE(resource.is_equal(*std::pmr::new_delete_resource()));
+}
+#endif
+
+TEST(allocator,pmrResource) {
+	using pmrVec = std::pmr::vector<int>;
+	void *ptr = (void*) 0x500000000000;
+	void *otherPtr = (void*) 0x600000000000;
+	size_t memsz = 4096 * 32;
+	{
+		autoFd fd("testFile.txt");
+		ASSERT_NE(fd, -1);
+		objectManager manager(fd, ptr, memsz);
+		manager.resetFile();
+		pmrVec &vec = manager.aquire<pmrVec>(0,
+				manager.getHandler().getManager()->getResource());
+		for (int i = 0; i < 100; ++i) {
+			vec.push_back(i);
+		}
+	}
+	autoFd fd("testFile.txt");
+	ASSERT_NE(fd, -1);
+	objectManager manager(fd, ptr, memsz);
+	FileMemoryManager &heap = *manager.getHandler().getManager();
+	std::pmr::memory_resource *resource = heap.getResource();
+	pmrVec &vec = manager.aquire<pmrVec>(0);
+	ASSERT_EQ(vec.size(), 100ul);
+	EXPECT_EQ(vec.get_allocator().resource(), resource);
+	// grows through the resource in the header after reopening
+	vec.resize(1000, 7);
+	EXPECT_EQ(vec[99], 99);
+	EXPECT_EQ(vec[999], 7);
+
+	autoFd otherFd("pmrTestFile.txt");
+	ASSERT_NE(otherFd, -1);
+	FileMemoryManagerHandler other(otherFd, otherPtr, memsz);
+	FileMemoryManager &otherHeap = *other.getManager();
+	otherHeap.reset();
+	EXPECT_TRUE(resource->is_equal(*heap.getResource()));
+	EXPECT_FALSE(resource->is_equal(*otherHeap.getResource()));
+	EXPECT_TRUE(fileAllocator<int>(&heap) == fileAllocator<long>(&heap));
+	EXPECT_FALSE(fileAllocator<int>(&heap) == fileAllocator<int>(&otherHeap));
+
+	// moves on one heap take the buffer, moves to another heap copy into it
+	pmrVec a(vec.begin(), vec.end(), resource);
+	const int *data = a.data();
+	pmrVec b(resource);
+	b = std::move(a);
+	EXPECT_EQ(b.data(), data);
+	pmrVec c(otherHeap.getResource());
+	c = std::move(b);
+	EXPECT_NE(c.data(), data);
+	EXPECT_GT(static_cast<const void*>(c.data()), otherPtr);
+	EXPECT_EQ(c.size(), 1000ul);
+
+	using vecT = std::vector<int, fileAllocator<int>>;
+	vecT x(vec.begin(), vec.end(), fileAllocator<int>(&heap));
+	vecT y { fileAllocator<int>(&otherHeap) };
+	y = std::move(x);
+	EXPECT_GT(static_cast<const void*>(y.data()), otherPtr);
+	EXPECT_EQ(y[99], 99);
+}
+
+#ifndef INFILEALLOCATOR_DEBUG_HEAP
+TEST(allocator,freeMap) {
+	autoFd fd("btreeTestFile.txt");
+	ASSERT_NE(fd, -1);
+	void *ptr = (void*) 0x500000000000;
+	size_t memsz = 4096 * 1024;
+	FileMemoryManagerHandler handler(fd, ptr, memsz);
+	FileMemoryManager &manager = *handler.getManager();
+	manager.reset();
+
+	// data that looks like the links of a free block is not taken for one
+	size_t *a = reinterpret_cast<size_t*>(manager.allocate(31));
+	size_t *b = reinterpret_cast<size_t*>(manager.allocate(31));
+	ASSERT_EQ(b - a, 4);
+	a[0] = 5747124830538865000ul;
+	a[1] = a[2] = 0;
+	a[3] = 5;
+	manager.deallocate(b, 31);
+	size_t *c = reinterpret_cast<size_t*>(manager.allocate(63));
+	EXPECT_TRUE(c + 8 <= a || c >= a + 4);
+	EXPECT_EQ(a[0], 5747124830538865000ul);
+
+	// blocks spread over more chunks than the header holds merge back into whole chunks
+	std::vector<std::pair<void*, size_t>> blocks;
+	for (size_t i = 0; i < 40000; ++i) {
+		size_t size = 1 + i % 100;
+		blocks.emplace_back(manager.allocate(size), size);
+	}
+	EXPECT_GT(manager.getFilehandler().freeMapBytes, 0ul);
+	std::shuffle(blocks.begin(), blocks.end(), std::mt19937_64(3));
+	for (auto &block : blocks) {
+		manager.deallocate(block.first, block.second);
+	}
+	manager.deallocate(a, 31);
+	manager.deallocate(c, 63);
+	manager.forEachFreeBlock([&](void*, size_t blockSize, int) {
+		EXPECT_GE(blockSize, pow2<16>);
+	});
+}
+#endif
+
+#ifndef INFILEALLOCATOR_DEBUG_HEAP
+TEST(allocator,reusePolicy) {
+	autoFd fd("testFile.txt");
+	ASSERT_NE(fd, -1);
+	void *ptr = (void*) 0x500000000000;
+	size_t memsz = 4096 * 32;
+	FileMemoryManagerHandler handler(fd, ptr, memsz);
+	FileMemoryManager &manager = *handler.getManager();
+	EXPECT_EQ(manager.getReusePolicy(), reusePolicy::lifo);
+
+	// x0 and x2 are no buddies, so they stay apart on the free list
+	auto reused = [&](reusePolicy policy, int firstFreed) {
+		manager.reset();
+		manager.setReusePolicy(policy);
+		Forceduint8_t *x[4];
+		for (auto &block : x) {
+			block = manager.allocate(63);
+		}
+		manager.deallocate(x[firstFreed], 63);
+		manager.deallocate(x[2 - firstFreed], 63);
+		Forceduint8_t *next = manager.allocate(63);
+		return next == x[0] ? 0 : next == x[2] ? 2 : -1;
+	};
+	EXPECT_EQ(reused(reusePolicy::lifo, 2), 0);
+	EXPECT_EQ(reused(reusePolicy::lifo, 0), 2);
+	EXPECT_EQ(reused(reusePolicy::fifo, 2), 2);
+	EXPECT_EQ(reused(reusePolicy::fifo, 0), 0);
+	EXPECT_EQ(reused(reusePolicy::addressOrdered, 2), 0);
+	EXPECT_EQ(reused(reusePolicy::addressOrdered, 0), 0);
+	manager.setReusePolicy(reusePolicy::lifo);
+}
+#endif
+
+TEST(allocator,ingestFile) {
+	// a heap of its own, the mapping size is kept in the file
+	autoFd fd("ingestTestFile.txt");
+	ASSERT_NE(fd, -1);
+	void *ptr = (void*) 0x600000000000;
+	size_t memsz = 4096 * 1024;
+	FileMemoryManagerHandler handler(fd, ptr, memsz);
+	FileMemoryManager &manager = *handler.getManager();
+	manager.reset();
+
+	std::vector<uint8_t> blob(300000 + 123);
+	for (size_t i = 0; i < blob.size(); ++i) {
+		blob[i] = static_cast<uint8_t>(i * 7 + i / 4096);
+	}
+	{
+		autoFd src("ingestTestFile.bin");
+		ASSERT_EQ(ftruncate(src, 0), 0);
+		ASSERT_EQ(pwrite(src, blob.data(), blob.size(), 0),
+				static_cast<ssize_t>(blob.size()));
+		Forceduint8_t *data = manager.ingestFile(src, 0, blob.size());
+		EXPECT_EQ(reinterpret_cast<size_t>(data) % pageSize, 0ul);
+		EXPECT_EQ(memcmp(data, blob.data(), blob.size()), 0);
+		manager.deallocatePageRun(data, blob.size());
+
+		Forceduint8_t *part = manager.ingestFile(src, 4096, 5000);
+		EXPECT_EQ(memcmp(part, blob.data() + 4096, 5000), 0);
+		manager.deallocatePageRun(part, 5000);
+		EXPECT_THROW(manager.ingestFile(src, 4096, blob.size()),
+				std::runtime_error);
+	}
+
+	// writes through the heap fd at the reported offset land in the block
+	FileMemoryManager::pageRun run = manager.reservePageRun(10000);
+	ASSERT_EQ(pwrite(manager.getFd(), blob.data(), run.size, run.fileOffset),
+			static_cast<ssize_t>(run.size));
+	EXPECT_EQ(memcmp(run.data, blob.data(), run.size), 0);
+	manager.deallocatePageRun(run.data, run.size);
+	unlink("ingestTestFile.bin");
+}
+
+TEST(allocator,retiredLayout) {
+	unlink("retiredLayoutTestFile.txt");
+	autoFd fd("retiredLayoutTestFile.txt");
+	ASSERT_NE(fd, -1);
+	void *ptr = (void*) 0x600000000000;
+	size_t memsz = 4096 * 32;
+
+	// objPtr and confNum open the header page in every layout
+	std::vector<uint64_t> page(pageSize / sizeof(uint64_t), 0);
+	page[1] = retiredConfirmationNumbers[0];
+	page[2] = 0x1234;
+	ASSERT_EQ(pwrite(fd, page.data(), pageSize, 0), static_cast<ssize_t>(pageSize));
+	for (auto mode : { FileMemoryManagerHandler::openMode::readWrite,
+			FileMemoryManagerHandler::openMode::readOnly }) {
+		try {
+			FileMemoryManagerHandler(fd, ptr, memsz, mode);
+			ADD_FAILURE() << "opened a heap of an earlier layout";
+		} catch (const std::runtime_error &e) {
+			EXPECT_STREQ(
+					"heap header has a layout that is no longer supported, recreate the heap",
+					e.what());
+		}
+	}
+	std::vector<uint64_t> after(page.size());
+	ASSERT_EQ(pread(fd, after.data(), pageSize, 0), static_cast<ssize_t>(pageSize));
+	EXPECT_EQ(after, page);
+
+	// a header whose layout is not known at all is not taken for an empty one either
+	page[1] = confirmationNumber + 1;
+	ASSERT_EQ(pwrite(fd, page.data(), pageSize, 0), static_cast<ssize_t>(pageSize));
+	try {
+		FileMemoryManagerHandler(fd, ptr, memsz);
+		ADD_FAILURE() << "opened a heap of an unknown layout";
+	} catch (const std::runtime_error &e) {
+		EXPECT_STREQ("file holds no heap of a known layout", e.what());
+	}
+	ASSERT_EQ(pread(fd, after.data(), pageSize, 0), static_cast<ssize_t>(pageSize));
+	EXPECT_EQ(after, page);
+}
+
+// under ASan the writes to redzones and freed blocks below are reported by ASan itself
+#if defined(INFILEALLOCATOR_DEBUG_HEAP) && !defined(INFILEALLOCATOR_ASAN)
+TEST(allocator,debugHeap) {
+	unlink("debugHeapTestFile.txt");
+	autoFd fd("debugHeapTestFile.txt");
+	ASSERT_NE(fd, -1);
+	void *ptr = (void*) 0x600000000000;
+	FileMemoryManagerHandler handler(fd, ptr, pow2<22>);
+	FileMemoryManager &manager = *handler.getManager();
+	auto onError = debugHeap::onError;
+	debugHeap::onError = [](const std::string &message) {
+		throw std::runtime_error(message);
+	};
+
+	Forceduint8_t *block = manager.allocate(100);
+	EXPECT_EQ(block[0], debugHeap::allocatedByte);
+	EXPECT_EQ(block[99], debugHeap::allocatedByte);
+	EXPECT_EQ(block[100], debugHeap::redzoneByte);
+	memset(block, 1, 100);
+	manager.deallocate(block, 100);
+	EXPECT_EQ(block[0], debugHeap::freedByte);
+	EXPECT_THROW(manager.deallocate(block, 100), std::runtime_error);
+
+	// a freed block stays out of the lists until the quarantine is flushed
+	Forceduint8_t *other = manager.allocate(100);
+	EXPECT_NE(other, block);
+	EXPECT_THROW(manager.deallocate(other, 50), std::runtime_error);
+	manager.deallocate(other, 100);
+	block[10] = 1;
+	EXPECT_THROW(manager.flushQuarantine(), std::runtime_error);
+	manager.flushQuarantine();
+
+	// the first byte past the block is guarded
+	Forceduint8_t *overrun = manager.allocate(64);
+	overrun[64] = 1;
+	EXPECT_THROW(manager.deallocate(overrun, 64), std::runtime_error);
+	Forceduint8_t *underrun = manager.allocate(64);
+	underrun[-20] = 1;
+	EXPECT_THROW(manager.deallocate(underrun, 64), std::runtime_error);
+
+	Forceduint8_t *aligned = manager.allocateAligned(100, 4096);
+	EXPECT_EQ(reinterpret_cast<size_t>(aligned) % 4096, 0ul);
+	manager.deallocateAligned(aligned, 100, 4096);
+	manager.flushQuarantine();
+
+	// blocks bound to a node are guarded the same way and go back to their arena
+	manager.enableNodeArenas(2);
+	Forceduint8_t *onNode = manager.allocateOnNode(64, 1);
+	EXPECT_EQ(onNode[64], debugHeap::redzoneByte);
+	onNode[64] = 1;
+	EXPECT_THROW(manager.deallocateOnNode(onNode, 64, 1), std::runtime_error);
+	onNode = manager.allocateOnNode(64, 1);
+	manager.deallocateOnNode(onNode, 64, 1);
+	EXPECT_EQ(onNode[0], debugHeap::freedByte);
+	manager.flushQuarantine();
+	size_t onNode1 = 0;
+	manager.forEachFreeBlock([&](void*, size_t, int node) {
+		onNode1 += node == 1;
+	});
+	EXPECT_GT(onNode1, 0ul);
+
+	// workers of a parallel build fill and release quarantines of their own
+	size_t quarantineBytes = debugHeap::quarantineBytes.load();
+	debugHeap::quarantineBytes = 8 * pageSize;
+	manager.parallelBuild(4, pow2<18>, [&](size_t) {
+		for (size_t i = 0; i < 200; ++i) {
+			Forceduint8_t *p = manager.allocate(1000);
+			memset(p, 1, 1000);
+			manager.deallocate(p, 1000);
+		}
+	});
+	debugHeap::quarantineBytes = quarantineBytes;
+	manager.flushQuarantine();
+	debugHeap::onError = onError;
+}
+#endif
+
 TEST(objectManager,simpleVec) {
 	autoFd fd("testFile.txt");
 	ASSERT_NE(fd, -1);
@@ -303,4 +729,1101 @@ TEST(objectManager,compoundVec) {
 }
 
 
+
+#ifndef INFILEALLOCATOR_DEBUG_HEAP
+TEST(objectManager,parallelBuild) {
+	autoFd fd("parallelTestFile.txt");
+	ASSERT_NE(fd, -1);
+	void *ptr = (void*) 0x600000000000;
+	size_t memsz = pow2<26>;
+	objectManager manager(fd, ptr, memsz);
+	manager.resetFile();
+	FileMemoryManager &heap = *manager.getHandler().getManager();
+
+	using vecT = std::vector<int, fileAllocator<int>>;
+	using vec2T = std::vector<vecT, fileAllocator<vecT>>;
+	std::vector<keyT> keys;
+	for (keyT key = 0; key < 64; ++key) {
+		keys.push_back(key);
+	}
+	manager.buildParallel<vec2T>(keys, 4, pow2<20>, [](keyT key, vec2T &vec) {
+		for (size_t i = 0; i < 50; ++i) {
+			vec.emplace_back();
+			for (size_t j = 0; j <= i % 7; ++j) {
+				vec.back().push_back(static_cast<int>(key * 1000 + i));
+			}
+		}
+	});
+	for (keyT key : keys) {
+		vec2T &vec = manager.aquire<vec2T>(key);
+		ASSERT_EQ(vec.size(), 50ul);
+		for (size_t i = 0; i < 50; ++i) {
+			ASSERT_EQ(vec[i].size(), i % 7 + 1);
+			EXPECT_EQ(vec[i][0], static_cast<int>(key * 1000 + i));
+		}
+	}
+	// the built objects are ordinary heap blocks afterwards
+	manager.aquire<vec2T>(3).emplace_back().push_back(1);
+	EXPECT_TRUE(manager.release<vec2T>(5));
+	EXPECT_THROW(manager.buildParallel<vec2T>( { 3 }, 1, pow2<16>,
+			[](keyT, vec2T&) {}), std::runtime_error);
+	EXPECT_THROW(manager.buildParallel<vec2T>( { 100, 101 }, 2, pow2<16>,
+			[](keyT key, vec2T &vec) {
+				if (key == 101) {
+					vec.resize(pow2<20>);
+				}
+			}), std::runtime_error);
+
+	// everything a build left unused can be allocated again
+	size_t before = heap.getFilehandler().size;
+	manager.buildParallel<vec2T>( { 200 }, 1, pow2<20>, [](keyT, vec2T &vec) {
+		vec.emplace_back().push_back(7);
+	});
+	Forceduint8_t *block = heap.allocate(pow2<19> - 1);
+	EXPECT_LT(block, heap.getFilehandler().dataAdress + before + pow2<20>);
+	heap.deallocate(block, pow2<19> - 1);
+	EXPECT_EQ(manager.aquire<vec2T>(200)[0][0], 7);
+
+	// a key given twice is refused before anything is built
+	EXPECT_THROW(manager.buildParallel<vec2T>( { 300, 300 }, 2, pow2<16>,
+			[](keyT, vec2T&) {}), std::runtime_error);
+	EXPECT_FALSE(manager.release<vec2T>(300));
+
+	// what the workers allocate is traced and counted for the heap
+	struct workerSink: tracing::sink {
+		std::thread::id builder = std::this_thread::get_id();
+		std::atomic<size_t> allocations { 0 };
+		void onAllocate(const void*, const void*, size_t) override {
+			if (std::this_thread::get_id() != builder) {
+				++allocations;
+			}
+		}
+		void onDeallocate(const void*, const void*, size_t) override {
+		}
+	} sink;
+	auto counted = [&]() {
+		uint64_t n = 0;
+		for (auto &c : takeSnapshot(heap, false).classes) {
+			n += c.allocations;
+		}
+		return n;
+	};
+	uint64_t countedBefore = counted();
+	tracing::activeSink.store(&sink);
+	manager.buildParallel<vec2T>( { 300, 301 }, 2, pow2<16>, [](keyT, vec2T &vec) {
+		vec.emplace_back().push_back(1);
+	});
+	tracing::activeSink.store(nullptr);
+	// the object, the outer and the inner buffer of each key
+	EXPECT_EQ(sink.allocations.load(), 6ul);
+	EXPECT_GE(counted() - countedBefore, 6ul);
+}
+#endif
+
+TEST(objectManager,twoHeaps) {
+	using vecT = std::vector<size_t, fileAllocator<size_t>>;
+	using vec2T = std::vector<vecT, fileAllocator<vecT>>;
+	void *ptr = (void*) 0x500000000000;
+	void *otherPtr = (void*) 0x600000000000;
+	size_t memsz = 4096 * 32;
+	autoFd otherFd("shardTestFile.txt");
+	ASSERT_NE(otherFd, -1);
+	objectManager other(otherFd, otherPtr, memsz);
+	other.resetFile();
+	other.aquire<vec2T>(0).emplace_back().push_back(2);
+	{
+		autoFd fd("testFile.txt");
+		ASSERT_NE(fd, -1);
+		objectManager manager(fd, ptr, memsz);
+		manager.resetFile();
+		// the inner vectors are default constructed inside their heap
+		manager.aquire<vec2T>(0).emplace_back().push_back(1);
+	}
+	autoFd fd("testFile.txt");
+	ASSERT_NE(fd, -1);
+	objectManager manager(fd, ptr, memsz);
+	vec2T &vec = manager.aquire<vec2T>(0);
+	vec2T &otherVec = other.aquire<vec2T>(0);
+	vec.emplace_back().resize(100, 1);
+	otherVec.emplace_back().resize(100, 2);
+	for (auto &inner : vec) {
+		EXPECT_LT(static_cast<void*>(inner.data()), otherPtr);
+		EXPECT_EQ(inner.get_allocator().getManagerPtr(),
+				manager.getHandler().getManager());
+		EXPECT_EQ(inner[0], 1ul);
+	}
+	for (auto &inner : otherVec) {
+		EXPECT_GT(static_cast<void*>(inner.data()), otherPtr);
+		EXPECT_EQ(inner[0], 2ul);
+	}
+
+	EXPECT_THROW(vecT(), std::runtime_error);
+	{
+		heaps::scope shard(other.getHandler().getManager());
+		vecT outside;
+		outside.push_back(3);
+		EXPECT_GT(static_cast<void*>(outside.data()), otherPtr);
+		{
+			heaps::scope inner(manager.getHandler().getManager());
+			vecT nested;
+			nested.push_back(4);
+			EXPECT_LT(static_cast<void*>(nested.data()), otherPtr);
+		}
+		EXPECT_EQ(vecT().get_allocator().getManagerPtr(),
+				other.getHandler().getManager());
+	}
+}
+
+TEST(objectManager,readOnlyPublish) {
+	using vecT = std::vector<size_t, fileAllocator<size_t>>;
+	void *ptr = (void*) 0x500000000000;
+	size_t memsz = 4096 * 32;
+	using openMode = FileMemoryManagerHandler::openMode;
+	auto build = [&](const char *path, size_t value, size_t size) {
+		autoFd fd(path);
+		FileMemoryManagerHandler handler(fd, ptr, size);
+		handler.getManager()->reset();
+		handler.getManager()->getObj<vecT>()->assign(1000, value);
+		handler.sync();
+	};
+	build("readOnlyTestFile.tmp", 1, memsz);
+	publishHeapFile("readOnlyTestFile.tmp", "readOnlyTestFile.txt");
+	build("readOnlyTestFile.tmp", 2, memsz);
+	{
+		autoFd fd("readOnlyTestFile.txt");
+		FileMemoryManagerHandler reader(fd, ptr, memsz, openMode::readOnly);
+		EXPECT_TRUE(reader.isReadOnly());
+		auto *vec = static_cast<vecT*>(reader.getManager()->getObjPtr());
+		ASSERT_EQ(vec->size(), 1000ul);
+		EXPECT_EQ((*vec)[999], 1ul);
+		// the resource in the header still has the writer's vtable pointer
+		EXPECT_THROW(reader.getManager()->getResource(), std::runtime_error);
+
+		// the builder publishes the next version while the reader keeps the first one
+		publishHeapFile("readOnlyTestFile.tmp", "readOnlyTestFile.txt");
+		EXPECT_EQ((*vec)[999], 1ul);
+		autoFd newFd("readOnlyTestFile.txt");
+		reader.remap(newFd);
+		vec = static_cast<vecT*>(reader.getManager()->getObjPtr());
+		EXPECT_EQ((*vec)[999], 2ul);
+
+	}
+	{
+		autoFd fd("readOnlyTestFile.tmp");
+		EXPECT_THROW(FileMemoryManagerHandler(fd, ptr, memsz, openMode::readOnly),
+				std::runtime_error);
+	}
+	{
+		// a reader may map more than the heap grew to, at an address of its own
+		void *otherPtr = (void*) 0x600000000000;
+		autoFd fd("readOnlyTestFile.txt");
+		FileMemoryManagerHandler wide(fd, otherPtr, memsz * 2, openMode::readOnly);
+		EXPECT_EQ(wide.getManager()->getMemSize(), memsz);
+
+		// but a version that grew past the mapping can not be remapped over it
+		build("readOnlyTestFile.tmp", 3, memsz * 4);
+		publishHeapFile("readOnlyTestFile.tmp", "readOnlyTestFile.txt");
+		autoFd newFd("readOnlyTestFile.txt");
+		try {
+			wide.remap(newFd);
+			ADD_FAILURE() << "remapped a heap bigger than the mapping";
+		} catch (const std::runtime_error &e) {
+			EXPECT_STREQ("different size of memory given", e.what());
+		}
+		EXPECT_EQ(wide.getManager()->getMemSize(), memsz);
+	}
+}
+
+TEST(objectManager,growHeap) {
+	using vecT = std::vector<size_t, fileAllocator<size_t>>;
+	void *ptr = (void*) 0x500000000000;
+	size_t memsz = 4096 * 8;
+	size_t reserve = 4096 * 1024;
+	unlink("growTestFile.txt");
+	{
+		autoFd fd("growTestFile.txt");
+		ASSERT_NE(fd, -1);
+		FileMemoryManagerHandler handler(fd, ptr, memsz);
+		FileMemoryManager &manager = *handler.getManager();
+		manager.reset();
+		EXPECT_THROW(manager.allocate(pow2<16>), std::runtime_error);
+	}
+	{
+		autoFd fd("growTestFile.txt");
+		FileMemoryManagerHandler handler(fd, ptr, memsz,
+				FileMemoryManagerHandler::openMode::readWrite, reserve);
+		FileMemoryManager &manager = *handler.getManager();
+		vecT *vec = manager.getObj<vecT>(fileAllocator<size_t>(&manager));
+		for (size_t i = 0; i < 50000; ++i) {
+			vec->push_back(i);
+		}
+		EXPECT_GT(manager.getMemSize(), memsz);
+		EXPECT_LE(manager.getMemSize(), reserve);
+		EXPECT_THROW(manager.allocate(reserve), std::runtime_error);
+	}
+	// reopening maps the size the heap grew to, without giving the reservation again
+	autoFd fd("growTestFile.txt");
+	FileMemoryManagerHandler handler(fd, ptr, memsz);
+	FileMemoryManager &manager = *handler.getManager();
+	EXPECT_GT(manager.getMemSize(), memsz);
+	auto *vec = static_cast<vecT*>(manager.getObjPtr());
+	ASSERT_EQ(vec->size(), 50000ul);
+	EXPECT_EQ((*vec)[49999], 49999ul);
+}
+
+#ifndef INFILEALLOCATOR_DEBUG_HEAP
+TEST(compactor,handles) {
+	autoFd fd("testFile.txt");
+	ASSERT_NE(fd, -1);
+	void *ptr = (void*) 0x500000000000;
+	size_t memsz = 4096 * 32;
+	FileMemoryManagerHandler handler(fd, ptr, memsz);
+	FileMemoryManager &manager = *handler.getManager();
+	manager.reset();
+
+	std::vector<size_t*> blocks;
+	for (size_t i = 0; i < 256; ++i) {
+		size_t *block = reinterpret_cast<size_t*>(manager.allocate(64));
+		*block = i;
+		blocks.push_back(block);
+	}
+	for (size_t i = 0; i < 128; ++i) {
+		manager.deallocate(blocks[i], 64);
+	}
+
+	heapCompactor compactor(&manager);
+	std::vector<size_t*> old(blocks.begin() + 128, blocks.end());
+	for (size_t i = 128; i < 256; ++i) {
+		compactor.registerHandle(blocks[i], 8);
+	}
+	while (!compactor.runSlice(std::chrono::microseconds(50))) {
+	}
+	EXPECT_EQ(compactor.getStats().blocksMoved, 128ul);
+	EXPECT_EQ(compactor.getStats().passes, 1ul);
+	for (size_t i = 128; i < 256; ++i) {
+		EXPECT_LT(blocks[i], old[0]);
+		EXPECT_EQ(*blocks[i], i);
+	}
+	compactor.runPass();
+	EXPECT_EQ(compactor.getStats().blocksMoved, 128ul);
+}
+#endif
+
+#ifndef INFILEALLOCATOR_DEBUG_HEAP
+TEST(compactor,containersAndTail) {
+	autoFd fd("testFile.txt");
+	ASSERT_NE(fd, -1);
+	void *ptr = (void*) 0x500000000000;
+	size_t memsz = 4096 * 32;
+	TesterType::setup(ptr, memsz);
+	objectManager manager(fd, ptr, memsz);
+	manager.resetFile();
+	FileMemoryManager &fileManager = *manager.getHandler().getManager();
+
+	using vecT = std::vector<TesterType,fileAllocator<TesterType>>;
+	vecT &vec1 = manager.aquire<vecT>(0);
+	vecT &vec2 = manager.aquire<vecT>(1);
+	vec1.resize(10);
+	vec2.resize(10);
+	TesterType *oldData = vec2.data();
+	vecT(vec1.get_allocator()).swap(vec1);
+
+	char *big = reinterpret_cast<char*>(fileManager.allocate(pageSize * 16));
+	size_t sizeBefore = fileManager.getFilehandler().size;
+	fileManager.deallocate(big, pageSize * 16);
+
+	heapCompactor compactor(&fileManager);
+	compactor.registerContainer(vec2);
+	compactor.runPass();
+
+	EXPECT_LT(vec2.data(), oldData);
+	EXPECT_EQ(vec2.size(), 10ul);
+	for (auto &v : vec2) {
+		v.testSelfAddress();
+	}
+	EXPECT_EQ(compactor.getStats().bytesTrimmed, pageSize * 16);
+	EXPECT_EQ(fileManager.getFilehandler().size, sizeBefore - pageSize * 16);
+	EXPECT_DOUBLE_EQ(compactor.progress(), 0.0);
+}
+#endif
+
+
+#ifndef INFILEALLOCATOR_DEBUG_HEAP
+TEST(numa,nodeArenas) {
+	autoFd fd("numaTestFile.txt");
+	ASSERT_NE(fd, -1);
+	void *ptr = (void*) 0x500000000000;
+	size_t memsz = 4096 * 128;
+	FileMemoryManagerHandler handler(fd, ptr, memsz);
+	FileMemoryManager &manager = *handler.getManager();
+	manager.reset();
+
+	ASSERT_GE(numa::nodeCount(), 1ul);
+	ASSERT_GE(numa::threadNode(), 0);
+
+	manager.enableNodeArenas(2);
+	ASSERT_EQ(manager.getNodeArenaCount(), 2ul);
+
+	Forceduint8_t *onNode1 = manager.allocateOnNode(100, 1);
+	manager.deallocateOnNode(onNode1, 100, 1);
+	Forceduint8_t *onNode0 = manager.allocateOnNode(100, 0);
+	EXPECT_NE(onNode0, onNode1);
+	auto chunkOf = [&](Forceduint8_t *adr) {
+		return (adr - static_cast<Forceduint8_t*>(ptr) - pageSize) / pow2<16>;
+	};
+	EXPECT_NE(chunkOf(onNode0), chunkOf(onNode1));
+	EXPECT_EQ(chunkOf(manager.allocateOnNode(100, 1)), chunkOf(onNode1));
+
+	// nodes without an arena fall back to the shared lists
+	Forceduint8_t *shared = manager.allocateOnNode(100, 7);
+	manager.deallocateOnNode(shared, 100, 7);
+	EXPECT_EQ(manager.allocate(100), shared);
+
+	numaFileAllocator<int> alloc(&manager, 1);
+	std::vector<int, numaFileAllocator<int>> vec(alloc);
+	for (int i = 0; i < 100; ++i) {
+		vec.push_back(i);
+	}
+	EXPECT_EQ(vec[99], 99);
+}
+#endif
+
+
+void testIoEngineHelper(bool forceThreadPool) {
+	autoFd fd("testFile.txt");
+	ASSERT_NE(fd, -1);
+	void *ptr = (void*) 0x500000000000;
+	size_t memsz = 4096 * 32;
+	FileMemoryManagerHandler handler(fd, ptr, memsz);
+	FileMemoryManager &manager = *handler.getManager();
+	manager.reset();
+
+	ioEngineOptions options;
+	options.forceThreadPool = forceThreadPool;
+	ioEngine &engine = attachIoEngine(handler, options);
+	ASSERT_EQ(handler.getIoEngine(), &engine);
+	if (forceThreadPool) {
+		EXPECT_FALSE(engine.usesIoUring());
+	}
+
+	char *data = reinterpret_cast<char*>(manager.allocate(pageSize * 3));
+	memset(data, 'x', pageSize * 3);
+	std::vector<std::future<int>> results;
+	for (int i = 0; i < 100; ++i) {
+		results.push_back(engine.writeback(data + i, pageSize * 2));
+		results.push_back(engine.prefetch(data, pageSize * 3));
+	}
+	results.push_back(engine.writeback(data, pageSize * 3, true));
+	results.push_back(engine.flush());
+	for (auto &result : results) {
+		EXPECT_EQ(result.get(), 0);
+	}
+
+	char check[16];
+	ASSERT_EQ(pread(fd, check, sizeof(check), data - static_cast<char*>(ptr)),
+			static_cast<ssize_t>(sizeof(check)));
+	EXPECT_EQ(check[15], 'x');
+}
+
+TEST(ioEngine,threadPool) {
+	testIoEngineHelper(true);
+}
+
+TEST(ioEngine,defaultBackend) {
+	testIoEngineHelper(false);
+}
+
+
+TEST(blockCodec,roundTrip) {
+	std::vector<uint8_t> raw(100000);
+	for (size_t i = 0; i < raw.size(); ++i) {
+		raw[i] = (i % 1000 < 500) ? 0 : static_cast<uint8_t>(i * 7 / 3);
+	}
+	std::vector<uint8_t> packed;
+	blockCodec::compress(raw.data(), raw.size(), packed);
+	EXPECT_LT(packed.size(), raw.size() / 2);
+	std::vector<uint8_t> unpacked(raw.size());
+	blockCodec::decompress(packed.data(), packed.size(), unpacked.data(),
+			unpacked.size());
+	EXPECT_EQ(raw, unpacked);
+}
+
+TEST(heapExport,moveToOtherBase) {
+	using vecT = std::vector<size_t,fileAllocator<size_t>>;
+	using vec2T = std::vector<vecT,fileAllocator<vecT>>;
+	void *ptr = (void*) 0x500000000000;
+	void *otherPtr = (void*) 0x600000000000;
+	size_t memsz = 4096 * 32;
+	std::stringstream stream;
+	std::stringstream unrebased;
+	size_t written;
+	{
+		autoFd fd("testFile.txt");
+		ASSERT_NE(fd, -1);
+		objectManager manager(fd, ptr, memsz);
+		manager.resetFile();
+		vec2T &vec = manager.aquire<vec2T>(0);
+		for (size_t j = 0; j < 5; j++) {
+			auto &ref = vec.emplace_back();
+			for (size_t i = 0; i < 20; ++i) {
+				ref.push_back(i * j);
+			}
+		}
+		manager.aquire<size_t>(1, 42ul);
+		FileMemoryManager &heap = *manager.getHandler().getManager();
+		heap.setReusePolicy(reusePolicy::fifo);
+		written = exportHeap(heap, stream, heapExporter::rebaseAll);
+		EXPECT_LT(written, heap.getFilehandler().size);
+		// without rebased pointers the export only fits a heap at the same address
+		exportHeap(heap, unrebased);
+	}
+	{
+		autoFd fd("exportTestFile.txt");
+		ASSERT_NE(fd, -1);
+		FileMemoryManagerHandler handler(fd, otherPtr, memsz);
+		EXPECT_THROW(importHeap(*handler.getManager(), unrebased),
+				std::runtime_error);
+		importHeap(*handler.getManager(), stream);
+		EXPECT_EQ(handler.getManager()->getReusePolicy(), reusePolicy::fifo);
+	}
+	{
+		autoFd fd("exportTestFile.txt");
+		objectManager manager(fd, otherPtr, memsz);
+		EXPECT_EQ(manager.aquire<size_t>(1), 42ul);
+		vec2T &vec = manager.aquire<vec2T>(0);
+		ASSERT_EQ(vec.size(), 5ul);
+		for (size_t j = 0; j < 5; j++) {
+			ASSERT_EQ(vec[j].size(), 20ul);
+			EXPECT_GT(static_cast<void*>(vec[j].data()), otherPtr);
+			for (size_t i = 0; i < 20; ++i) {
+				EXPECT_EQ(vec[j][i], i * j);
+			}
+		}
+		vec[0].resize(100);
+		vec.emplace_back().resize(10);
+		manager.aquire<int>(2, 1);
+	}
+}
+
+TEST(heapExport,pointerFilterAndTable) {
+	unlink("exportTableTestFile.txt");
+	unlink("exportTableTestFile2.txt");
+	auto *ptr = reinterpret_cast<Forceduint8_t*>(0x500000000000);
+	auto *otherPtr = reinterpret_cast<Forceduint8_t*>(0x600000000000);
+	size_t memsz = 4096 * 1024;
+	std::stringstream stream;
+	size_t sourceFree = 0;
+	size_t tableBytes;
+	{
+		autoFd fd("exportTableTestFile.txt");
+		ASSERT_NE(fd, -1);
+		FileMemoryManagerHandler handler(fd, ptr, memsz);
+		FileMemoryManager &manager = *handler.getManager();
+		// small blocks past the chunks kept in the header need the table
+		manager.allocate(pow2<19>);
+		auto *words = reinterpret_cast<uint64_t*>(manager.allocate(63));
+		words[0] = reinterpret_cast<uint64_t>(words + 1);
+		words[1] = reinterpret_cast<uint64_t>(ptr + pageSize); // an integer
+		manager.getObj<uint64_t*>(reinterpret_cast<uint64_t*>(words));
+		tableBytes = manager.getFilehandler().freeMapChunks
+				* sizeof(*manager.getFilehandler().freeMap);
+		ASSERT_GT(tableBytes, 0ul);
+		manager.forEachFreeBlock([&](void*, size_t blockSize, int) {
+			sourceFree += blockSize;
+		});
+		void *obj = manager.getObjPtr();
+		exportHeap(manager, stream, [&](const void *slot) {
+			return slot == words || slot == obj;
+		});
+	}
+	std::string exported = stream.str();
+	{
+		autoFd fd("exportTableTestFile2.txt");
+		ASSERT_NE(fd, -1);
+		FileMemoryManagerHandler handler(fd, otherPtr, memsz);
+		FileMemoryManager &manager = *handler.getManager();
+		importHeap(manager, stream);
+		auto *words = *static_cast<uint64_t**>(manager.getObjPtr());
+		EXPECT_EQ(words[0], reinterpret_cast<uint64_t>(words + 1));
+		EXPECT_EQ(words[1], reinterpret_cast<uint64_t>(ptr + pageSize));
+		size_t importedFree = 0;
+		manager.forEachFreeBlock([&](void*, size_t blockSize, int) {
+			importedFree += blockSize;
+		});
+		EXPECT_EQ(importedFree, sourceFree + tableBytes);
+
+		std::stringstream truncated(exported.substr(0, 6));
+		EXPECT_THROW(importHeap(manager, truncated), std::runtime_error);
+	}
+}
+
+#ifndef INFILEALLOCATOR_DEBUG_HEAP
+TEST(heapStats,snapshotAndPrometheus) {
+	autoFd fd("testFile.txt");
+	ASSERT_NE(fd, -1);
+	void *ptr = (void*) 0x500000000000;
+	size_t memsz = 4096 * 32;
+	FileMemoryManagerHandler handler(fd, ptr, memsz);
+	FileMemoryManager &manager = *handler.getManager();
+	manager.reset();
+	heapStatsSnapshot before = takeSnapshot(manager);
+	// reset starts the counts over, a heap mapped here later does not inherit them
+	EXPECT_EQ(before.freePagesCalls, 0ul);
+	EXPECT_EQ(before.classes[sizeToIndex(40)].allocations, 0ul);
+
+	std::vector<Forceduint8_t*> blocks;
+	for (int i = 0; i < 10; ++i) {
+		blocks.push_back(manager.allocate(40));
+	}
+	std::thread other([&]() {
+		manager.deallocate(blocks[0], 40);
+	});
+	other.join();
+
+	heapStatsSnapshot after = takeSnapshot(manager);
+	const sizeClassStats &c64 = after.classes[sizeToIndex(40)];
+	EXPECT_EQ(c64.blockSize, 64ul);
+	EXPECT_EQ(c64.allocations - before.classes[1].allocations, 10ul);
+	EXPECT_EQ(c64.deallocations - before.classes[1].deallocations, 1ul);
+	EXPECT_GT(after.freePagesCalls, before.freePagesCalls);
+	EXPECT_EQ(after.bumpBytes, pow2<16>);
+	size_t freeBytes = 0;
+	manager.forEachFreeBlock([&](void*, size_t blockSize, int) {
+		freeBytes += blockSize;
+	});
+	EXPECT_EQ(after.freeListBytes, freeBytes);
+	EXPECT_EQ(after.freeListBytes + 9 * 64, pow2<16>);
+
+	std::ostringstream text;
+	writePrometheus(text, after);
+	EXPECT_NE(text.str().find("infile_heap_allocations_total{size_class=\"64\"}"),
+			std::string::npos);
+	EXPECT_NE(text.str().find("# TYPE infile_heap_bump_bytes gauge\ninfile_heap_bump_bytes 65536\n"),
+			std::string::npos);
+
+	// pages handed out on a thread that did not allocate from the heap before count for it
+	uint64_t pages = takeSnapshot(manager, false).pagesHandedOut;
+	std::thread fresh([&]() {
+		manager.getFilehandler().getFreePages(1);
+	});
+	fresh.join();
+	EXPECT_EQ(takeSnapshot(manager, false).pagesHandedOut, pages + 1);
+
+	int pipeFds[2];
+	ASSERT_EQ(pipe(pipeFds), 0);
+	{
+		prometheusExporter exporter(manager, pipeFds[1],
+				std::chrono::milliseconds(1000));
+	}
+	close(pipeFds[1]);
+	char buffer[64] = { };
+	EXPECT_GT(read(pipeFds[0], buffer, sizeof(buffer) - 1), 0);
+	EXPECT_EQ(std::string(buffer).rfind("# HELP", 0), 0ul);
+	close(pipeFds[0]);
+}
+#endif
+
+TEST(checksums,crc32c) {
+	const char *text = "123456789";
+	EXPECT_EQ(crc32c::compute(text, 9), 0xe3069283u);
+	EXPECT_EQ(~crc32c::software(~0u, reinterpret_cast<const uint8_t*>(text), 9),
+			0xe3069283u);
+	std::vector<uint8_t> data(4 * 1000 + 3);
+	std::mt19937 rng(5);
+	for (auto &byte : data) {
+		byte = static_cast<uint8_t>(rng());
+	}
+	const uint8_t *buffers[5] = { data.data(), data.data() + 1000, data.data()
+			+ 2000, data.data() + 3000, data.data() + 4000 };
+	size_t lens[5] = { 1000, 1000, 1000, 1000, 3 };
+	uint32_t out[5];
+	crc32c::computeMany(buffers, lens, 5, out);
+	for (int i = 0; i < 5; ++i) {
+		EXPECT_EQ(out[i], ~crc32c::software(~0u, buffers[i], lens[i]));
+	}
+}
+
+#ifndef INFILEALLOCATOR_DEBUG_HEAP
+TEST(checksums,commitVerifyScrub) {
+	unlink("checksumTestFile.txt");
+	unlink("checksumTestFile.crc");
+	void *ptr = (void*) 0x600000000000;
+	size_t memsz = pow2<22>;
+	std::vector<Forceduint8_t*> blocks;
+	off_t corrupted;
+	{
+		autoFd fd("checksumTestFile.txt");
+		autoFd sidecar("checksumTestFile.crc");
+		FileMemoryManagerHandler handler(fd, ptr, memsz);
+		FileMemoryManager &manager = *handler.getManager();
+		heapChecksums checksums(handler, sidecar, 14);
+		for (size_t i = 0; i < 200; ++i) {
+			blocks.push_back(manager.allocate(1000 + i * 100));
+			memset(blocks.back(), static_cast<int>(i), 1000 + i * 100);
+		}
+		EXPECT_GT(checksums.commit(), 1ul);
+		EXPECT_TRUE(checksums.verifyAll().empty());
+
+		// the allocator marks its own writes, the application announces the others
+		for (size_t i = 0; i < 200; i += 2) {
+			manager.deallocate(blocks[i], 1000 + i * 100);
+		}
+		checksums.markDirty(blocks[1], 10);
+		memset(blocks[1], 0xff, 10);
+		EXPECT_TRUE(checksums.verifyAll().empty());
+		checksums.commit();
+		EXPECT_TRUE(checksums.verifyAll().empty());
+
+		// a write that did not go through the mapping
+		char junk = 0x5a;
+		corrupted = handler.getManager()->getFilehandler().fileOffset(blocks[151]);
+		ASSERT_EQ(pwrite(fd, &junk, 1, corrupted + 7), 1);
+		corrupted &= ~static_cast<off_t>(pow2<14> - 1);
+		EXPECT_EQ(checksums.verify(blocks[151], 1),
+				std::vector<off_t> { corrupted });
+		std::vector<off_t> all = checksums.verifyAll();
+		EXPECT_EQ(all, std::vector<off_t> { corrupted });
+
+		std::mutex mutex;
+		std::vector<off_t> found;
+		{
+			heapScrubber scrubber(checksums, [&](off_t offset) {
+				std::lock_guard<std::mutex> lock(mutex);
+				found.push_back(offset);
+			}, 0, std::chrono::milliseconds(1));
+			scrubber.waitForPasses(2);
+		}
+		ASSERT_GE(found.size(), 2ul);
+		EXPECT_EQ(found[0], corrupted);
+	}
+
+	// a reader checks against the sidecar, including the header
+	autoFd fd("checksumTestFile.txt");
+	autoFd sidecar("checksumTestFile.crc");
+	FileMemoryManagerHandler reader(fd, ptr, memsz,
+			FileMemoryManagerHandler::openMode::readOnly);
+	heapChecksums checksums(reader, sidecar, 14);
+	EXPECT_EQ(checksums.verifyAll(), std::vector<off_t> { corrupted });
+	EXPECT_THROW(checksums.commit(), std::runtime_error);
+	heapChecksums otherExtents(reader, sidecar, 16);
+	EXPECT_EQ(otherExtents.extentCount(), 0ul);
+}
+#endif
+
+#ifndef INFILEALLOCATOR_DEBUG_HEAP
+TEST(checksums,detachWhileMarking) {
+	unlink("checksumTestFile.txt");
+	unlink("checksumTestFile.crc");
+	autoFd fd("checksumTestFile.txt");
+	autoFd sidecar("checksumTestFile.crc");
+	FileMemoryManagerHandler handler(fd, (void*) 0x600000000000, pow2<22>);
+	MemoryFileHandler &fileHandler = handler.getManager()->getFilehandler();
+	Forceduint8_t *block = handler.getManager()->allocate(pow2<16>);
+
+	// the dirty bits of a tracker are freed while another thread still writes
+	std::atomic<bool> done { false };
+	std::thread writer([&] {
+		while (!done.load()) {
+			fileHandler.touchedRange(block, pow2<16>);
+		}
+	});
+	for (int i = 0; i < 200; ++i) {
+		heapChecksums checksums(handler, sidecar, 14);
+	}
+	done.store(true);
+	writer.join();
+	EXPECT_EQ(dirtyTracking::activeTrackers.load(), 0ul);
+}
+#endif
+
+#ifndef INFILEALLOCATOR_DEBUG_HEAP
+TEST(transactions,commitAbortRecover) {
+	unlink("txTestFile.txt");
+	unlink("txTestFile.log");
+	autoFd fd("txTestFile.txt");
+	autoFd logFd("txTestFile.log");
+	void *ptr = (void*) 0x600000000000;
+	FileMemoryManagerHandler handler(fd, ptr, pow2<22>);
+	FileMemoryManager &manager = *handler.getManager();
+	auto *slots = reinterpret_cast<uint64_t*>(manager.allocate(
+			2 * sizeof(uint64_t)));
+	uint64_t &counter = slots[0];
+	counter = 1;
+	auto logSize = [&]() {
+		struct stat st;
+		fstat(logFd, &st);
+		return st.st_size;
+	};
+
+	Forceduint8_t *node;
+	{
+		transactionLog log(handler, logFd);
+		EXPECT_EQ(log.recoveredTransactions(), 0ul);
+		transaction tx = log.begin();
+		node = tx.allocate(100);
+		memset(node, 7, 100);
+		tx.declare(&counter, sizeof(counter));
+		counter = 2;
+		EXPECT_GT(logSize(), 0);
+		tx.commit();
+		EXPECT_FALSE(tx.isActive());
+		EXPECT_EQ(counter, 2ul);
+		EXPECT_EQ(logSize(), 0);
+
+		// abort puts the old bytes back and frees the allocations
+		Forceduint8_t *block;
+		{
+			transaction aborted = log.begin();
+			aborted.declare(&counter, sizeof(counter));
+			counter = 3;
+			block = aborted.allocate(100);
+		}
+		EXPECT_EQ(counter, 2ul);
+		EXPECT_EQ(manager.allocate(100), block);
+		manager.deallocate(block, 100);
+
+		// frees wait for the commit
+		transaction freeing = log.begin();
+		freeing.deallocate(node, 100);
+		Forceduint8_t *other = manager.allocate(100);
+		EXPECT_NE(other, node);
+		manager.deallocate(other, 100);
+		freeing.commit();
+		EXPECT_EQ(manager.allocate(100), node);
+
+		// a process that dies inside a transaction
+		pid_t pid = fork();
+		ASSERT_NE(pid, -1);
+		if (pid == 0) {
+			transaction crashed = log.begin();
+			crashed.declare(&counter, sizeof(counter));
+			counter = 99;
+			slots[1] = reinterpret_cast<uint64_t>(crashed.allocate(5000));
+			_exit(0);
+		}
+		int status;
+		waitpid(pid, &status, 0);
+		EXPECT_EQ(counter, 99ul);
+	}
+	transactionLog log(handler, logFd);
+	EXPECT_EQ(log.recoveredTransactions(), 1ul);
+	EXPECT_EQ(log.unresolvedAllocations(), 0ul);
+	EXPECT_EQ(counter, 2ul);
+	EXPECT_EQ(logSize(), 0);
+	EXPECT_EQ(manager.allocate(5000), reinterpret_cast<Forceduint8_t*>(slots[1]));
+}
+#endif
+
+TEST(transactions,groupCommit) {
+	unlink("txTestFile.txt");
+	unlink("txTestFile.log");
+	autoFd fd("txTestFile.txt");
+	autoFd logFd("txTestFile.log");
+	void *ptr = (void*) 0x600000000000;
+	FileMemoryManagerHandler handler(fd, ptr, pow2<22>);
+	FileMemoryManager &manager = *handler.getManager();
+	std::mutex heapMutex;
+	constexpr size_t threadCount = 4;
+	constexpr size_t commits = 25;
+	auto *counters = reinterpret_cast<uint64_t*>(manager.allocate(
+			threadCount * sizeof(uint64_t)));
+	memset(counters, 0, threadCount * sizeof(uint64_t));
+
+	transactionLog log(handler, logFd, &heapMutex);
+	std::vector<std::thread> threads;
+	for (size_t t = 0; t < threadCount; ++t) {
+		threads.emplace_back([&, t]() {
+			for (size_t i = 0; i < commits; ++i) {
+				transaction tx = log.begin();
+				Forceduint8_t *block = tx.allocate(64);
+				memset(block, static_cast<int>(t), 64);
+				tx.declare(&counters[t], sizeof(uint64_t));
+				counters[t]++;
+				tx.deallocate(block, 64);
+				tx.commit();
+			}
+		});
+	}
+	for (auto &thread : threads) {
+		thread.join();
+	}
+	for (size_t t = 0; t < threadCount; ++t) {
+		EXPECT_EQ(counters[t], commits);
+	}
+	EXPECT_GE(log.flushCount(), 1ul);
+	EXPECT_LE(log.flushCount(), threadCount * commits);
+	struct stat st;
+	fstat(logFd, &st);
+	EXPECT_EQ(st.st_size, 0);
+}
+
+#ifndef INFILEALLOCATOR_DEBUG_HEAP
+TEST(trace,recordAndReplay) {
+	autoFd fd("testFile.txt");
+	ASSERT_NE(fd, -1);
+	void *ptr = (void*) 0x500000000000;
+	size_t memsz = 4096 * 32;
+	FileMemoryManagerHandler handler(fd, ptr, memsz);
+	FileMemoryManager &manager = *handler.getManager();
+	manager.reset();
+
+	std::vector<std::pair<Forceduint8_t*, size_t>> live;
+	{
+		traceRecorder recorder(&manager, "testTrace.bin");
+		std::mt19937 rng(7);
+		for (int i = 0; i < 400; ++i) {
+			if (!live.empty() && rng() % 3 == 0) {
+				size_t pick = rng() % live.size();
+				manager.deallocate(live[pick].first, live[pick].second);
+				live[pick] = live.back();
+				live.pop_back();
+			} else {
+				size_t size = 1 + rng() % 1024;
+				live.push_back( { manager.allocate(size), size });
+			}
+		}
+		EXPECT_EQ(recorder.getEventCount(), 400ul);
+	}
+	// not recorded any more
+	manager.deallocate(live.back().first, live.back().second);
+	live.pop_back();
+
+	std::vector<traceEvent> events = readTrace("testTrace.bin");
+	ASSERT_EQ(events.size(), 400ul);
+	EXPECT_TRUE(events[0].allocation);
+	EXPECT_EQ(events[0].offset, 0ul);
+
+	// the default policy models the heap, so it has to end up with the same file size
+	simulation::buddyPolicy current;
+	simulation::report r = simulation::replay(events, current);
+	EXPECT_EQ(r.peakFileBytes, manager.getFilehandler().size - pageSize);
+	EXPECT_GT(r.internalFragmentation, 0.0);
+	EXPECT_LT(r.internalFragmentation, 0.5);
+	uint64_t allocations = 0;
+	for (auto &c : r.classes) {
+		allocations += c.allocations;
+		EXPECT_LE(c.utilization(), 1.0);
+	}
+	EXPECT_EQ(allocations,
+			static_cast<uint64_t>(std::count_if(events.begin(), events.end(),
+					[](const traceEvent &e) {
+						return e.allocation;
+					})));
+
+	for (auto &p : simulation::defaultPolicies()) {
+		simulation::report other = simulation::replay(events, *p);
+		EXPECT_GE(other.peakFileBytes, other.peakRequestedBytes);
+	}
+	for (auto &l : live) {
+		manager.deallocate(l.first, l.second);
+	}
+	unlink("testTrace.bin");
+}
+#endif
+
+TEST(btree,insertFindErase) {
+	autoFd fd("btreeTestFile.txt");
+	ASSERT_NE(fd, -1);
+	void *ptr = (void*) 0x500000000000;
+	size_t memsz = 4096 * 1024;
+	FileMemoryManagerHandler handler(fd, ptr, memsz);
+	FileMemoryManager &manager = *handler.getManager();
+	manager.reset();
+
+	// small nodes, so the tree gets a few levels
+	fileBTree<uint64_t, uint64_t, 256> tree(&manager);
+	std::map<uint64_t, uint64_t> expected;
+	std::mt19937_64 rng(8);
+	for (int i = 0; i < 20000; ++i) {
+		// keys with the top bit set check the unsigned compare
+		uint64_t key = rng() % 30000 + (i % 2 ? 0 : 1ul << 63);
+		bool inserted = expected.emplace(key, i).second;
+		ASSERT_EQ(tree.insert(key, i), inserted);
+	}
+	EXPECT_EQ(tree.size(), expected.size());
+	EXPECT_GE(tree.getHeight(), 3ul);
+	for (uint64_t key = 0; key < 30000; key += 7) {
+		auto it = expected.find(key);
+		uint64_t *value = tree.find(key);
+		ASSERT_EQ(value != nullptr, it != expected.end());
+		if (value) {
+			EXPECT_EQ(*value, it->second);
+		}
+	}
+	for (uint64_t key = 0; key < 30000; key += 3) {
+		EXPECT_EQ(tree.erase(key), expected.erase(key) == 1);
+	}
+	EXPECT_EQ(tree.size(), expected.size());
+
+	auto expectedIt = expected.lower_bound(1000);
+	size_t visited = tree.scan(1000, 5000, [&](uint64_t key, uint64_t value) {
+		ASSERT_EQ(key, expectedIt->first);
+		ASSERT_EQ(value, expectedIt->second);
+		++expectedIt;
+	});
+	EXPECT_EQ(expectedIt, expected.lower_bound(5000));
+	EXPECT_GT(visited, 0ul);
+
+	size_t all = 0;
+	uint64_t last = 0;
+	for (auto it = tree.begin(); it != tree.end(); ++it) {
+		EXPECT_TRUE(all == 0 || last < it.key());
+		last = it.key();
+		all++;
+	}
+	EXPECT_EQ(all, expected.size());
+	tree.clear();
+#ifdef INFILEALLOCATOR_DEBUG_HEAP
+	manager.flushQuarantine();
+#endif
+	size_t freeBytes = 0;
+	manager.forEachFreeBlock([&](void*, size_t blockSize, int) {
+		freeBytes += blockSize;
+	});
+	// everything but the free map table is free again
+	EXPECT_EQ(freeBytes + manager.getFilehandler().freeMapBytes,
+			manager.getFilehandler().size - pageSize);
+}
+
+TEST(btree,bulkLoad) {
+	autoFd fd("btreeTestFile.txt");
+	ASSERT_NE(fd, -1);
+	void *ptr = (void*) 0x500000000000;
+	size_t memsz = 4096 * 1024;
+	FileMemoryManagerHandler handler(fd, ptr, memsz);
+	FileMemoryManager &manager = *handler.getManager();
+	manager.reset();
+
+	std::vector<std::pair<int32_t, double>> sorted;
+	for (int32_t i = -100000; i < 100000; i += 2) {
+		sorted.push_back( { i, i * 0.5 });
+	}
+	auto &tree = *new (manager.allocate(sizeof(fileBTree<int32_t, double>))) fileBTree<
+			int32_t, double>(&manager);
+	tree.bulkLoad(sorted.begin(), sorted.end(), 0.9);
+	EXPECT_EQ(tree.size(), sorted.size());
+	// 100000 keys at 306 per leaf fit below one root with 341 children
+	EXPECT_EQ(tree.getHeight(), 2ul);
+	EXPECT_THROW(tree.bulkLoad(sorted.begin(), sorted.end()), std::runtime_error);
+
+	ASSERT_NE(tree.find(-100000), nullptr);
+	EXPECT_EQ(*tree.find(-100000), -50000.0);
+	EXPECT_EQ(tree.find(-99999), nullptr);
+	EXPECT_EQ(*tree.find(99998), 49999.0);
+	EXPECT_EQ(tree.find(100000), nullptr);
+
+	// inserts into the gaps left by fill
+	for (int32_t i = -99999; i < 100000; i += 200) {
+		EXPECT_TRUE(tree.insert(i, 1.0));
+	}
+	size_t visited = tree.scan(-10, 10, [](int32_t, double) {
+	}, true);
+	// ten even keys and the inserted 1
+	EXPECT_EQ(visited, 11ul);
+	int32_t previous = std::numeric_limits<int32_t>::min();
+	size_t all = 0;
+	for (auto it = tree.begin(); it != tree.end(); ++it) {
+		EXPECT_LT(previous, it.key());
+		previous = it.key();
+		all++;
+	}
+	EXPECT_EQ(all, tree.size());
+	tree.~fileBTree();
+}
+
+TEST(log,appendTailTrim) {
+	autoFd fd("logTestFile.txt");
+	ASSERT_NE(fd, -1);
+	void *ptr = (void*) 0x500000000000;
+	size_t memsz = 4096 * 1024;
+	FileMemoryManagerHandler handler(fd, ptr, memsz);
+	FileMemoryManager &manager = *handler.getManager();
+	manager.reset();
+	std::mutex heapMutex;
+
+	using logT = fileLog<uint64_t, 4096>;
+	logT &log = *new (manager.allocate(sizeof(logT))) logT(&manager, &heapMutex);
+	const uint64_t perSegment = logT::entriesPerSegment();
+	const uint64_t perThread = 20000;
+	const int threads = 4;
+
+	{
+		logT::reader tailReader = log.openReader();
+		std::vector<uint64_t> lastSeen(threads, 0);
+		uint64_t seen = 0;
+		auto check = [&](uint64_t index, uint64_t value) {
+			ASSERT_EQ(index, seen);
+			uint64_t thread = value >> 32;
+			uint64_t n = value & 0xffffffff;
+			// each producer's entries show up in its own order
+			ASSERT_EQ(n, lastSeen[thread]);
+			lastSeen[thread]++;
+			seen++;
+		};
+
+		std::atomic<bool> done { false };
+		size_t freed = 0;
+		std::thread consumer([&]() {
+			while (!done.load()) {
+				if (tailReader.poll(check) == 0) {
+					std::this_thread::yield();
+				}
+				freed += log.trimBefore(tailReader.position());
+			}
+			tailReader.poll(check);
+			// the second call frees what the first one unlinked
+			freed += log.trimBefore(tailReader.position());
+			freed += log.trimBefore(tailReader.position());
+		});
+		std::vector<std::thread> producers;
+		for (int t = 0; t < threads; ++t) {
+			producers.emplace_back([&, t]() {
+				for (uint64_t n = 0; n < perThread; ++n) {
+					log.append(static_cast<uint64_t>(t) << 32 | n);
+				}
+			});
+	}
+	for (auto &p : producers) {
+		p.join();
+	}
+	done.store(true);
+	consumer.join();
+
+	EXPECT_EQ(seen, threads * perThread);
+	EXPECT_EQ(log.end(), threads * perThread);
+	EXPECT_GT(freed, 0ul);
+	EXPECT_EQ(freed % 4096, 0ul);
+	EXPECT_EQ(log.begin() % perSegment, 0ul);
+	EXPECT_EQ(log.size(), log.end() - log.begin());
+
+	// a new reader starts at the head, nothing before it can be read anymore
+	logT::reader late = log.openReader(0);
+	EXPECT_EQ(late.position(), log.begin());
+	uint64_t first = 0;
+	late.poll([&](uint64_t index, uint64_t) {
+		if (first == 0) {
+			first = index;
+		}
+	}, 1);
+	EXPECT_EQ(first, log.begin());
+
+	// the late reader holds its segment
+	size_t before = log.begin();
+	log.trimBefore(log.end());
+	EXPECT_EQ(log.begin(), before);
+	}
+
+	log.~logT();
+	manager.deallocate(&log, sizeof(logT));
+#ifdef INFILEALLOCATOR_DEBUG_HEAP
+	manager.flushQuarantine();
+#endif
+	size_t freeBytes = 0;
+	manager.forEachFreeBlock([&](void*, size_t blockSize, int) {
+		freeBytes += blockSize;
+	});
+	EXPECT_EQ(freeBytes + manager.getFilehandler().freeMapBytes,
+			manager.getFilehandler().size - pageSize);
+}
+
 }